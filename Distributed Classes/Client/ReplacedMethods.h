@@ -22,6 +22,13 @@
 -(const char*)storedClassName;
 @end
 
+@interface ClassDescription : NSObject
+-(ClassRepresentation*)classRepresentation;
+-(NSString*)describedClassName;
+-(NSArray*)superclassNames;
+-(unsigned int)classGeneration;
+@end
+
 @interface MethodProxy : NSObject
 -(const char*)typeEncoding;
 -(unsigned int)getNumberOfArguments;
@@ -34,6 +41,7 @@
 
 @interface VendedObject : NSObject
 -(ClassRepresentation*)objc_getClass:(const char*)name;
+-(bycopy ClassDescription*)objc_getClassDescription:(const char*)name;
 -(ClassRepresentation*)object_getClass:(id)object;
 -(MethodProxy*)class_getInstanceMethod:(ClassRepresentation*)class andSelector:(SEL)selector;
 -(MethodProxy*)class_getClassMethod:(ClassRepresentation*)class andSelector:(SEL)selector;
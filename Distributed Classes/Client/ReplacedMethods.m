@@ -24,6 +24,8 @@
 #import "DCNSDistantObject.h"
 #import "DCNSPortNameServer.h"
 #import "DCNSBasicAuthentication.h"
+#import "DCNSConnection-NSPrivate.h"
+#import "DCNSPrivate.h"
 #include <objc/message.h>
 #include "fishhook.h"
 
@@ -41,6 +43,7 @@ struct objc_method {
 @protocol VendedObjectProtocol <NSObject>
 @required
 -(ClassRepresentation*)objc_getClass:(const char*)name;
+-(bycopy ClassDescription*)objc_getClassDescription:(const char*)name;
 -(ClassRepresentation*)object_getClass:(id)object;
 -(MethodProxy*)class_getInstanceMethod:(ClassRepresentation*)class andSelector:(SEL)selector;
 -(MethodProxy*)class_getClassMethod:(ClassRepresentation*)class andSelector:(SEL)selector;
@@ -50,6 +53,17 @@ struct objc_method {
 #pragma mark Static variables
 
 static Class distantObjectClass;
+static Class methodProxyClass;
+
+// Classes already looked up on the server by name, or kCFNull if it has none; see remoteClassNamed()
+static NSLock *remoteClassesLock;
+static CFMutableDictionaryRef remoteClasses;
+static unsigned int remoteClassGeneration;
+static NSTimeInterval remoteClassGenerationChecked;	// when the server last told us its generation
+
+// Methods already looked up for a remote class, see lookUpRemoteMethod()
+static NSLock *remoteMethodsLock;
+static CFMutableDictionaryRef remoteMethods;
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark Function definitions
@@ -101,13 +115,110 @@ static void (*orig_method_getReturnType)(Method meth, char *dst, size_t dst_len)
  objc_copyClassList(unsigned int *outCount)
  */
 
+/*
+ * Asking for a description of the class gets us the proxy for it along with the signatures of all its methods,
+ * which are cached by DCNSDistantObject. Messaging the class or its instances then needs no further round trips
+ * to find out what their methods look like.
+ *
+ * Each class is only asked for once. Frameworks often probe for classes that don't exist anywhere, so the server
+ * saying it has no such class is remembered as well, until the server's class generation changes (when it loads
+ * more code) or we connect again.
+ *
+ * We only learn the generation along with a description, so if nothing else has been looked up for a while, a class
+ * remembered as missing is asked for again rather than trusted. That costs about one round trip per interval.
+ */
+
+#define MISSING_CLASS_RECHECK_INTERVAL 5.0
+
+static const void *remoteClassNameRetain(CFAllocatorRef allocator, const void *value) {
+    return strdup(value);
+}
+
+static void remoteClassNameRelease(CFAllocatorRef allocator, const void *value) {
+    free((void *)value);
+}
+
+static Boolean remoteClassNameEqual(const void *a, const void *b) {
+    return strcmp(a, b) == 0;
+}
+
+static CFHashCode remoteClassNameHash(const void *value) {
+    // FNV-1a
+    const unsigned char *name = value;
+    CFHashCode hash = 2166136261U;
+    while (*name)
+        hash = (hash ^ *name++) * 16777619U;
+    return hash;
+}
+
+static void collectMissingRemoteClass(const void *key, const void *value, void *context) {
+    if (value == kCFNull)
+        CFArrayAppendValue((CFMutableArrayRef)context, key);
+}
+
+static void forgetMissingRemoteClasses(void) {
+    // Must hold remoteClassesLock.
+    CFMutableArrayRef names = CFArrayCreateMutable(NULL, 0, NULL);
+    CFIndex i;
+    
+    CFDictionaryApplyFunction(remoteClasses, collectMissingRemoteClass, names);
+    for (i = 0; i < CFArrayGetCount(names); i++)
+        CFDictionaryRemoveValue(remoteClasses, CFArrayGetValueAtIndex(names, i));	// the name is freed here
+    
+    CFRelease(names);
+}
+
+static void noteRemoteClassGeneration(unsigned int generation) {
+    // Must hold remoteClassesLock.
+    if (generation != remoteClassGeneration) {
+        forgetMissingRemoteClasses();
+        remoteClassGeneration = generation;
+    }
+    remoteClassGenerationChecked = [NSDate timeIntervalSinceReferenceDate];
+}
+
+static id remoteClassNamed(const char *name) {
+    id result;
+    BOOL recheck;
+    
+    [remoteClassesLock lock];
+    result = (id)CFDictionaryGetValue(remoteClasses, name);
+    recheck = (result == (id)kCFNull && [NSDate timeIntervalSinceReferenceDate] - remoteClassGenerationChecked >= MISSING_CLASS_RECHECK_INTERVAL);
+    [remoteClassesLock unlock];
+    
+    if (result && !recheck)
+        return result == (id)kCFNull ? nil : result;
+    
+    if ([remoteConnection _peerWireFeatures] & DCNS_WIRE_FEATURE_CLASS_DESCRIPTIONS) {
+        ClassDescription *description = [remoteProxy objc_getClassDescription:name];
+        result = [description classRepresentation];
+        
+        [remoteClassesLock lock];
+        noteRemoteClassGeneration([description classGeneration]);
+        CFDictionarySetValue(remoteClasses, name, result ? result : (id)kCFNull);
+        [remoteClassesLock unlock];
+    } else {
+        // An older server, which can't tell us it doesn't have a class.
+        result = [remoteProxy objc_getClass:name];
+        
+        if (result) {
+            [remoteClassesLock lock];
+            CFDictionarySetValue(remoteClasses, name, result);
+            [remoteClassesLock unlock];
+        }
+    }
+    
+    // The runtime's callers expect classes to live forever, even past us forgetting them.
+    return [result retain];
+}
+
 Class new_objc_getClass(const char* name) {
     id result = orig_objc_getClass(name);
     
     // Runtime didn't find class, see if we can
     // get a proxy for it.
     if (!result)
-        result = [remoteProxy objc_getClass:name];
+        result = remoteClassNamed(name);
     
     return result;
 }
@@ -150,11 +261,70 @@ Class new_object_getClass(id object) {
  BOOL class_conformsToProtocol(Class cls, Protocol *protocol)
  */
 
+/*
+ * Remote methods don't change, and the server sends them as a snapshot that answers questions about the method
+ * locally (older servers send a proxy, which doesn't). Either way, each is only asked for once per class and
+ * selector; a method the class doesn't have is remembered too. Class proxies can go away once nothing uses them, and
+ * another take their address, so each key holds on to its class. The runtime's callers expect a Method to live
+ * forever, so those we hand out are never freed, even after we forget them on connecting again.
+ */
+
+typedef struct {
+    Class aClass;
+    SEL selector;
+    BOOL isInstance;
+} RemoteMethodKey;
+
+static const void *remoteMethodKeyRetain(CFAllocatorRef allocator, const void *value) {
+    RemoteMethodKey *copy = malloc(sizeof(RemoteMethodKey));
+    
+    *copy = *(const RemoteMethodKey *)value;
+    [copy->aClass retain];
+    return copy;
+}
+
+static void remoteMethodKeyRelease(CFAllocatorRef allocator, const void *value) {
+    [((const RemoteMethodKey *)value)->aClass release];
+    free((void *)value);
+}
+
+static Boolean remoteMethodKeyEqual(const void *a, const void *b) {
+    const RemoteMethodKey *x = a, *y = b;
+    return x->aClass == y->aClass && x->selector == y->selector && x->isInstance == y->isInstance;
+}
+
+static CFHashCode remoteMethodKeyHash(const void *value) {
+    const RemoteMethodKey *key = value;
+    return (CFHashCode)(uintptr_t)key->aClass ^ (CFHashCode)(uintptr_t)key->selector ^ key->isInstance;
+}
+
+static Method lookUpRemoteMethod(Class aClass, SEL aSelector, BOOL isInstance) {
+    RemoteMethodKey key = { aClass, aSelector, isInstance };
+    id method;
+    
+    [remoteMethodsLock lock];
+    method = (id)CFDictionaryGetValue(remoteMethods, &key);
+    [remoteMethodsLock unlock];
+    
+    if (method)
+        return method == (id)kCFNull ? NULL : (Method)method;
+    
+    // Create a custom method to satisfy what the output should be. aClass == class proxy.
+    if (isInstance)
+        method = [remoteProxy class_getInstanceMethod:(ClassRepresentation*)aClass andSelector:aSelector];
+    else
+        method = [remoteProxy class_getClassMethod:(ClassRepresentation*)aClass andSelector:aSelector];
+    
+    [remoteMethodsLock lock];
+    CFDictionarySetValue(remoteMethods, &key, method ? method : (id)kCFNull);
+    [remoteMethodsLock unlock];
+    
+    return (Method)[method retain];
+}
+
 Method new_class_getInstanceMethod(Class aClass, SEL aSelector) {
     if (orig_object_getClass(aClass) == distantObjectClass) {
-        // Create a custom method to satisfy what the output should be. aClass == class proxy.
-        MethodProxy *newMethod = [remoteProxy class_getInstanceMethod:(ClassRepresentation*)aClass andSelector:aSelector];
-        return (Method)newMethod;
+        return lookUpRemoteMethod(aClass, aSelector, YES);
     } else {
         return orig_class_getInstanceMethod(aClass, aSelector);
     }
@@ -162,9 +332,7 @@ Method new_class_getInstanceMethod(Class aClass, SEL aSelector) {
 
 Method new_class_getClassMethod(Class aClass, SEL aSelector) {
     if (orig_object_getClass(aClass) == distantObjectClass) {
-        // Create a custom method to satisfy what the output should be.
-        MethodProxy *newMethod = [remoteProxy class_getClassMethod:(ClassRepresentation*)aClass andSelector:aSelector];
-        return (Method)newMethod;
+        return lookUpRemoteMethod(aClass, aSelector, NO);
     } else {
         return orig_class_getClassMethod(aClass, aSelector);
     }
@@ -174,14 +342,14 @@ Method new_class_getClassMethod(Class aClass, SEL aSelector) {
 #pragma mark Method functions
 
 BOOL isMethodProxy(Method test) {
-    // MethodProxy is an object, Method is a struct
+    // MethodProxy is an object, Method is a struct; it's either a snapshot or a proxy for one on the server
     struct objc_object *object = (struct objc_object*)test;
     if (object != (void*)0x0) {
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wdeprecated-declarations"
         Class class = object->isa;
 #pragma cland diagnostic pop
-        return class == distantObjectClass;
+        return class == distantObjectClass || class == methodProxyClass;
         //return YES;
     } else {
         return NO;
@@ -327,6 +495,28 @@ int dcns_common_configure(DCNSConnection *connection, id<DCNSConnectionDelegate>
     [(DCNSDistantObject*)remoteProxy setProtocolForProxy:@protocol(VendedObjectProtocol)];
     
     distantObjectClass = [DCNSDistantObject class];
+    methodProxyClass = [MethodProxy class];
+    
+    if (!remoteMethodsLock) {
+        CFDictionaryKeyCallBacks classCallbacks = { 0, remoteClassNameRetain, remoteClassNameRelease, NULL, remoteClassNameEqual, remoteClassNameHash };
+        CFDictionaryKeyCallBacks methodCallbacks = { 0, remoteMethodKeyRetain, remoteMethodKeyRelease, NULL, remoteMethodKeyEqual, remoteMethodKeyHash };
+        
+        remoteClassesLock = [[NSLock alloc] init];
+        remoteClasses = CFDictionaryCreateMutable(NULL, 0, &classCallbacks, &kCFTypeDictionaryValueCallBacks);
+        remoteMethodsLock = [[NSLock alloc] init];
+        remoteMethods = CFDictionaryCreateMutable(NULL, 0, &methodCallbacks, &kCFTypeDictionaryValueCallBacks);
+    }
+    
+    // Anything looked up on a previous connection is of no use on this one.
+    [remoteClassesLock lock];
+    CFDictionaryRemoveAllValues(remoteClasses);
+    remoteClassGeneration = 0;
+    remoteClassGenerationChecked = 0;
+    [remoteClassesLock unlock];
+    
+    [remoteMethodsLock lock];
+    CFDictionaryRemoveAllValues(remoteMethods);
+    [remoteMethodsLock unlock];
     
     // Rebind symbols using fishhook.
     rebind_symbols((struct rebinding[12]){
@@ -36,6 +36,14 @@
  */
 - (DCNSDistantObject *)_getLocalByRemote:(id)remote;
 
+/**
+ Guards the tables of local and remote proxies.
+ @discussion The methods here that use those tables expect it to be held. A proxy's last release is made
+ under it, so a proxy found while holding it may be retained.
+ @return The lock
+ */
+- (NSLock *)_proxiesLock;
+
 // Not documented.
 - (void) _addLocalDistantObject:(DCNSDistantObject *) obj forLocal:(id) target andRemote:(id) remote;
 - (void) _removeLocalDistantObjectForLocal:(id) target andRemote:(id) remote;
@@ -43,4 +51,83 @@
 - (void) _addRemoteDistantObject:(DCNSDistantObject *) obj forRemote:(id) target;
 - (void) _removeRemoteDistantObjectForRemote:(id) target;
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Private methods to query the remote
+
+/**
+ Gives the optional parts of the protocol that the remote supports, as agreed during -rootProxy.
+ @return A mask of DCNS_WIRE_FEATURE_* values
+ */
+- (unsigned int)_peerWireFeatures;
+
+/**
+ Gives the number the remote knows one of our classes by, for sharing method signatures between proxies.
+ @discussion Numbers are handed out in turn on each connection as classes are first sent, so they say nothing
+ about where the classes are in memory.
+ @param cls The class
+ @return The number, never 0
+ */
+- (unsigned long long)_numberForProxyClass:(Class)cls;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Private methods for distributed reference counting
+
+/**
+ Queues a notice to the remote that our proxy for one of its objects has gone away.
+ @discussion Does nothing if the connection has been invalidated, or the remote doesn't understand such notices.
+ @param ref The reference number of the remote object
+ @param count The number of times the remote sent us the reference
+ @param connection The connection the proxy was for, which may no longer exist
+ */
++ (void)_queueReleaseOfReference:(unsigned int)ref wireCount:(unsigned int)count connection:(DCNSConnection *)connection;
+
+/**
+ Called by the remote with a batch of references its proxies no longer need.
+ @param references Pairs of little-endian 32-bit reference numbers and wire counts
+ */
+- (oneway void)_releaseWireReferences:(bycopy NSData *)references;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Private methods for cached results
+
+/**
+ Gives a result cached by a proxy on this connection.
+ @param key The reference number of the remote object, followed by the selector and arguments
+ @return The result, or nil if there is none
+ */
+- (id)_cachedResultForKey:(NSArray *)key;
+
+/**
+ Gives a number to pass to -_cacheResult:cost:forKey:generation: for a request about to be sent.
+ @return The current generation of the cache
+ */
+- (unsigned int)_resultCacheGeneration;
+
+/**
+ Caches the result of a request, unless the remote may have invalidated it since the request was sent.
+ @param value The result
+ @param cost The approximate size of the result and key, in bytes
+ @param key The reference number of the remote object, followed by the selector and arguments
+ @param generation The generation of the cache from before the request was sent
+ */
+- (void)_cacheResult:(id)value cost:(NSUInteger)cost forKey:(NSArray *)key generation:(unsigned int)generation;
+
+/**
+ Forgets every result cached for a remote object.
+ @param ref The reference number of the remote object
+ */
+- (void)_removeCachedResultsForReference:(unsigned int)ref;
+
+/**
+ Tells the remote that results it has cached from one of our objects may have changed.
+ @param ref The reference number the remote knows the object by
+ */
+- (void)_sendInvalidationOfReference:(unsigned int)ref;
+
+/**
+ Called by the remote when results cached from one of its objects may have changed.
+ @param ref The reference number of the remote object
+ */
+- (oneway void)_invalidateCachedResultsForReference:(unsigned int)ref;
+
 @end
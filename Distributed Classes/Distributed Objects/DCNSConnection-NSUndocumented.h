@@ -30,6 +30,7 @@
 // These methods exist in Cocoa, but are not documented.
 
 + (DCNSConnection *) lookUpConnectionWithReceivePort:(NSPort *) receivePort sendPort:(NSPort *) sendPort;
++ (DCNSConnection *) lookUpConnectionWithReceivePort:(NSPort *) receivePort sendPort:(NSPort *) sendPort channel:(unsigned int) channel; // not in Cocoa
 - (void) _portInvalidated:(NSNotification *) n;
 - (id) newConversation;
 - (DCNSPortCoder *) portCoderWithComponents:(NSArray *) components;
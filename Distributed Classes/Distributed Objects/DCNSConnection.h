@@ -32,20 +32,28 @@
 #import <Foundation/NSTimer.h>
 #import <Foundation/NSPort.h>
 
+#import <CoreFoundation/CoreFoundation.h>
+
 #import "DCNSDistantObjectRequest.h"
 #import "DCNSConnection-Delegate.h"
 
 @class NSData;
+@class NSMutableData;
 @class NSMapTable;
 @class NSHashTable;
+@class NSCondition;
+@class NSLock;
 @class NSDictionary;
 @class NSMutableArray;
+@class NSMutableDictionary;
 @class NSString;
 @class NSException;
 @class NSRunLoop;
 @class DCNSDistantObject;
 @class NSInvocation;
 @class DCNSPortCoder;
+@class DCNSNameTable;
+@class DCNSNameCache;
 @class DCNSAbstractError;
 @class NSPortNameServer;
 
@@ -54,6 +62,9 @@ extern NSString *const DCNSConnectionRepliesReceived;
 extern NSString *const DCNSConnectionRepliesSent;
 extern NSString *const DCNSConnectionRequestsReceived;
 extern NSString *const DCNSConnectionRequestsSent;
+extern NSString *const DCNSConnectionOutboundQueueDepth;
+extern NSString *const DCNSConnectionOutboundQueueBytes;
+extern NSString *const DCNSConnectionStallTime;
 
 // NSRunLoop modes, NSNotification names and NSException strings.
 
@@ -62,6 +73,16 @@ extern NSString *const DCNSConnectionDidInitializeNotification;
 extern NSString *const DCNSFailedAuthenticationException;
 extern NSString *const DCNSInvalidPortNameServerException;
 extern NSString *const DCNSTransmissionException;
+extern NSString *const DCNSFlowControlException;
+
+/**
+ What a connection does with an outgoing message when the remote's receive window is full.
+ */
+typedef NS_ENUM(NSInteger, DCNSFlowControlPolicy) {
+    DCNSFlowControlPolicyBlock,     // wait for the remote to acknowledge data, up to the transmission timeout
+    DCNSFlowControlPolicyFailFast,  // raise DCNSFlowControlException straight away
+    DCNSFlowControlPolicyQueue      // hold the message locally until there is room, up to outboundQueueBudget
+};
 
 @interface DCNSConnection : NSObject <NSPortDelegate> {
 	id _rootObject;						// the root object to vend
@@ -71,11 +92,57 @@ extern NSString *const DCNSTransmissionException;
 	NSMapTable *_responses;				// unprocessed responses of DCNSPortCoder* indexed by sequence number
     id _currentConversation;            // used as a check whether the current response should be queued when sending
 	unsigned int _localProxyCount;      // the count of DCNSDistantObjects that map to a local object
+	NSLock *_proxiesLock;               // guards the tables of proxies below, and the count above
 	unsigned int _repliesReceived;      // the count of replies received by this connection
 	unsigned int _repliesSent;          // the count of replies sent by this connection
 	unsigned int _requestsReceived;     // the count of requests received by this connection
 	unsigned int _requestsSent;         // the count of requests sent by this connection
 	BOOL _isValid;                      // whether the current connection has a valid route to the remote
+    unsigned int _sequence;             // the sequence number of the last request sent
+    unsigned int _channel;              // tells us apart from other connections sharing our ports
+    unsigned int _peerWireFeatures;     // the optional parts of the protocol the remote supports
+    DCNSNameTable *_outgoingNames;      // class names and selectors we have interned for the remote
+    DCNSNameTable *_incomingNames;      // class names and selectors the remote has interned for us
+    DCNSNameCache *_decodedNames;       // class names and selectors decoded so far, by their bytes
+    NSMapTable *_proxyClassNumbers;     // the numbers the remote knows our proxies' classes by, by class
+    unsigned int _lastProxyClassNumber; // the last of them handed out
+    NSLock *_proxyClassesLock;          // guards the two above
+    
+    // Flow control.
+    unsigned int _peerWindowMessages;   // how many un-acknowledged messages the remote will accept (0 if unknown)
+    unsigned int _peerWindowBytes;      // how many un-acknowledged bytes the remote will accept (0 if unknown)
+    unsigned int _outstandingMessages;  // messages sent but not yet acknowledged
+    NSUInteger _outstandingBytes;       // bytes sent but not yet acknowledged
+    NSMapTable *_creditsBySequence;     // bytes charged against the window, indexed by sequence number
+    NSMutableArray *_outboundQueue;     // messages waiting for room in the window
+    NSUInteger _outboundQueueBytes;     // the size of the messages waiting in _outboundQueue
+    NSTimeInterval _stallTime;          // total time spent waiting for room in the window
+    BOOL _advertisedReceiveWindow;      // whether the remote has been told our window, and so must keep to it
+    unsigned int _unansweredMessages;   // requests received from the remote but not yet answered
+    NSUInteger _unansweredBytes;        // the size of the requests in _unansweredMessages
+    NSMapTable *_unansweredBySequence;  // the size of each unanswered request, indexed by sequence number
+    NSCondition *_creditCondition;      // guards all of the above
+    
+    // Heartbeats.
+    CFRunLoopRef _timerRunLoop;         // the runloop of the thread that runs our Ack and heartbeat timers
+    CFRunLoopTimerRef _heartbeatTimer;  // sends heartbeats and checks for those from the remote
+    NSTimeInterval _lastReceiveTime;    // when anything was last received from the remote
+    BOOL _peerSendsHeartbeats;          // whether the remote has sent us a heartbeat yet
+    BOOL _peerFellSilent;               // whether we were invalidated for not hearing from the remote
+    volatile int32_t _requestsInProgress; // requests from the remote being handled right now
+    volatile NSTimeInterval _lastRequestFinished; // when the last of them was done with
+    
+    // Distributed reference counting.
+    NSMutableData *_pendingReleases;    // references to tell the remote we no longer need, with their wire counts
+    CFRunLoopTimerRef _releaseTimer;    // sends whatever notices have been held back
+    
+    // Cached results of remote methods.
+    NSLock *_resultCacheLock;           // guards all of the below
+    CFMutableDictionaryRef _resultCache; // results and their cost, by reference number, selector and arguments
+    CFMutableDictionaryRef _resultCacheByReference; // the first of each remote object's results, by reference number
+    struct DCNSCachedResult *_newestCachedResult, *_oldestCachedResult; // in the order they were last used
+    NSUInteger _resultCacheCost;        // the approximate size of everything in _resultCache
+    unsigned int _resultCacheGeneration; // changed by every invalidation from the remote
     
     // mclarke :: Security extensions.
     char *_sessionKey;                  // the current 256-bit key used for security
@@ -95,6 +162,14 @@ extern NSString *const DCNSTransmissionException;
  */
 @property (nonatomic, retain) NSPort *sendPort;
 
+/**
+ The channel this connection uses on its ports.
+ @discussion When a client connects to a remote endpoint (the same address and port) it already has a connection to,
+ it shares the receive port of that connection on a new channel, as long as the remote supports channels. Connections
+ to different services, even on the same host, are to different endpoints, and so still have a socket each.
+ */
+@property (nonatomic, readonly) unsigned int channel;
+
 /**
  Used to provide security callbacks to the user.
  @discussion Note that the delegate is retained.
@@ -145,6 +220,60 @@ extern NSString *const DCNSTransmissionException;
  */
 @property (nonatomic, readwrite) NSTimeInterval transmissionTimeout;
 
+/** @name Failure Detection */
+
+/**
+ The interval at which a heartbeat is sent to the remote. Pass 0 to disable heartbeats.
+ @discussion Defaults to 1 second.
+ */
+@property (nonatomic, readwrite) NSTimeInterval heartbeatInterval;
+
+/**
+ The number of heartbeat intervals that may pass without hearing from the remote before the connection is
+ invalidated. Pass 0 to never invalidate.
+ @discussion This only applies once the remote has sent a heartbeat itself, so peers that don't send them are
+ never timed out. Defaults to 3.
+ */
+@property (nonatomic, readwrite) unsigned int heartbeatMissLimit;
+
+/** @name Flow Control */
+
+/**
+ The number of un-acknowledged messages this connection will accept from the remote.
+ @discussion This is advertised to the remote when the connection is established, and a remote that sends more
+ unanswered requests than this is invalidated. Defaults to 64.
+ */
+@property (nonatomic, readwrite) unsigned int receiveWindowMessages;
+
+/**
+ The number of un-acknowledged bytes this connection will accept from the remote.
+ @discussion This is advertised to the remote when the connection is established, and a remote that sends more
+ than this in unanswered requests is invalidated. Defaults to 4MB.
+ */
+@property (nonatomic, readwrite) unsigned int receiveWindowBytes;
+
+/**
+ What to do with a request when the remote's receive window is full. Defaults to DCNSFlowControlPolicyBlock.
+ @discussion Replies are never held back, since the remote gets its credit for a request back from the reply.
+ Flow control only applies when acksEnabled is set.
+ */
+@property (nonatomic, readwrite) DCNSFlowControlPolicy flowControlPolicy;
+
+/**
+ The number of bytes that may be held in the outbound queue before DCNSFlowControlException is raised.
+ Defaults to 8MB.
+ */
+@property (nonatomic, readwrite) NSUInteger outboundQueueBudget;
+
+/** @name Caching Results */
+
+/**
+ The approximate number of bytes the results of remote methods cached by proxies on this connection may take up.
+ Once it is reached, the oldest results are forgotten first. Pass 0 to cache nothing.
+ @discussion See -[DCNSDistantObject dc_cacheResultsForSelector:]. Defaults to 1MB.
+ */
+@property (nonatomic, readwrite) NSUInteger resultCacheBudget;
+
 /**
  This is called whenever an error occurs during the system's operation. 
  @discussion Note that this is treated as a global error handler, and won't have as much context compared to 
@@ -274,6 +403,17 @@ extern NSString *const DCNSTransmissionException;
  */
 - (instancetype)initWithReceivePort:(NSPort *) receivePort sendPort:(NSPort *) sendPort;
 
+/**
+ Inits a new DCNSConnection object for one channel of a pair of ports.
+ @discussion Several connections may share the same ports, and so the same socket, as long as each has its own channel.
+ Each has its own sequence numbers, session key and flow control. Channel 0 is what peers that predate channels use.
+ @param receivePort Port on which data will be received.
+ @param sendPort Port on which data will be sent
+ @param channel The channel for this connection
+ @return Initialised connection object.
+ */
+- (instancetype)initWithReceivePort:(NSPort *)receivePort sendPort:(NSPort *)sendPort channel:(unsigned int)channel;
+
 /**
  Invalidates the current connection, allowing for it to disconnect from the remote, and then to be deallocated.
  */
@@ -64,6 +64,7 @@
 #import <Foundation/NSInvocation.h>
 #import <Foundation/NSMethodSignature.h>
 #import <Foundation/NSAutoreleasePool.h>
+#import <Foundation/NSIndexSet.h>
 
 #include <stdlib.h>
 
@@ -72,6 +73,37 @@
 
 @interface DCNSConnection (Private)
 
+// Flow control
+- (BOOL)_flowControlActive;
+- (NSUInteger)_lengthOfComponents:(NSArray *)components;
+- (void)_transmitComponents:(NSArray *)components sequence:(unsigned int)seq;
+- (BOOL)_sendComponents:(NSArray *)components sequence:(unsigned int)seq mayBlock:(BOOL)mayBlock;
+- (BOOL)_isQueuedSequence:(unsigned int)seq;
+- (void)_releaseCreditForSequence:(unsigned int)seq;
+- (void)_sendQueuedComponents;
+- (BOOL)_admitRequestWithLength:(NSUInteger)length sequence:(unsigned int)seq;
+- (void)_finishedRequestWithSequence:(unsigned int)seq;
+- (unsigned long long)_exchangeReceiveWindow:(unsigned long long)window;
+
+// Heartbeats
+- (void)_scheduleHeartbeatTimer;
+- (void)_heartbeatTimerDidFire;
+
+// Distributed reference counting
+- (void)_scheduleReleaseTimer;
+- (void)_sendPendingReleases;
+- (void)_sendOnewayToRemote:(SEL)selector argument:(void *)argument;
+- (void)_sendInvocation:(NSInvocation *)i internal:(BOOL)internal mayBlock:(BOOL)mayBlock;
+
+// Cached results
+- (void)_removeCachedResult:(struct DCNSCachedResult *)result;
+- (void)_removeAllCachedResults;
+
+// Channels
++ (DCNSConnection *)_connectionToShareWithSendPort:(NSPort *)sendPort;
+- (DCNSConnection *)_connectionSharingReceivePort;
+- (unsigned int)_exchangeWireFeatures:(unsigned int)features;
+
 @end
 
 @interface DCNSAbstractError (Private)
@@ -86,6 +118,10 @@
 #define FLAGS_RESPONSE	0x0e2ffece
 #define FLAGS_ACK	    0x0e5ffefe
 
+// Heartbeats are sent as an Ack for this sequence number, which is never used by a request.
+// Peers that don't know about heartbeats simply find nothing to acknowledge.
+#define HEARTBEAT_SEQUENCE 0
+
 // Utilised when negotiating a session key.
 #define FLAGS_DH_REQUEST 0x0e3ffeed
 #define FLAGS_DH_RESPONSE 0x0e4ffece
@@ -94,6 +130,22 @@
 #define DEFAULT_TRANSMISSION_TIMEOUT 10.0
 #define DEFAULT_ACK_ENABLED YES
 
+// Default flow control settings
+#define DEFAULT_RECEIVE_WINDOW_MESSAGES 64
+#define DEFAULT_RECEIVE_WINDOW_BYTES (4*1024*1024)
+#define DEFAULT_OUTBOUND_QUEUE_BUDGET (8*1024*1024)
+#define DEFAULT_RESULT_CACHE_BUDGET (1024*1024)
+
+// Default heartbeat settings
+#define DEFAULT_HEARTBEAT_INTERVAL 1.0
+#define DEFAULT_HEARTBEAT_MISS_LIMIT 3
+
+// How many release notices are held back before they are sent without waiting for the release timer.
+#define RELEASE_BATCH_MAX_REFERENCES 256
+
+// How often the release timer sends whatever notices have been held back.
+#define RELEASE_BATCH_INTERVAL 1.0
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark Function definitions
 
@@ -107,6 +159,9 @@ NSString *const DCNSConnectionRepliesReceived = @"kConnectionRepliesReceived";
 NSString *const DCNSConnectionRepliesSent = @"kConnectionRepliesSent";
 NSString *const DCNSConnectionRequestsReceived = @"kConnectionRequestsReceived";
 NSString *const DCNSConnectionRequestsSent = @"kConnectionRequestsSent";
+NSString *const DCNSConnectionOutboundQueueDepth = @"kConnectionOutboundQueueDepth";
+NSString *const DCNSConnectionOutboundQueueBytes = @"kConnectionOutboundQueueBytes";
+NSString *const DCNSConnectionStallTime = @"kConnectionStallTime";
 
 // Runloops
 NSString *const DCNSConnectionReplyMode = @"NSDefaultRunLoopMode";
@@ -115,6 +170,7 @@ NSString *const DCNSConnectionReplyMode = @"NSDefaultRunLoopMode";
 NSString *const DCNSFailedAuthenticationException = @"DCNSFailedAuthenticationException";
 NSString *const DCNSInvalidPortNameServerException = @"DCNSInvalidPortNameServerException";
 NSString *const DCNSPortTimeoutException = @"DCNSPortTimeoutException";
+NSString *const DCNSFlowControlException = @"DCNSFlowControlException";
 
 // Notifications
 NSString *const NSConnectionDidDieNotification = @"DCNSConnectionDidDieNotification";
@@ -126,6 +182,7 @@ NSString *const DCNSConnectionErrorDomain = @"DCNSConnectionErrorDomain";
 // Concurrency
 static NSLock *_DCNSResponsesLock;
 static NSLock *_DCNSAckLock;
+static NSLock *_DCNSReleasesLock;	// guards _pendingReleases, and membership of _allConnections while queueing one
 static dispatch_semaphore_t _DCNSReceiveScheduleSem;
 
 // A cache of known connections that are currently instiantated.
@@ -133,9 +190,9 @@ static dispatch_semaphore_t _DCNSReceiveScheduleSem;
 // Speed issues causes by this might be visible on server reponses time with multiple clients.
 static NSHashTable *_allConnections;
 
-// Sequence number for message ordering.
-// Will 'tick over' after hitting the maximum integer.
-static unsigned int _sequence;
+// The last channel handed out to a connection sharing its receive port with another.
+// Will 'tick over' after hitting the maximum the message id can carry.
+static unsigned int _DCNSLastChannel;
 
 @implementation DCNSConnection
 
@@ -150,12 +207,20 @@ static unsigned int _sequence;
     if (!_DCNSAckLock) {
         _DCNSAckLock = [[NSLock alloc] init];
     }
+    
+    if (!_DCNSReleasesLock) {
+        _DCNSReleasesLock = [[NSLock alloc] init];
+    }
 }
 
 + (DCNSConnection *)connectionWithReceivePort:(NSPort *)receivePort sendPort:(NSPort *)sendPort {
     return [[[self alloc] initWithReceivePort:receivePort sendPort:sendPort] autorelease];
 }
 
+- (id)initWithReceivePort:(NSPort *)receivePort sendPort:(NSPort *)sendPort {
+    return [self initWithReceivePort:receivePort sendPort:sendPort channel:0];
+}
+
 + (DCNSConnection *)connectionWithRegisteredName:(NSString *)name host:(NSString *)hostName usingNameServer:(NSPortNameServer *)server portNumber:(unsigned int)portnum {
     
 #if DEBUG_LOG_LEVEL>=1
@@ -228,10 +293,14 @@ static unsigned int _sequence;
  * Furthermore, this method may be called when a server is creating a child connection
  * to handle a new client, or when either the client or server are initializing for the
  * first time.
+ *
+ * A client that already has a connection to the same remote endpoint (address and port), if it
+ * supports channels, will share the receivePort of that connection (and so the socket the remote
+ * replies on) on a new channel.
  */
-- (id)initWithReceivePort:(NSPort *)receivePort sendPort:(NSPort *)sendPort {
+- (id)initWithReceivePort:(NSPort *)receivePort sendPort:(NSPort *)sendPort channel:(unsigned int)channel {
 #if DEBUG_LOG_LEVEL>=2
-    NSLog(@"DCNSConnection -initWithReceivePort:%@ sendPort:%@", receivePort, sendPort);
+    NSLog(@"DCNSConnection -initWithReceivePort:%@ sendPort:%@ channel:%u", receivePort, sendPort, channel);
 #endif
     
     // run +initialize
@@ -241,6 +310,7 @@ static unsigned int _sequence;
     
     if (self) {
         NSNotificationCenter *nc = [NSNotificationCenter defaultCenter];
+        DCNSConnection *sibling = nil;
         
         _sessionKey = NULL;
         
@@ -259,13 +329,26 @@ static unsigned int _sequence;
             sendPort = receivePort;
         } else if (!receivePort) {
             // We have hit condition (2).
-            receivePort = [[[sendPort class] new] autorelease];
+            sibling = [DCNSConnection _connectionToShareWithSendPort:sendPort];
+            
+            if (sibling) {
+                // Share the sibling's receivePort on a channel of our own; 0 is left for peers without channels.
+                receivePort = sibling.receivePort;
+                
+                do {
+                    channel = __sync_add_and_fetch(&_DCNSLastChannel, 1) & 0x7fffffff;
+                } while (channel == 0);
+            } else {
+                receivePort = [[[sendPort class] new] autorelease];
+            }
         }
         
+        _channel = channel;
+        
         // First, we will check if a connection with these ports already exist. If so, we will
         // give the callee that instead.
         
-        DCNSConnection *c = [DCNSConnection lookUpConnectionWithReceivePort:receivePort sendPort:sendPort];
+        DCNSConnection *c = [DCNSConnection lookUpConnectionWithReceivePort:receivePort sendPort:sendPort channel:channel];
         
         // Check if we already have a connection on these ports, and return that instead if so.
         if (c != nil) {
@@ -300,6 +383,34 @@ static unsigned int _sequence;
             _runLoops = [c->_runLoops mutableCopy];
             self.transmissionTimeout = c.transmissionTimeout;
             self.acksEnabled = c.acksEnabled;
+            self.receiveWindowMessages = c.receiveWindowMessages;
+            self.receiveWindowBytes = c.receiveWindowBytes;
+            self.flowControlPolicy = c.flowControlPolicy;
+            self.outboundQueueBudget = c.outboundQueueBudget;
+            self.resultCacheBudget = c.resultCacheBudget;
+            self.heartbeatInterval = c.heartbeatInterval;
+            self.heartbeatMissLimit = c.heartbeatMissLimit;
+        } else if (sibling) {
+            
+#if DEBUG_LOG_LEVEL>=1
+            NSLog(@"DCNSConnection -init: sharing receive port of %p on channel %u", sibling, channel);
+#endif
+            
+            // The receivePort is already scheduled and running on the sibling's thread.
+            
+            self.receivePort = [receivePort retain];
+            self.sendPort = [sendPort retain];
+            _modes = [sibling->_modes mutableCopy];
+            _runLoops = [sibling->_runLoops mutableCopy];
+            self.transmissionTimeout = sibling.transmissionTimeout;
+            self.acksEnabled = sibling.acksEnabled;
+            self.receiveWindowMessages = sibling.receiveWindowMessages;
+            self.receiveWindowBytes = sibling.receiveWindowBytes;
+            self.flowControlPolicy = sibling.flowControlPolicy;
+            self.outboundQueueBudget = sibling.outboundQueueBudget;
+            self.resultCacheBudget = sibling.resultCacheBudget;
+            self.heartbeatInterval = sibling.heartbeatInterval;
+            self.heartbeatMissLimit = sibling.heartbeatMissLimit;
         } else {
             // Alright, can actually make a brand new connection then.
             
@@ -313,6 +424,13 @@ static unsigned int _sequence;
             _runLoops = [[NSMutableArray alloc] initWithCapacity:10];
             self.transmissionTimeout = DEFAULT_TRANSMISSION_TIMEOUT; // default timeout.
             self.acksEnabled = DEFAULT_ACK_ENABLED; // default acks state
+            self.receiveWindowMessages = DEFAULT_RECEIVE_WINDOW_MESSAGES;
+            self.receiveWindowBytes = DEFAULT_RECEIVE_WINDOW_BYTES;
+            self.flowControlPolicy = DCNSFlowControlPolicyBlock;
+            self.outboundQueueBudget = DEFAULT_OUTBOUND_QUEUE_BUDGET;
+            self.resultCacheBudget = DEFAULT_RESULT_CACHE_BUDGET;
+            self.heartbeatInterval = DEFAULT_HEARTBEAT_INTERVAL;
+            self.heartbeatMissLimit = DEFAULT_HEARTBEAT_MISS_LIMIT;
             
             // The receiving port is now scheduled on its own runloop. We should wait until that actually
             // occurs before continuing any further.
@@ -322,28 +440,39 @@ static unsigned int _sequence;
             dispatch_semaphore_wait(_DCNSReceiveScheduleSem, DISPATCH_TIME_FOREVER);
         }
         
-        // Make us respond to handlePortMessage:
-        [self.receivePort setDelegate:self];
+        // Make us respond to handlePortMessage: (a shared port already has a delegate, which routes by channel)
+        if (!sibling)
+            [self.receivePort setDelegate:self];
         
         // If the client disconnects or server goes down, we will be notified.
         [nc addObserver:self selector:@selector(_portInvalidated:) name:NSPortDidBecomeInvalidNotification object:self.sendPort];
         
+        _isValid = YES;
+        
         // Schedule the Ack timer for both new and children connections.
         [NSThread detachNewThreadSelector:@selector(scheduleAckTimerOnNewThread) toTarget:self withObject:nil];
         
-        _isValid = YES;
-        
         // Make us persistent at least until we are invalidated.
         [self retain];
 
-        // Retain local proxies
-        self.localObjects = NSCreateMapTable(NSNonRetainedObjectMapKeyCallBacks, NSObjectMapValueCallBacks, 10);
+        // Proxies are looked up and registered from any thread; other connections' proxies have their own lock.
+        _proxiesLock = [[NSLock alloc] init];
+        
+        // Filled in as proxies cache results.
+        _resultCacheLock = [[NSLock alloc] init];
+        
+        // Filled in as the classes of our objects are sent.
+        _proxyClassNumbers = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks, NSIntegerMapValueCallBacks, 10);
+        _proxyClassesLock = [[NSLock alloc] init];
+        
+        // Local proxies by the address of their object; they are kept alive by the remote, see DCNSDistantObject
+        self.localObjects = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks, NSNonRetainedObjectMapValueCallBacks, 10);
         
         // Don't retain these local proxies
         self.localObjectsByRemote = NSCreateMapTable(NSIntegerMapKeyCallBacks, NSNonRetainedObjectMapValueCallBacks, 10);
         
-        // Retain remote proxies
-        self.remoteObjects = NSCreateMapTable(NSIntegerMapKeyCallBacks, NSObjectMapValueCallBacks, 10);
+        // Remote proxies by reference number; they retain us rather than the other way round
+        self.remoteObjects = NSCreateMapTable(NSIntegerMapKeyCallBacks, NSNonRetainedObjectMapValueCallBacks, 10);
         
         // Map sequence number to response portcoder when handling a port message.
         _responses = NSCreateMapTable(NSIntegerMapKeyCallBacks, NSObjectMapValueCallBacks, 10);
@@ -354,13 +483,29 @@ static unsigned int _sequence;
         self.pendingAcksToSendTimeMap = [NSMapTable mapTableWithKeyOptions:NSMapTableCopyIn
                                                                 valueOptions:NSMapTableCopyIn];
         
+        // Flow control state; the remote's window is unknown until it has been exchanged.
+        _creditsBySequence = NSCreateMapTable(NSIntegerMapKeyCallBacks, NSIntegerMapValueCallBacks, 10);
+        _unansweredBySequence = NSCreateMapTable(NSIntegerMapKeyCallBacks, NSIntegerMapValueCallBacks, 10);
+        _outboundQueue = [[NSMutableArray alloc] initWithCapacity:10];
+        _creditCondition = [[NSCondition alloc] init];
+        
+        // Give the remote a full allowance of heartbeats from now.
+        _lastReceiveTime = [NSDate timeIntervalSinceReferenceDate];
+        
+        // Interned names are only sent once the remote has said it understands them.
+        _outgoingNames = [[DCNSNameTable alloc] init];
+        _incomingNames = [[DCNSNameTable alloc] init];
+        _decodedNames = [[DCNSNameCache alloc] init];
+        
         if (!_allConnections) {
             // Don't retain connections in hash table
             _allConnections = NSCreateHashTable(NSNonOwnedPointerHashCallBacks, 10);
         }
         
         // Add us to connections list
+        [_DCNSReleasesLock lock];
         NSHashInsertKnownAbsent(_allConnections, self);
+        [_DCNSReleasesLock unlock];
         
         // And tell everyone we're now alive.
         [nc postNotificationName:NSConnectionDidInitializeNotification object:self];
@@ -393,12 +538,45 @@ static unsigned int _sequence;
         [self removeRunLoop:rl];
     }
     
+    // Stop sending heartbeats, and don't let a change of interval start them again.
+    @synchronized (self) {
+        if (_heartbeatTimer) {
+            CFRunLoopTimerInvalidate(_heartbeatTimer);
+            CFRelease(_heartbeatTimer);
+            _heartbeatTimer = NULL;
+        }
+        
+        if (_releaseTimer) {
+            CFRunLoopTimerInvalidate(_releaseTimer);
+            CFRelease(_releaseTimer);
+            _releaseTimer = NULL;
+        }
+        
+        if (_timerRunLoop) {
+            CFRelease(_timerRunLoop);
+            _timerRunLoop = NULL;
+        }
+    }
+    
+    // Anything waiting for room in the remote's window will never get it now.
+    [_creditCondition lock];
+    [_outboundQueue removeAllObjects];
+    _outboundQueueBytes = 0;
+    [_creditCondition broadcast];
+    [_creditCondition unlock];
+    
     // Post that we're no longer valid.
     [[NSNotificationCenter defaultCenter] postNotificationName:NSConnectionDidDieNotification object:self];
     
+    // Anyone still sharing our receivePort needs a delegate for it that will outlive us.
+    if ([self.receivePort delegate] == (id)self)
+        [self.receivePort setDelegate:[self _connectionSharingReceivePort]];
+    
+    [_DCNSResponsesLock lock];
     if(_responses)
         NSFreeMapTable(_responses);
     _responses = nil;
+    [_DCNSResponsesLock unlock];
     
     [self.receivePort release];
     self.receivePort = nil;
@@ -406,12 +584,24 @@ static unsigned int _sequence;
     [self.sendPort release];
     self.sendPort = nil;
     
-    // Remove us from the connections table
+    // Remove us from the connections table, after which proxies going away can't queue releases with us.
+    [_DCNSReleasesLock lock];
     if(_allConnections) {
         //const char *key = [[NSString stringWithFormat:@"%d-%d", [self.sendPort machPort], [self.receivePort machPort]] UTF8String];
         //NSMapRemove(_allConnections, key);
         NSHashRemove(_allConnections, self);
     }
+    [_pendingReleases release];
+    _pendingReleases = nil;
+    [_DCNSReleasesLock unlock];
+    
+    // The remote can't reach our objects any more, so we needn't keep them alive for it.
+    [DCNSDistantObject _releaseLocalReferencesForConnection:self];
+    
+    // Nor tell us when results from its objects change.
+    [_resultCacheLock lock];
+    [self _removeAllCachedResults];
+    [_resultCacheLock unlock];
     
 #if DEBUG_LOG_LEVEL>=1
     NSLog(@"DCNSConnection did invalidate %p", self);
@@ -461,6 +651,15 @@ static unsigned int _sequence;
         self.remoteObjects = nil;
     }
     
+    [_proxiesLock release];
+    
+    [self _removeAllCachedResults];
+    [_resultCacheLock release];
+    
+    if (_proxyClassNumbers)
+        NSFreeMapTable(_proxyClassNumbers);
+    [_proxyClassesLock release];
+    
     if(_responses)
         NSFreeMapTable(_responses);
     
@@ -484,6 +683,31 @@ static unsigned int _sequence;
     [self.rootObject release];
     [_requestQueue release];
     
+    if (_creditsBySequence)
+        NSFreeMapTable(_creditsBySequence);
+    if (_unansweredBySequence)
+        NSFreeMapTable(_unansweredBySequence);
+    [_outboundQueue release];
+    [_creditCondition release];
+    
+    [_outgoingNames release];
+    [_incomingNames release];
+    [_decodedNames release];
+    
+    // Method signatures learnt from the remote mustn't be found by a connection that later gets our address.
+    [DCNSDistantObject _removeSignaturesForConnection:self];
+    
+    if (_heartbeatTimer) {
+        CFRunLoopTimerInvalidate(_heartbeatTimer);
+        CFRelease(_heartbeatTimer);
+    }
+    if (_releaseTimer) {
+        CFRunLoopTimerInvalidate(_releaseTimer);
+        CFRelease(_releaseTimer);
+    }
+    if (_timerRunLoop)
+        CFRelease(_timerRunLoop);
+    
     // This is calloc'd.
     if (_sessionKey != NULL) {
         free(_sessionKey);
@@ -577,8 +801,8 @@ static unsigned int _sequence;
     if([_runLoops containsObject:runLoop]) {
         // remove from all modes
         for (NSString *mode in _modes) {
-            // Only remove the receive port if this is the last connection left
-            if ([_allConnections count] == 1)
+            // Only remove the receive port if no other connection is using it
+            if (![self _connectionSharingReceivePort])
                 [self.receivePort removeFromRunLoop:runLoop forMode:mode];
             
             if(self.receivePort != self.sendPort)
@@ -607,6 +831,14 @@ static unsigned int _sequence;
     NSTimer *pendingAckTimer = [NSTimer timerWithTimeInterval:0.25 target:self selector:@selector(pendingAckTimerDidFire:) userInfo:nil repeats:YES];
     [[NSRunLoop currentRunLoop] addTimer:pendingAckTimer forMode:NSDefaultRunLoopMode];
     
+    // Heartbeats and release notices share this thread, and heartbeats are rescheduled here if their interval changes.
+    @synchronized (self) {
+        if (_isValid)
+            _timerRunLoop = (CFRunLoopRef)CFRetain(CFRunLoopGetCurrent());
+    }
+    [self _scheduleHeartbeatTimer];
+    [self _scheduleReleaseTimer];
+    
     [[NSRunLoop currentRunLoop] run];
 }
 
@@ -698,6 +930,38 @@ static unsigned int _sequence;
     int K = [DCNSDiffieHellmanUtility powermod:B power:seca modulus:p];
     _sessionKey = [DCNSDiffieHellmanUtility convertToKey:K];
     
+    // Tell the remote how much we will accept from it, and learn the same in return.
+    // Peers that predate flow control don't know this selector, so we carry on without a window.
+    @try {
+        unsigned long long window = ((unsigned long long)self.receiveWindowMessages << 32) | self.receiveWindowBytes;
+        window = [conn _exchangeReceiveWindow:window];
+        
+        [_creditCondition lock];
+        _peerWindowMessages = (unsigned int)(window >> 32);
+        _peerWindowBytes = (unsigned int)(window & 0xffffffff);
+        _advertisedReceiveWindow = YES;
+        [_creditCondition unlock];
+    } @catch (NSException *e) {
+        if (![[e name] isEqualToString:DCNSMethodSignatureException])
+            [e raise];
+        
+#if DEBUG_LOG_LEVEL>=1
+        NSLog(@"DCNSConnection: peer does not support flow control");
+#endif
+    }
+    
+    // Agree on which optional parts of the protocol both sides support. As above, older peers support none.
+    @try {
+        _peerWireFeatures = [conn _exchangeWireFeatures:DCNS_WIRE_FEATURES] & DCNS_WIRE_FEATURES;
+    } @catch (NSException *e) {
+        if (![[e name] isEqualToString:DCNSMethodSignatureException])
+            [e raise];
+        
+#if DEBUG_LOG_LEVEL>=1
+        NSLog(@"DCNSConnection: peer does not support optional wire features");
+#endif
+    }
+    
     // This ends up in forwardInvocation: and asks other side for a reference to their root object
     DCNSDistantObject *proxy = [conn rootObject];
     
@@ -735,11 +999,24 @@ static unsigned int _sequence;
 
 // the objects and not the proxies
 - (NSArray *)knownLocalObjects {
-    return NSAllMapTableKeys(self.localObjects);
+    NSArray *objects;
+    
+    [_proxiesLock lock];
+    objects = NSAllMapTableKeys(self.localObjects);
+    [_proxiesLock unlock];
+    
+    return objects;
 }
 
 - (NSArray *)knownRemoteObjects {
-    return NSAllMapTableValues(self.remoteObjects);
+    NSArray *objects;
+    
+    // Retained under the lock, so none of them can go away before our caller has them.
+    [_proxiesLock lock];
+    objects = NSAllMapTableValues(self.remoteObjects);
+    [_proxiesLock unlock];
+    
+    return objects;
 }
 
 - (NSArray *)requestModes {
@@ -750,6 +1027,13 @@ static unsigned int _sequence;
     return (self.transmissionTimeout / 1.5);
 }
 
+- (void)setHeartbeatInterval:(NSTimeInterval)heartbeatInterval {
+    _heartbeatInterval = heartbeatInterval;
+    
+    // Takes effect straight away if our timer thread is already running.
+    [self _scheduleHeartbeatTimer];
+}
+
 - (void)setRootObject:(NSObject*)anObj {
     _rootObject = [anObj retain];
     
@@ -760,11 +1044,20 @@ static unsigned int _sequence;
 }
 
 - (NSDictionary *)statistics {
+    [_creditCondition lock];
+    NSUInteger queueDepth = [_outboundQueue count];
+    NSUInteger queueBytes = _outboundQueueBytes;
+    NSTimeInterval stallTime = _stallTime;
+    [_creditCondition unlock];
+    
     return [NSDictionary dictionaryWithObjectsAndKeys:
             [NSNumber numberWithUnsignedInt:_repliesReceived], @"DCDCNSConnectionRepliesReceived",
             [NSNumber numberWithUnsignedInt:_repliesSent], @"DCDCNSConnectionRepliesSent",
             [NSNumber numberWithUnsignedInt:_requestsReceived], @"DCDCNSConnectionRequestsReceived",
             [NSNumber numberWithUnsignedInt:_requestsSent], @"DCDCNSConnectionRequestsSent",
+            [NSNumber numberWithUnsignedInteger:queueDepth], DCNSConnectionOutboundQueueDepth,
+            [NSNumber numberWithUnsignedInteger:queueBytes], DCNSConnectionOutboundQueueBytes,
+            [NSNumber numberWithDouble:stallTime], DCNSConnectionStallTime,
             nil
             ];
 }
@@ -830,6 +1123,10 @@ static unsigned int _sequence;
 }
 
 + (DCNSConnection *)lookUpConnectionWithReceivePort:(NSPort *)receivePort sendPort:(NSPort *)sendPort {
+    return [self lookUpConnectionWithReceivePort:receivePort sendPort:sendPort channel:0];
+}
+
++ (DCNSConnection *)lookUpConnectionWithReceivePort:(NSPort *)receivePort sendPort:(NSPort *)sendPort channel:(unsigned int)channel {
     // Look up if we already know this connection
     
     // FIXME: this should use a NSMapTable with struct { NSPort *recv, *send; } as key/hash
@@ -839,7 +1136,7 @@ static unsigned int _sequence;
         NSHashEnumerator e=NSEnumerateHashTable(_allConnections);
         DCNSConnection *c;
         while((c=(DCNSConnection *) NSNextHashEnumeratorItem(&e))) {
-            if([c receivePort] == receivePort && [c sendPort] == sendPort)
+            if([c receivePort] == receivePort && [c sendPort] == sendPort && c->_channel == channel)
                 return c;	// found!
         }
         
@@ -861,9 +1158,23 @@ static unsigned int _sequence;
 }
 
 - (DCNSPortCoder *)portCoderWithComponents:(NSArray *)components {
-    return [[[DCNSPortCoder alloc] initWithReceivePort:self.receivePort
-                                            sendPort:self.sendPort
-                                          components:components] autorelease];
+    DCNSPortCoder *coder = [[[DCNSPortCoder alloc] initWithReceivePort:self.receivePort
+                                                            sendPort:self.sendPort
+                                                          components:components] autorelease];
+    [coder setChannel:_channel];
+    [coder setOutgoingNames:(_peerWireFeatures & DCNS_WIRE_FEATURE_INTERNED_NAMES) ? _outgoingNames : nil
+              incomingNames:_incomingNames];
+    
+    // Only the first component is ever encrypted, so nothing may be sent beside it.
+    if ([self.delegate respondsToSelector:@selector(encryptData:andSessionKey:)])
+        [coder setWireFeatures:_peerWireFeatures & ~DCNS_WIRE_FEATURE_OUT_OF_LINE_DATA];
+    else
+        [coder setWireFeatures:_peerWireFeatures];
+    
+    [coder setNameCache:_decodedNames];
+    [coder setLastComponentIsAuthentication:[self.delegate respondsToSelector:@selector(authenticateComponents:withData:andSessionKey:)]];
+    
+    return coder;
 }
 
 /*
@@ -875,7 +1186,12 @@ static unsigned int _sequence;
  * up unnecessary memory until it is dropped.
  */
 - (void)sendInvocation:(NSInvocation *)i internal:(BOOL)internal {
+    [self _sendInvocation:i internal:internal mayBlock:YES];
+}
+
+- (void)_sendInvocation:(NSInvocation *)i internal:(BOOL)internal mayBlock:(BOOL)mayBlock {
     // send invocation and handle result - this might be called reentrant!
+    // Unless it may block, a oneway invocation is queued if the remote has no room for it (see Flow control).
     
     BOOL isOneway = NO;
     
@@ -892,8 +1208,11 @@ static unsigned int _sequence;
     isOneway = [[i methodSignature] isOneway];
     portCoder = [self portCoderWithComponents:nil];	// for encoding
     
-    // Increment sequence number for this conversation
-    unsigned int currentSequence = ++_sequence;
+    // Increment sequence number for this conversation, which never uses the one reserved for heartbeats.
+    unsigned int currentSequence;
+    do {
+        currentSequence = __sync_add_and_fetch(&_sequence, 1);
+    } while (currentSequence == HEARTBEAT_SEQUENCE);
     
     // Encode message metadata
     [portCoder encodeValueOfObjCType:@encode(unsigned long) at:&flags];
@@ -920,12 +1239,13 @@ static unsigned int _sequence;
     // Set delegate as needed.
     [self.sendPort setDelegate:self];
 
-    // Encode and send - raises exception on timeout.
-    [portCoder sendBeforeTime:[NSDate timeIntervalSinceReferenceDate]+self.transmissionTimeout sendReplyPort:NO];
-    _requestsSent++; // no need for concurrency here.
+    // Names first defined by this request can be referenced once the remote has replied, as it must
+    // have decoded the request to do so.
+    NSIndexSet *definedNames = [[[portCoder definedNames] retain] autorelease];
     
-    // Setup Ack.
-    [self setupPendingAckWithNumber:currentSequence andComponents:[portCoder components]];
+    // Send once the remote has room for it, and setup its Ack - raises exception on timeout.
+    BOOL queued = [self _sendComponents:[portCoder components] sequence:currentSequence mayBlock:mayBlock];
+    _requestsSent++; // no need for concurrency here.
     
     // Release internal memory immediately.
     [portCoder invalidate];
@@ -947,23 +1267,28 @@ static unsigned int _sequence;
             NSLog(@"*** (conn=%p) loop for response %u in %@ at %d", self, currentSequence, DCNSConnectionReplyMode, [_receivePort machPort]);
 #endif
             
-            if (![self isValid])
+            if (![self isValid]) {
+                if (_peerFellSilent)
+                    [NSException raise:DCNSPortTimeoutException format:@"The remote stopped responding whilst we waited for a response (sequence: %d)", currentSequence];
                 [NSException raise:DCNSTransmissionException format:@"Connection became invalid whilst sending data."];
+            }
             if (![self.receivePort isValid])
                 [NSException raise:DCNSTransmissionException format:@"Receiving port became invalid whilst sending data."];
             
+            // The responses go with the connection, which may have been invalidated since we checked,
+            // so take ours out whilst the lock keeps them around.
             [_DCNSResponsesLock lock];
-            portCoder = NSMapGet(_responses, INT2VOIDP(currentSequence));
+            portCoder = _responses ? NSMapGet(_responses, INT2VOIDP(currentSequence)) : nil;
+            if (portCoder) {
+                [portCoder retain];	// we will need it for a little time...
+                NSMapRemove(_responses, INT2VOIDP(currentSequence));
+            }
             [_DCNSResponsesLock unlock];
             
             if (portCoder) {
                 // The response we are waiting for has arrived!
                 
-                [portCoder retain];	// we will need it for a little time...
-                
-                [_DCNSResponsesLock lock];
-                NSMapRemove(_responses, INT2VOIDP(currentSequence));
-                [_DCNSResponsesLock unlock];
+                [_outgoingNames confirmIds:definedNames];
                 
                 break;	// break the loop and decode the response
             }
@@ -974,6 +1299,10 @@ static unsigned int _sequence;
             NSLog(@"responses %@", NSAllMapTableValues(_responses));
 #endif
             
+            // The remote can't answer what it hasn't been sent, so the time only starts once we leave the queue.
+            if (queued && (queued = [self _isQueuedSequence:currentSequence]))
+                until = [NSDate dateWithTimeIntervalSinceNow:self.transmissionTimeout];
+            
             if([until timeIntervalSinceNow] < 0) {
                 [NSException raise:DCNSPortTimeoutException format:@"Did not receive a response within %.0f seconds (sequence: %d)", self.transmissionTimeout, currentSequence];
             }
@@ -1065,8 +1394,10 @@ static unsigned int _sequence;
     if(!message)
         return;
     
-    // Setup port coder with this message.
-    [[DCNSPortCoder portCoderWithReceivePort:[message receivePort] sendPort:[message sendPort] components:[message components]] dispatch];
+    // Setup port coder with this message; its msgid tells us which connection on these ports it is for.
+    DCNSPortCoder *coder = [DCNSPortCoder portCoderWithReceivePort:[message receivePort] sendPort:[message sendPort] components:[message components]];
+    [coder setChannel:[message msgid]];
+    [coder dispatch];
 }
 
 - (void) handlePortCoder:(DCNSPortCoder *) coder; {
@@ -1098,6 +1429,14 @@ static unsigned int _sequence;
         NSLog(@"%p: handlePortCoder: %@", self, coder);
 #endif
     
+        // Anything at all from the remote shows that it is still alive.
+        _lastReceiveTime = [NSDate timeIntervalSinceReferenceDate];
+        
+        // Names the remote has interned for us may be referenced in what follows.
+        [coder setOutgoingNames:nil incomingNames:_incomingNames];
+        [coder setNameCache:_decodedNames];
+        [coder setLastComponentIsAuthentication:[self.delegate respondsToSelector:@selector(authenticateComponents:withData:andSessionKey:)]];
+    
         @try {
             [coder decodeValueOfObjCType:@encode(unsigned int) at:&flags];
 #if DEBUG_LOG_LEVEL>=2
@@ -1124,15 +1463,35 @@ static unsigned int _sequence;
                 case FLAGS_REQUEST:	// request received
                 case FLAGS_DH_REQUEST:
                     _requestsReceived++;
-                    [self handleRequest:coder sequence:seq];
+                    
+                    if (![self _admitRequestWithLength:[self _lengthOfComponents:[coder components]] sequence:seq]) {
+                        NSLog(@"[DCNSConnection] (%p) The remote has overrun our receive window, invalidating", self);
+                        
+                        [coder invalidate];
+                        [self invalidate];
+                        break;
+                    }
+                    
+                    __sync_add_and_fetch(&_requestsInProgress, 1);
+                    @try {
+                        [self handleRequest:coder sequence:seq];
+                    } @catch (NSException *e) {
+                        // Nothing will be sent back for it now.
+                        [self _finishedRequestWithSequence:seq];
+                        @throw;
+                    } @finally {
+                        _lastRequestFinished = [NSDate timeIntervalSinceReferenceDate];
+                        __sync_sub_and_fetch(&_requestsInProgress, 1);
+                    }
                     
                     break;
                 case FLAGS_RESPONSE:	// response received
                 case FLAGS_DH_RESPONSE:
                     _repliesReceived++;
                     [_DCNSResponsesLock lock];
-                    // Put response into sequence queue/dictionary
-                    NSMapInsert(_responses, INT2VOIDP(seq), (void *) coder);
+                    // Put response into sequence queue/dictionary, unless nobody is left to wait for it.
+                    if (_responses)
+                        NSMapInsert(_responses, INT2VOIDP(seq), (void *) coder);
                     [_DCNSResponsesLock unlock];
                     
                     // We should also send back an Ack to let the remote know we have recieved their data.
@@ -1151,7 +1510,10 @@ static unsigned int _sequence;
                     [self handleAckReceived:seq];
                     break;
                 case FLAGS_ACK:
-                    [self handleAckReceived:seq];
+                    if (seq == HEARTBEAT_SEQUENCE)
+                        _peerSendsHeartbeats = YES;
+                    else
+                        [self handleAckReceived:seq];
                     break;
                 default:
                     NSLog(@"%p: unknown flags received: %08x", self, flags);
@@ -1184,6 +1546,9 @@ static unsigned int _sequence;
     [self.pendingAcksToCachedDataMap removeObjectForKey:key];
     [self.pendingAcksToSendTimeMap removeObjectForKey:key];
     [_DCNSAckLock unlock];
+    
+    // The remote now has room for more of our data.
+    [self _releaseCreditForSequence:ackNumber];
 }
 
 - (void)sendAckToRemote:(unsigned int)ackNumber {
@@ -1213,17 +1578,16 @@ static unsigned int _sequence;
     // To store an Ack, simply add it to the two pending Ack maps. The Ack timeout timer will pick
     // them up as needed.
     // NOTE: We will treat the modification of these two maps as a critical section.
+    // NOTE: This is done before sending, so that a quick Ack can't arrive before its entry exists.
     
-    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-        time_t currentTime = time(NULL);
+    time_t currentTime = time(NULL);
     
-        id key = [NSNumber numberWithInt:ackNumber];
+    id key = [NSNumber numberWithInt:ackNumber];
     
-        [_DCNSAckLock lock];
-        [self.pendingAcksToSendTimeMap setObject:[NSNumber numberWithInt:(unsigned int)currentTime] forKey:key];
-        [self.pendingAcksToCachedDataMap setObject:components forKey:key];
-        [_DCNSAckLock unlock];
-    });
+    [_DCNSAckLock lock];
+    [self.pendingAcksToSendTimeMap setObject:[NSNumber numberWithInt:(unsigned int)currentTime] forKey:key];
+    [self.pendingAcksToCachedDataMap setObject:components forKey:key];
+    [_DCNSAckLock unlock];
 }
 
 - (void)pendingAckTimerDidFire:(NSTimer*)timer {
@@ -1264,6 +1628,9 @@ static unsigned int _sequence;
             [self.pendingAcksToSendTimeMap removeObjectForKey:key];
             [_DCNSAckLock unlock];
             
+            // We no longer track this data, so don't let it hold the window shut.
+            [self _releaseCreditForSequence:[key unsignedIntValue]];
+            
             // XXX: Not releasing the components since it will have been retained only by the map.
         }
     }
@@ -1284,6 +1651,8 @@ static unsigned int _sequence;
         // We have already been called and are waiting on an Ack from the remote.
         DCNSPortCoder *coder = [self portCoderWithComponents:components];
         
+        [self _finishedRequestWithSequence:seq];
+        
         [coder sendBeforeTime:[NSDate timeIntervalSinceReferenceDate]+self.transmissionTimeout sendReplyPort:NO];
         [coder invalidate];
         
@@ -1465,6 +1834,9 @@ static unsigned int _sequence;
     NSMethodSignature *sig = [result methodSignature];
     BOOL isOneway = [sig isOneway];
     
+    // The request no longer counts against our receive window.
+    [self _finishedRequestWithSequence:seq];
+    
 #if DEBUG_LOG_LEVEL>=3
     NSLog(@"returnResult: %@", result);
     NSLog(@"   exception: %@", exception);
@@ -1508,11 +1880,10 @@ static unsigned int _sequence;
         NSLog(@"DCNSConnection: -returnResult: now sending %@", [pc components]);
 #endif
         
-        // Send response on sendPort
-        [pc sendBeforeTime:[NSDate timeIntervalSinceReferenceDate]+self.transmissionTimeout sendReplyPort:NO];
-        
-        // Setup the Ack waiting.
-        [self setupPendingAckWithNumber:seq andComponents:[pc components]];
+        // Send response on sendPort, and setup the Ack waiting.
+        // Replies go past the remote's window: it charged its own for the request, and this is what gives the
+        // credit back. We are on the receiving thread too, so must neither wait for Acks nor fail here.
+        [self _transmitComponents:[pc components] sequence:seq];
         
         _repliesSent++;
         [pc invalidate];
@@ -1563,12 +1934,463 @@ static unsigned int _sequence;
 
 @end
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Heartbeats
+
+static void _DCNSHeartbeatTimerCallBack(CFRunLoopTimerRef timer, void *info) {
+    @autoreleasepool {
+        [(DCNSConnection *)info _heartbeatTimerDidFire];
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Flow control of outgoing data
+
+/*
+ * Each side advertises a window of how many un-acknowledged messages and bytes it will accept. Sending a
+ * message charges it against the remote's window, and its Ack (or a response, which counts as one) gives
+ * the credit back. Until the windows have been exchanged in -rootProxy, and whenever Acks are disabled,
+ * nothing is limited.
+ */
+
+@implementation DCNSConnection (Private)
+
+- (BOOL)_flowControlActive {
+    // Must be called with _creditCondition locked.
+    return self.acksEnabled && (_peerWindowMessages > 0 || _peerWindowBytes > 0);
+}
+
+- (BOOL)_hasCreditForLength:(NSUInteger)length {
+    // Must be called with _creditCondition locked.
+    // A message is always allowed through on its own, or one larger than the window could never be sent.
+    if (_outstandingMessages == 0)
+        return YES;
+    
+    if (_peerWindowMessages > 0 && _outstandingMessages >= _peerWindowMessages)
+        return NO;
+    
+    if (_peerWindowBytes > 0 && _outstandingBytes + length > _peerWindowBytes)
+        return NO;
+    
+    return YES;
+}
+
+- (void)_chargeCreditForLength:(NSUInteger)length sequence:(unsigned int)seq {
+    // Must be called with _creditCondition locked.
+    // A re-sent request may reuse its sequence number, so don't charge for it twice.
+    if (NSMapGet(_creditsBySequence, INT2VOIDP(seq)))
+        return;
+    
+    NSMapInsert(_creditsBySequence, INT2VOIDP(seq), (void *)length);
+    _outstandingMessages++;
+    _outstandingBytes += length;
+}
+
+- (NSUInteger)_lengthOfComponents:(NSArray *)components {
+    NSUInteger length = 0;
+    
+    for (id component in components) {
+        if ([component isKindOfClass:[NSData class]])
+            length += [component length];
+    }
+    
+    return length;
+}
+
+- (void)_transmitComponents:(NSArray *)components sequence:(unsigned int)seq {
+    DCNSPortCoder *coder = [self portCoderWithComponents:components];
+    
+    // Setup the Ack first, so that a quick reply can't arrive before its entry exists.
+    [self setupPendingAckWithNumber:seq andComponents:components];
+    
+    @try {
+        [coder sendBeforeTime:[NSDate timeIntervalSinceReferenceDate]+self.transmissionTimeout sendReplyPort:NO];
+    } @finally {
+        [coder invalidate];
+    }
+}
+
+- (BOOL)_sendComponents:(NSArray *)components sequence:(unsigned int)seq mayBlock:(BOOL)mayBlock {
+    // Returns YES if the message was queued rather than sent.
+    NSUInteger length = [self _lengthOfComponents:components];
+    DCNSFlowControlPolicy policy = mayBlock ? self.flowControlPolicy : DCNSFlowControlPolicyQueue;
+    
+    [_creditCondition lock];
+    
+    if (![self _flowControlActive]) {
+        [_creditCondition unlock];
+        [self _transmitComponents:components sequence:seq];
+        return NO;
+    }
+    
+    // Anything already queued goes first, so that we don't overtake it.
+    if ([_outboundQueue count] == 0 && [self _hasCreditForLength:length]) {
+        [self _chargeCreditForLength:length sequence:seq];
+        [_creditCondition unlock];
+        [self _transmitComponents:components sequence:seq];
+        return NO;
+    }
+    
+    switch (policy) {
+        case DCNSFlowControlPolicyFailFast: {
+            // Acks release credit from other threads, so report what we saw when we made the decision.
+            unsigned int messages = _outstandingMessages;
+            NSUInteger bytes = _outstandingBytes;
+            
+            [_creditCondition unlock];
+            [NSException raise:DCNSFlowControlException format:@"Remote receive window is full (%u messages, %lu bytes outstanding)", messages, (unsigned long)bytes];
+            break;
+        }
+            
+        case DCNSFlowControlPolicyBlock: {
+            NSDate *until = [NSDate dateWithTimeIntervalSinceNow:self.transmissionTimeout];
+            NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+            BOOL hasCredit = NO;
+            
+            while (_isValid && [self _flowControlActive]) {
+                if ([_outboundQueue count] == 0 && [self _hasCreditForLength:length]) {
+                    hasCredit = YES;
+                    break;
+                }
+                
+                if (![_creditCondition waitUntilDate:until])
+                    break;
+            }
+            
+            _stallTime += [NSDate timeIntervalSinceReferenceDate] - start;
+            
+            if (!_isValid) {
+                [_creditCondition unlock];
+                [NSException raise:DCNSTransmissionException format:@"Connection became invalid whilst waiting to send data."];
+            }
+            
+            if (!hasCredit && [self _flowControlActive]) {
+                [_creditCondition unlock];
+                [NSException raise:DCNSFlowControlException format:@"Remote receive window stayed full for %.0f seconds", self.transmissionTimeout];
+            }
+            
+            if (hasCredit)
+                [self _chargeCreditForLength:length sequence:seq];
+            
+            [_creditCondition unlock];
+            [self _transmitComponents:components sequence:seq];
+            break;
+        }
+            
+        case DCNSFlowControlPolicyQueue:
+        default:
+            if (_outboundQueueBytes + length > self.outboundQueueBudget) {
+                [_creditCondition unlock];
+                [NSException raise:DCNSFlowControlException format:@"Outbound queue is over its budget of %lu bytes", (unsigned long)self.outboundQueueBudget];
+            }
+            
+            [_outboundQueue addObject:[NSArray arrayWithObjects:[NSNumber numberWithUnsignedInt:seq], components, nil]];
+            _outboundQueueBytes += length;
+            [_creditCondition unlock];
+            return YES;
+    }
+    
+    return NO;
+}
+
+- (BOOL)_isQueuedSequence:(unsigned int)seq {
+    BOOL queued = NO;
+    
+    [_creditCondition lock];
+    
+    for (NSArray *entry in _outboundQueue) {
+        if ([[entry objectAtIndex:0] unsignedIntValue] == seq) {
+            queued = YES;
+            break;
+        }
+    }
+    
+    [_creditCondition unlock];
+    
+    return queued;
+}
+
+- (void)_releaseCreditForSequence:(unsigned int)seq {
+    [_creditCondition lock];
+    
+    NSUInteger length = (NSUInteger)NSMapGet(_creditsBySequence, INT2VOIDP(seq));
+    if (length) {
+        NSMapRemove(_creditsBySequence, INT2VOIDP(seq));
+        
+        _outstandingMessages--;
+        _outstandingBytes -= MIN(length, _outstandingBytes);
+        
+        [_creditCondition broadcast];
+    }
+    
+    [_creditCondition unlock];
+    
+    if (length)
+        [self _sendQueuedComponents];
+}
+
+- (void)_sendQueuedComponents {
+    NSMutableArray *ready = nil;
+    
+    // Take everything that now fits, in order.
+    [_creditCondition lock];
+    
+    while ([_outboundQueue count] > 0) {
+        NSArray *entry = [_outboundQueue objectAtIndex:0];
+        unsigned int seq = [[entry objectAtIndex:0] unsignedIntValue];
+        NSUInteger length = [self _lengthOfComponents:[entry objectAtIndex:1]];
+        
+        if ([self _flowControlActive] && ![self _hasCreditForLength:length])
+            break;
+        
+        [self _chargeCreditForLength:length sequence:seq];
+        _outboundQueueBytes -= MIN(length, _outboundQueueBytes);
+        
+        if (!ready)
+            ready = [NSMutableArray arrayWithCapacity:[_outboundQueue count]];
+        
+        [ready addObject:entry];
+        [_outboundQueue removeObjectAtIndex:0];
+    }
+    
+    // Blocked senders wait for the queue to drain before they go.
+    if (ready)
+        [_creditCondition broadcast];
+    
+    [_creditCondition unlock];
+    
+    for (NSArray *entry in ready) {
+        @try {
+            [self _transmitComponents:[entry objectAtIndex:1] sequence:[[entry objectAtIndex:0] unsignedIntValue]];
+        } @catch (NSException *e) {
+            // Nobody is left to tell directly; the remote will time out on this one.
+            [self _handleExceptionIfPossible:e andRaise:NO];
+        }
+    }
+}
+
+- (void)_scheduleHeartbeatTimer {
+    @synchronized (self) {
+        if (_heartbeatTimer) {
+            CFRunLoopTimerInvalidate(_heartbeatTimer);
+            CFRelease(_heartbeatTimer);
+            _heartbeatTimer = NULL;
+        }
+        
+        NSTimeInterval interval = self.heartbeatInterval;
+        
+        // Wait for the timer thread to start; it is forgotten again on invalidation.
+        if (!_timerRunLoop || interval <= 0)
+            return;
+        
+        // The timer keeps us alive whilst it can fire; it is invalidated along with the connection.
+        CFRunLoopTimerContext context = { 0, self, CFRetain, CFRelease, NULL };
+        _heartbeatTimer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + interval, interval, 0, 0, _DCNSHeartbeatTimerCallBack, &context);
+        
+        CFRunLoopAddTimer(_timerRunLoop, _heartbeatTimer, kCFRunLoopDefaultMode);
+        CFRunLoopWakeUp(_timerRunLoop);
+    }
+}
+
+- (void)_heartbeatTimerDidFire {
+    // A listening connection has nobody to talk to.
+    if (!_isValid || self.sendPort == self.receivePort)
+        return;
+    
+    // Nothing is read from the remote while a request is being handled, which may take as long as it likes.
+    // That includes the requests of connections sharing our receive port, as they are handled on its thread.
+    NSTimeInterval lastFinished = _lastRequestFinished;
+    BOOL busy = __sync_fetch_and_add(&_requestsInProgress, 0) > 0;
+    
+    [_DCNSReleasesLock lock];
+    NSHashEnumerator e = NSEnumerateHashTable(_allConnections);
+    DCNSConnection *c;
+    while ((c = (DCNSConnection *)NSNextHashEnumeratorItem(&e))) {
+        if (c == self || [c receivePort] != self.receivePort)
+            continue;
+        
+        busy = busy || __sync_fetch_and_add(&c->_requestsInProgress, 0) > 0;
+        lastFinished = MAX(lastFinished, c->_lastRequestFinished);
+    }
+    [_DCNSReleasesLock unlock];
+    
+    NSTimeInterval silence = [NSDate timeIntervalSinceReferenceDate] - MAX(_lastReceiveTime, lastFinished);
+    
+    if (!busy && _peerSendsHeartbeats && self.heartbeatMissLimit > 0 && silence > self.heartbeatInterval * self.heartbeatMissLimit) {
+        NSLog(@"[DCNSConnection] (%p) Nothing received from the remote for %.2f seconds, invalidating", self, silence);
+        
+        // Anybody waiting on a response fails straight away, rather than at the end of their own timeout.
+        _peerFellSilent = YES;
+        [self invalidate];
+        return;
+    }
+    
+    // Heartbeats are Acks, which the remote doesn't expect if they are disabled.
+    if (self.acksEnabled) {
+        DCNSPortCoder *pc = [self portCoderWithComponents:nil];
+        unsigned int flags = FLAGS_ACK;
+        unsigned int seq = HEARTBEAT_SEQUENCE;
+        
+        [pc encodeValueOfObjCType:@encode(unsigned int) at:&flags];
+        [pc encodeValueOfObjCType:@encode(unsigned int) at:&seq];
+        
+        @try {
+            [pc sendBeforeTime:[NSDate timeIntervalSinceReferenceDate]+self.heartbeatInterval sendReplyPort:NO];
+        } @catch (NSException *e) {
+            // A failed write will invalidate the port, and so us, if the remote has really gone.
+#if DEBUG_LOG_LEVEL>=1
+            NSLog(@"[DCNSConnection] (%p) Failed to send heartbeat: %@", self, e);
+#endif
+        }
+        
+        [pc invalidate];
+    }
+}
+
+- (unsigned long long)_exchangeReceiveWindow:(unsigned long long)window {
+    // Called by the remote during -rootProxy; the window is packed as (messages << 32 | bytes).
+    
+    [_creditCondition lock];
+    _peerWindowMessages = (unsigned int)(window >> 32);
+    _peerWindowBytes = (unsigned int)(window & 0xffffffff);
+    _advertisedReceiveWindow = YES;
+    [_creditCondition unlock];
+    
+    return ((unsigned long long)self.receiveWindowMessages << 32) | self.receiveWindowBytes;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Flow control of incoming data
+
+/*
+ * Once the remote has been told our window it must keep to it: every request it sends stays charged until
+ * we have answered it, as the remote only gets its credit back from the reply. A remote that sends more than
+ * that anyway is broken or hostile, and we stop listening to it. As on the sending side, a request is always
+ * let in on its own.
+ */
+
+- (BOOL)_admitRequestWithLength:(NSUInteger)length sequence:(unsigned int)seq {
+    BOOL admit = YES;
+    
+    [_creditCondition lock];
+    
+    // A re-sent request is charged once, like on the sending side.
+    if (_advertisedReceiveWindow && self.acksEnabled && !NSMapGet(_unansweredBySequence, INT2VOIDP(seq))) {
+        if (_unansweredMessages > 0) {
+            if (self.receiveWindowMessages > 0 && _unansweredMessages >= self.receiveWindowMessages)
+                admit = NO;
+            if (self.receiveWindowBytes > 0 && _unansweredBytes + length > self.receiveWindowBytes)
+                admit = NO;
+        }
+        
+        if (admit) {
+            // Never store a zero, which reads back as no entry.
+            NSMapInsert(_unansweredBySequence, INT2VOIDP(seq), (void *)MAX(length, 1));
+            _unansweredMessages++;
+            _unansweredBytes += length;
+        }
+    }
+    
+    [_creditCondition unlock];
+    
+    return admit;
+}
+
+- (void)_finishedRequestWithSequence:(unsigned int)seq {
+    [_creditCondition lock];
+    
+    NSUInteger length = (NSUInteger)NSMapGet(_unansweredBySequence, INT2VOIDP(seq));
+    if (length) {
+        NSMapRemove(_unansweredBySequence, INT2VOIDP(seq));
+        
+        _unansweredMessages--;
+        _unansweredBytes -= MIN(length, _unansweredBytes);
+    }
+    
+    [_creditCondition unlock];
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Channels
+
+/*
+ * Every message carries the channel of its connection in its msgid, so that several connections between
+ * the same two endpoints can share a port pair (and so a socket), each keeping its own sequence numbers,
+ * session key and flow control. A client only shares with a remote that has said it supports channels.
+ *
+ * Sharing is by remote endpoint: the family, type, protocol and address a socket is connected to. Services
+ * listening on different ports of the same host are different endpoints, and a socket can only be connected
+ * to one of them, so each still has its own socket; channels help where many connections go to one server.
+ */
+
+static BOOL _DCNSSameRemoteEndpoint(NSPort *a, NSPort *b) {
+    if (a == b)
+        return YES;
+    
+    if (![a isKindOfClass:[DCNSSocketPort class]] || ![b isKindOfClass:[DCNSSocketPort class]])
+        return NO;
+    
+    DCNSSocketPort *x = (DCNSSocketPort *)a, *y = (DCNSSocketPort *)b;
+    return x.protocolFamily == y.protocolFamily && x.socketType == y.socketType && x.protocol == y.protocol &&
+           [x.address isEqualToData:y.address];
+}
+
++ (DCNSConnection *)_connectionToShareWithSendPort:(NSPort *)sendPort {
+    if (!_allConnections)
+        return nil;
+    
+    NSHashEnumerator e = NSEnumerateHashTable(_allConnections);
+    DCNSConnection *c;
+    while ((c = (DCNSConnection *)NSNextHashEnumeratorItem(&e))) {
+        if (!c->_isValid || !_DCNSSameRemoteEndpoint([c sendPort], sendPort) || [c receivePort] == [c sendPort])
+            continue;
+        
+        if (!(c->_peerWireFeatures & DCNS_WIRE_FEATURE_CHANNELS) || ![[c receivePort] isValid])
+            continue;
+        
+        // A server's child connections receive on the port it vends on, which isn't ours to share.
+        if ([DCNSConnection lookUpConnectionWithReceivePort:[c receivePort] sendPort:[c receivePort]])
+            continue;
+        
+        return c;
+    }
+    
+    return nil;
+}
+
+- (DCNSConnection *)_connectionSharingReceivePort {
+    if (!_allConnections || !self.receivePort)
+        return nil;
+    
+    NSHashEnumerator e = NSEnumerateHashTable(_allConnections);
+    DCNSConnection *c;
+    while ((c = (DCNSConnection *)NSNextHashEnumeratorItem(&e))) {
+        if (c != self && c->_isValid && [c receivePort] == self.receivePort)
+            return c;
+    }
+    
+    return nil;
+}
+
+- (unsigned int)_exchangeWireFeatures:(unsigned int)features {
+    // Called by the remote during -rootProxy.
+    _peerWireFeatures = features & DCNS_WIRE_FEATURES;
+    
+    return DCNS_WIRE_FEATURES;
+}
+
+@end
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark Private methods to handle caching of remote/local proxies
 // mclarke :: These remain unchanged from mySTEP.
 
 @implementation DCNSConnection (NSPrivate)
 
+- (NSLock *)_proxiesLock {
+    return _proxiesLock;
+}
+
 - (DCNSDistantObject *)_getLocal:(id)target {
     // Get proxy object for local object - if known
     
@@ -1633,5 +2455,334 @@ static unsigned int _sequence;
     NSMapRemove(self.remoteObjects, (void *) target);
 }
 
+- (unsigned int)_peerWireFeatures {
+    return _peerWireFeatures;
+}
+
+- (unsigned long long)_numberForProxyClass:(Class)cls {
+    [_proxyClassesLock lock];
+    
+    unsigned int number = (unsigned int)(uintptr_t)NSMapGet(_proxyClassNumbers, cls);
+    if (!number) {
+        number = ++_lastProxyClassNumber;
+        NSMapInsert(_proxyClassNumbers, cls, INT2VOIDP(number));
+    }
+    
+    [_proxyClassesLock unlock];
+    
+    return number;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Distributed reference counting
+
+/*
+ * An object we send by reference is kept alive for the remote by its local proxy, which used to happen for as long
+ * as this process ran. Now, each proxy counts how many times its reference has been sent (its wire count), and the
+ * remote counts how many times it has received it. When the remote's proxy goes away, it tells us its count, and
+ * the local proxy lets go of the object once every reference it sent has been accounted for. A reference that was
+ * in flight when the remote's proxy went away is still counted here, so the object survives to be used by the new
+ * proxy that decoding it creates.
+ *
+ * Notices are batched, and sent by a timer of their own or once a batch fills up. They never wait for room in the
+ * remote's window, but join the outbound queue instead, so the timer thread is never held up. Anything the remote
+ * hasn't told us about is let go of when the connection is invalidated, including everything sent to a remote that
+ * predates these notices.
+ */
+
+static void _DCNSReleaseTimerCallBack(CFRunLoopTimerRef timer, void *info) {
+    @autoreleasepool {
+        [(DCNSConnection *)info _sendPendingReleases];
+    }
+}
+
+- (void)_scheduleReleaseTimer {
+    @synchronized (self) {
+        // Wait for the timer thread to start; it is forgotten again on invalidation.
+        if (!_timerRunLoop || _releaseTimer || self.sendPort == self.receivePort)
+            return;
+        
+        // The timer keeps us alive whilst it can fire; it is invalidated along with the connection.
+        CFRunLoopTimerContext context = { 0, self, CFRetain, CFRelease, NULL };
+        _releaseTimer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + RELEASE_BATCH_INTERVAL, RELEASE_BATCH_INTERVAL, 0, 0, _DCNSReleaseTimerCallBack, &context);
+        
+        CFRunLoopAddTimer(_timerRunLoop, _releaseTimer, kCFRunLoopDefaultMode);
+    }
+}
+
++ (void)_queueReleaseOfReference:(unsigned int)ref wireCount:(unsigned int)count connection:(DCNSConnection *)connection {
+    uint32_t entry[2] = { NSSwapHostIntToLittle(ref), NSSwapHostIntToLittle(count) };
+    BOOL full = NO;
+    
+    [_DCNSReleasesLock lock];
+    
+    // Not in the table once invalidated, and the connection may have been deallocated since.
+    if (_allConnections && NSHashGet(_allConnections, connection) && (connection->_peerWireFeatures & DCNS_WIRE_FEATURE_RELEASE_NOTICES)) {
+        if (!connection->_pendingReleases)
+            connection->_pendingReleases = [[NSMutableData alloc] initWithCapacity:sizeof(entry) * 16];
+        
+        [connection->_pendingReleases appendBytes:entry length:sizeof(entry)];
+        full = [connection->_pendingReleases length] >= sizeof(entry) * RELEASE_BATCH_MAX_REFERENCES;
+        
+        // Proxies may go away on any thread, so sending is left to the timer thread.
+        if (full) {
+            @synchronized (connection) {
+                if (connection->_timerRunLoop) {
+                    CFRunLoopPerformBlock(connection->_timerRunLoop, kCFRunLoopDefaultMode, ^{
+                        [connection _sendPendingReleases];
+                    });
+                    CFRunLoopWakeUp(connection->_timerRunLoop);
+                }
+            }
+        }
+    }
+    
+    [_DCNSReleasesLock unlock];
+}
+
+- (void)_sendPendingReleases {
+    NSData *references;
+    
+    [_DCNSReleasesLock lock];
+    references = _pendingReleases;
+    _pendingReleases = nil;
+    [_DCNSReleasesLock unlock];
+    
+    if (!references)
+        return;
+    
+    // Whatever we couldn't tell the remote is let go of when the connection dies.
+    [self _sendOnewayToRemote:@selector(_releaseWireReferences:) argument:&references];
+    
+    [references release];
+}
+
+- (void)_sendOnewayToRemote:(SEL)selector argument:(void *)argument {
+    if (!_isValid)
+        return;
+    
+    // Addressed to the remote's connection (reference 0), which we know the signature of.
+    NSMethodSignature *sig = [DCNSConnection instanceMethodSignatureForSelector:selector];
+    NSInvocation *i = [NSInvocation invocationWithMethodSignature:sig];
+    
+    [i setTarget:[DCNSDistantObject proxyWithTarget:(id)0 connection:self]];
+    [i setSelector:selector];
+    [i setArgument:argument atIndex:2];
+    
+    @try {
+        [self _sendInvocation:i internal:YES mayBlock:NO];
+    } @catch (NSException *e) {
+#if DEBUG_LOG_LEVEL>=1
+        NSLog(@"[DCNSConnection] (%p) Failed to send %@: %@", self, NSStringFromSelector(selector), e);
+#endif
+    }
+}
+
+- (oneway void)_releaseWireReferences:(bycopy NSData *)references {
+    const uint32_t *entries = [references bytes];
+    NSUInteger i, count = [references length] / (2 * sizeof(uint32_t));
+    
+#if DEBUG_LOG_LEVEL>=2
+    NSLog(@"DCNSConnection: -_releaseWireReferences: %lu references", (unsigned long)count);
+#endif
+    
+    for (i = 0; i < count; i++)
+        [DCNSDistantObject _releaseLocalReference:NSSwapLittleIntToHost(entries[2 * i])
+                                        wireCount:NSSwapLittleIntToHost(entries[2 * i + 1])
+                                       connection:self];
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Cached results
+
+/*
+ * Proxies may be told that some methods of their remote object have no side effects and return a value that
+ * only changes with the object's state, in which case their results are cached here, by the remote object's
+ * reference number, the selector and the arguments. This is only done with a remote that tells us when that
+ * state changes, whereupon everything cached for the object is forgotten.
+ *
+ * A result is only cached if no invalidation at all has arrived since its request was sent, as one may be about
+ * the state the result was read from and have overtaken the reply. The cache is kept under resultCacheBudget by
+ * forgetting the least recently used results first.
+ *
+ * Each result is on two lists: every result in the order of use, and those of the same remote object. Using,
+ * forgetting or invalidating a result then never needs to look at any of the others.
+ */
+
+typedef struct DCNSCachedResult {
+    NSArray *key;           // retained, as is the value
+    id value;
+    NSUInteger cost;
+    struct DCNSCachedResult *older, *newer;
+    struct DCNSCachedResult *previousForReference, *nextForReference;
+} DCNSCachedResult;
+
+// The hash of an NSArray is only its count, which would put every key for the same number of arguments
+// in one bucket, so keys are hashed by what is in them.
+static CFHashCode _DCNSResultKeyHash(const void *value) {
+    CFHashCode hash = 0;
+    
+    for (id element in (NSArray *)value)
+        hash = hash * 31 + [element hash];
+    
+    return hash;
+}
+
+static Boolean _DCNSResultKeyEqual(const void *a, const void *b) {
+    return [(NSArray *)a isEqualToArray:(NSArray *)b];
+}
+
+- (id)_cachedResultForKey:(NSArray *)key {
+    DCNSCachedResult *result;
+    id value = nil;
+    
+    [_resultCacheLock lock];
+    
+    result = _resultCache ? (DCNSCachedResult *)CFDictionaryGetValue(_resultCache, key) : NULL;
+    if (result) {
+        value = [[result->value retain] autorelease];
+        
+        // Now the most recently used.
+        if (result != _newestCachedResult) {
+            result->newer->older = result->older;
+            if (result->older)
+                result->older->newer = result->newer;
+            else
+                _oldestCachedResult = result->newer;
+            
+            result->older = _newestCachedResult;
+            result->newer = NULL;
+            _newestCachedResult->newer = result;
+            _newestCachedResult = result;
+        }
+    }
+    
+    [_resultCacheLock unlock];
+    
+    return value;
+}
+
+- (unsigned int)_resultCacheGeneration {
+    unsigned int generation;
+    
+    [_resultCacheLock lock];
+    generation = _resultCacheGeneration;
+    [_resultCacheLock unlock];
+    
+    return generation;
+}
+
+// These must be called with _resultCacheLock held.
+
+- (void)_removeCachedResult:(DCNSCachedResult *)result {
+    if (result->older)
+        result->older->newer = result->newer;
+    else
+        _oldestCachedResult = result->newer;
+    if (result->newer)
+        result->newer->older = result->older;
+    else
+        _newestCachedResult = result->older;
+    
+    if (result->nextForReference)
+        result->nextForReference->previousForReference = result->previousForReference;
+    if (result->previousForReference)
+        result->previousForReference->nextForReference = result->nextForReference;
+    else if (result->nextForReference)
+        CFDictionarySetValue(_resultCacheByReference, [result->key objectAtIndex:0], result->nextForReference);
+    else
+        CFDictionaryRemoveValue(_resultCacheByReference, [result->key objectAtIndex:0]);
+    
+    _resultCacheCost -= result->cost;
+    CFDictionaryRemoveValue(_resultCache, result->key);
+    
+    [result->key release];
+    [result->value release];
+    free(result);
+}
+
+- (void)_removeAllCachedResults {
+    while (_oldestCachedResult)
+        [self _removeCachedResult:_oldestCachedResult];
+    
+    if (_resultCache) {
+        CFRelease(_resultCache);
+        CFRelease(_resultCacheByReference);
+        _resultCache = _resultCacheByReference = NULL;
+    }
+}
+
+- (void)_cacheResult:(id)value cost:(NSUInteger)cost forKey:(NSArray *)key generation:(unsigned int)generation {
+    NSUInteger budget = self.resultCacheBudget;
+    
+    [_resultCacheLock lock];
+    
+    if (_isValid && generation == _resultCacheGeneration && cost <= budget && !(_resultCache && CFDictionaryContainsKey(_resultCache, key))) {
+        DCNSCachedResult *result = calloc(1, sizeof(DCNSCachedResult));
+        NSNumber *reference = [key objectAtIndex:0];
+        
+        if (!_resultCache) {
+            CFDictionaryKeyCallBacks callbacks = kCFTypeDictionaryKeyCallBacks;
+            callbacks.equal = _DCNSResultKeyEqual;
+            callbacks.hash = _DCNSResultKeyHash;
+            
+            _resultCache = CFDictionaryCreateMutable(NULL, 0, &callbacks, NULL);
+            _resultCacheByReference = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+        }
+        
+        while (_resultCacheCost + cost > budget && _oldestCachedResult)
+            [self _removeCachedResult:_oldestCachedResult];
+        
+        result->key = [key copy];
+        result->value = [value retain];
+        result->cost = cost;
+        
+        result->older = _newestCachedResult;
+        if (_newestCachedResult)
+            _newestCachedResult->newer = result;
+        else
+            _oldestCachedResult = result;
+        _newestCachedResult = result;
+        
+        result->nextForReference = (DCNSCachedResult *)CFDictionaryGetValue(_resultCacheByReference, reference);
+        if (result->nextForReference)
+            result->nextForReference->previousForReference = result;
+        CFDictionarySetValue(_resultCacheByReference, reference, result);
+        
+        CFDictionarySetValue(_resultCache, result->key, result);
+        _resultCacheCost += cost;
+    }
+    
+    [_resultCacheLock unlock];
+}
+
+- (void)_removeCachedResultsForReference:(unsigned int)ref {
+    DCNSCachedResult *result;
+    
+    [_resultCacheLock lock];
+    if (_resultCacheByReference) {
+        while ((result = (DCNSCachedResult *)CFDictionaryGetValue(_resultCacheByReference, [NSNumber numberWithUnsignedInt:ref])))
+            [self _removeCachedResult:result];
+    }
+    [_resultCacheLock unlock];
+}
+
+- (void)_sendInvalidationOfReference:(unsigned int)ref {
+    if (_peerWireFeatures & DCNS_WIRE_FEATURE_RESULT_INVALIDATION)
+        [self _sendOnewayToRemote:@selector(_invalidateCachedResultsForReference:) argument:&ref];
+}
+
+- (oneway void)_invalidateCachedResultsForReference:(unsigned int)ref {
+#if DEBUG_LOG_LEVEL>=2
+    NSLog(@"DCNSConnection: -_invalidateCachedResultsForReference: %u", ref);
+#endif
+    
+    [_resultCacheLock lock];
+    _resultCacheGeneration++;
+    [_resultCacheLock unlock];
+    
+    [self _removeCachedResultsForReference:ref];
+}
+
 @end
 
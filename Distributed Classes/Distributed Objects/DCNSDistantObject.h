@@ -26,17 +26,26 @@
 #import <objc/runtime.h>
 
 @class DCNSConnection;
+@class NSArray;
+@class NSDictionary;
 @class NSMutableDictionary;
+@class NSHashTable;
+
+// Raised when a method signature cannot be found for a selector.
+extern NSString *const DCNSMethodSignatureException;
 
 /**
  Proxies messages to a given "real" object, whether in the local process or remote.
  */
 @interface DCNSDistantObject : NSProxy  <NSCoding> {
-	DCNSConnection *_connection;	        // retained for local objects
+	DCNSConnection *_connection;	        // retained
 	id _local;	                            // retained dependent object if we are a local proxy
 	unsigned int _remote;	                // reference address/number (same on both sides)
 	Protocol *_protocol;                    // the protocol the proxied object responds to, if available.
-	NSMutableDictionary *_selectorCache;	// caches the method signatures we have asked for
+	unsigned long long _remoteClass;        // identifies the remote object's class to the shared signature cache, 0 if unknown
+	NSMutableDictionary *_selectorCache;	// caches the method signatures we have asked for, if _remoteClass is unknown or its connection has no room left in the shared cache
+	unsigned int _wireCount;	            // how many times our reference has been sent (local) or received (remote)
+	NSHashTable *_cacheableSelectors;	    // selectors whose results may be cached, if any
 }
 
 /** Creating the Proxy */
@@ -85,6 +94,58 @@
  */
 - (void)setProtocolForProxy:(Protocol *)aProtocol;
 
+/** @name Reading Several Values */
+
+/**
+ Reads the values of several keys of the real object, as with <code>-valueForKey:</code>, in a single message.
+ @discussion Values that would go by copy as a result of any other method do so here; other objects are returned as
+ proxies. A nil value is given as <code>NSNull</code>. When the remote does not support this, each key is read in turn.
+ @param keys The keys to read.
+ @return The values of the keys, by key.
+ */
+- (NSDictionary *)dc_valuesForKeys:(NSArray *)keys;
+
+/**
+ Reads the values of several keys of the real object into the members of a struct, in a single message.
+ @discussion The struct has one member for each key, in the same order, each either a number or a struct that the
+ value of its key is an NSValue of. Numbers are converted to the type of their member. For example:
+ <pre>
+ struct { double width; BOOL hidden; } fields;
+ [proxy dc_getValues:&fields ofObjCType:@encode(typeof(fields)) forKeys:@[@"width", @"hidden"]];
+ </pre>
+ An exception is raised if a member cannot be set from its value.
+ @param values The struct to fill in.
+ @param type The Objective-C type encoding of the struct.
+ @param keys The keys to read.
+ */
+- (void)dc_getValues:(void *)values ofObjCType:(const char *)type forKeys:(NSArray *)keys;
+
+/** @name Caching Results */
+
+/**
+ Declares that the given method of the real object has no side effects, and returns a value that only changes
+ when the object does. Its results are then kept by the connection and reused for calls with the same arguments,
+ until the remote says the object has changed with <code>+dc_invalidateCachedResultsForObject:</code>.<br/>
+ Only results that are numbers, structs of them, or property list objects are cached, and only for calls whose
+ arguments are the same. This has no effect on proxies to local objects, or when the remote does not support it.
+ @param selector The selector of the method whose results may be cached.
+ */
+- (void)dc_cacheResultsForSelector:(SEL)selector;
+
+/**
+ Declares that every instance method of the given protocol, and the protocols it adopts, may have its results
+ cached, as for <code>-dc_cacheResultsForSelector:</code>.
+ @param protocol The protocol made up of the methods whose results may be cached.
+ */
+- (void)dc_cacheResultsForProtocol:(Protocol *)protocol;
+
+/**
+ Tells every remote that has been sent the given object that results cached from it are no longer valid. This
+ should be called after any change to the object that the results of its cached methods depend on.
+ @param object The local object that has changed.
+ */
++ (void)dc_invalidateCachedResultsForObject:(id)object;
+
 /** @name Extra Lifecycle Methods */
 
 /**
@@ -27,6 +27,7 @@
 #import <Foundation/NSRunLoop.h>
 #import "DCNSConnection.h"
 #import "DCNSConnection-NSUndocumented.h"
+#import "DCNSConnection-NSPrivate.h"
 #import "DCNSDistantObject.h"
 #import <Foundation/NSPort.h>
 #import "DCNSPortCoder.h"
@@ -37,11 +38,14 @@
 #import <Foundation/NSValue.h>
 #import <Foundation/NSString.h>
 #import <Foundation/NSDate.h>
+#import <Foundation/NSNull.h>
 #import <Foundation/NSException.h>
 #import <Foundation/NSLock.h>
+#import <Foundation/NSHashTable.h>
 #import <Foundation/NSThread.h>
 #import <Foundation/NSNotification.h>
 #import <Foundation/NSInvocation.h>
+#import <Foundation/NSKeyValueCoding.h>
 #import <Foundation/NSMethodSignature.h>
 #import <Foundation/NSObjCRuntime.h>
 
@@ -86,21 +90,306 @@
     return n;
 }
 
+static NSData *_DCNSPackValuesForKeys(NSDictionary *values, NSArray *keys, const char *types);
+
+// The remote asks us for signatures through -methodDescriptionForSelector:, which above depends only on our class. An
+// object that answers for itself may answer differently from others of its class, so it has no class to share with them.
+static Class _DCNSClassForProxySignatures(Class c, Class root) {
+    SEL sel = @selector(methodDescriptionForSelector:);
+    
+    if (class_getMethodImplementation(c, sel) != class_getMethodImplementation(root, sel))
+        return Nil;
+    
+    return c;
+}
+
++ (Class)_classForProxySignatures {
+    return _DCNSClassForProxySignatures(object_getClass(self), object_getClass([NSObject class]));
+}
+
+- (Class)_classForProxySignatures {
+    return _DCNSClassForProxySignatures(object_getClass(self), [NSObject class]);
+}
+
++ (Class)_classForProxySignaturesOfInstances {
+    return _DCNSClassForProxySignatures(self, [NSObject class]);
+}
+
+// Reading several keys at once is answered here, so that a proxy needs only one message for all of them.
+
+- (bycopy NSDictionary *)_dc_valuesForKeys:(bycopy NSArray *)keys {
+    NSMutableDictionary *values = [NSMutableDictionary dictionaryWithCapacity:[keys count]];
+    NSUInteger i;
+    
+    for (i = 0; i < [keys count]; i++) {
+        NSString *key = [keys objectAtIndex:i];
+        id value = [self valueForKey:key];
+        
+        [values setObject:(value ? value : [NSNull null]) forKey:key];
+    }
+    
+    return values;
+}
+
+- (bycopy NSData *)_dc_packedValuesForKeys:(bycopy NSArray *)keys objCTypes:(bycopy NSString *)types {
+    return _DCNSPackValuesForKeys([self _dc_valuesForKeys:keys], keys, [types UTF8String]);
+}
+
 @end
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark Global variables
 
-// Collects all NSDistantObjects to make them exist only once
-static NSHashTable *distantObjects;
-
-// Maps all existing NSDistantObjects to access them by remote reference - which is unique
-static NSMapTable *distantObjectsByRef;
-
 static Class _doClass;
+static id _cachedNil;	// stands in for nil in cached keys and results
 
 NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Proxy table
+
+/*
+ * Every local proxy has a slot in one table, and the reference number we send the remote for it is the index of
+ * that slot tagged with the slot's generation, which changes each time the slot is freed. Finding the proxy for a
+ * reference the remote sends back is then an array index, and a reference to a proxy that has since gone away
+ * can't find whichever proxy took its slot next. Slots are handed out in slabs that never move, least recently
+ * freed first, so that a generation takes as long as possible to come round again.
+ *
+ * The table is split into stripes, each with its own lock, slabs and free slots; slot n belongs to stripe
+ * n % PROXY_TABLE_STRIPES. A connection takes slots from a stripe picked by its address, moving on to the next
+ * only if that one is full, so proxies being created for different connections rarely wait for each other.
+ *
+ * References are still 32 bits on the wire: 20 bits of slot and 12 of generation, which is never 0 so neither is
+ * a reference (0 is the connection). A slot whose generation would wrap is retired instead of freed, as a reference
+ * the remote still held from its first use would find the new proxy.
+ *
+ * Finding a proxy by its object or by a remote's reference is done with the tables of its connection, which are
+ * keyed by address or by number rather than by asking the objects involved, and guarded by the connection's
+ * -_proxiesLock. Where both are needed, that lock is taken before a stripe's.
+ */
+
+#define PROXY_TABLE_SLOT_BITS 20
+#define PROXY_TABLE_SLOT_MASK ((1u << PROXY_TABLE_SLOT_BITS) - 1)
+#define PROXY_TABLE_GENERATION_MASK ((1u << (32 - PROXY_TABLE_SLOT_BITS)) - 1)
+#define PROXY_TABLE_STRIPES 16
+#define PROXY_TABLE_SLAB_SIZE 1024
+#define PROXY_TABLE_MAX_SLABS ((PROXY_TABLE_SLOT_MASK + 1) / PROXY_TABLE_STRIPES / PROXY_TABLE_SLAB_SIZE)
+
+typedef struct {
+    DCNSDistantObject *proxy;   // not retained, nil if the slot is free
+    unsigned int generation;    // tags references to the slot's current proxy
+    unsigned int nextFree;      // the next free index in the stripe + 1 (0 for none), if the slot is free
+} DCNSProxyTableEntry;
+
+typedef struct {
+    NSLock *lock;               // guards the stripe, and the wire counts of the proxies in it
+    DCNSProxyTableEntry *slabs[PROXY_TABLE_MAX_SLABS];
+    unsigned int usedSlots;     // indexes below this have been handed out at least once
+    unsigned int freeSlots;     // the first free index + 1, 0 for none
+    unsigned int lastFreeSlot;  // the last free index + 1, 0 for none
+} DCNSProxyTableStripe;
+
+static DCNSProxyTableStripe _proxyTable[PROXY_TABLE_STRIPES];
+
+static inline DCNSProxyTableStripe *_DCNSProxyTableStripe(unsigned int ref) {
+    return &_proxyTable[(ref & PROXY_TABLE_SLOT_MASK) % PROXY_TABLE_STRIPES];
+}
+
+static inline DCNSProxyTableEntry *_DCNSProxyTableEntry(DCNSProxyTableStripe *stripe, unsigned int index) {
+    return &stripe->slabs[index / PROXY_TABLE_SLAB_SIZE][index % PROXY_TABLE_SLAB_SIZE];
+}
+
+static unsigned int _DCNSProxyTableInsertInStripe(unsigned int stripeIndex, DCNSDistantObject *proxy) {
+    DCNSProxyTableStripe *stripe = &_proxyTable[stripeIndex];
+    DCNSProxyTableEntry *entry;
+    unsigned int index, ref;
+    
+    [stripe->lock lock];
+    
+    if (stripe->freeSlots) {
+        index = stripe->freeSlots - 1;
+        entry = _DCNSProxyTableEntry(stripe, index);
+        stripe->freeSlots = entry->nextFree;
+        if (!stripe->freeSlots)
+            stripe->lastFreeSlot = 0;
+    } else {
+        index = stripe->usedSlots;
+        
+        if (index / PROXY_TABLE_SLAB_SIZE >= PROXY_TABLE_MAX_SLABS) {
+            [stripe->lock unlock];
+            return 0;	// full
+        }
+        
+        if (index % PROXY_TABLE_SLAB_SIZE == 0) {
+            stripe->slabs[index / PROXY_TABLE_SLAB_SIZE] = calloc(PROXY_TABLE_SLAB_SIZE, sizeof(DCNSProxyTableEntry));
+            if (!stripe->slabs[index / PROXY_TABLE_SLAB_SIZE]) {
+                [stripe->lock unlock];
+                return 0;
+            }
+        }
+        
+        entry = _DCNSProxyTableEntry(stripe, index);
+        entry->generation = 1;
+        stripe->usedSlots++;
+    }
+    
+    entry->proxy = proxy;
+    entry->nextFree = 0;
+    ref = (entry->generation << PROXY_TABLE_SLOT_BITS) | (index * PROXY_TABLE_STRIPES + stripeIndex);
+    
+    [stripe->lock unlock];
+    
+    return ref;
+}
+
+static unsigned int _DCNSProxyTableInsert(DCNSDistantObject *proxy, DCNSConnection *connection) {
+    unsigned int home = (unsigned int)(((uintptr_t)connection >> 4) ^ ((uintptr_t)connection >> 12)) % PROXY_TABLE_STRIPES;
+    unsigned int i, ref = 0;
+    
+    for (i = 0; i < PROXY_TABLE_STRIPES && ref == 0; i++)
+        ref = _DCNSProxyTableInsertInStripe((home + i) % PROXY_TABLE_STRIPES, proxy);
+    
+    return ref;
+}
+
+// These must be called with the lock of the stripe of ref held.
+
+static DCNSDistantObject *_DCNSProxyTableGet(unsigned int ref) {
+    DCNSProxyTableStripe *stripe = _DCNSProxyTableStripe(ref);
+    unsigned int index = (ref & PROXY_TABLE_SLOT_MASK) / PROXY_TABLE_STRIPES;
+    DCNSProxyTableEntry *entry;
+    
+    if (index >= stripe->usedSlots)
+        return nil;
+    
+    entry = _DCNSProxyTableEntry(stripe, index);
+    if (entry->generation != ref >> PROXY_TABLE_SLOT_BITS)
+        return nil;	// a proxy that has gone away, or never existed
+    
+    return entry->proxy;
+}
+
+static void _DCNSProxyTableRemove(unsigned int ref) {
+    DCNSProxyTableStripe *stripe = _DCNSProxyTableStripe(ref);
+    unsigned int index = (ref & PROXY_TABLE_SLOT_MASK) / PROXY_TABLE_STRIPES;
+    DCNSProxyTableEntry *entry = _DCNSProxyTableEntry(stripe, index);
+    
+    entry->proxy = nil;
+    entry->generation = (entry->generation + 1) & PROXY_TABLE_GENERATION_MASK;
+    entry->nextFree = 0;
+    
+    // Retired; no reference has a generation of 0, so nothing can find it again.
+    if (entry->generation == 0)
+        return;
+    
+    // Freed slots join the end of the list.
+    if (stripe->lastFreeSlot)
+        _DCNSProxyTableEntry(stripe, stripe->lastFreeSlot - 1)->nextFree = index + 1;
+    else
+        stripe->freeSlots = index + 1;
+    stripe->lastFreeSlot = index + 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Shared method signatures
+
+/*
+ * Asking the remote for a method signature is a synchronous round trip, and used to be done again by every proxy,
+ * even for objects of a class another proxy had already asked about. Instead, the remote tells us an identity for
+ * the class of each object it sends us a reference to, and the signatures we learn are shared by every proxy for an
+ * object of that class on the same connection.
+ *
+ * The identity is a number the remote hands out per connection as it first sends each class, so it gives nothing
+ * away about the remote's memory, and is only meaningful on the connection it came over, hence the connection
+ * being part of the key. The connection removes its entries when it goes away, before its address can be reused.
+ * Proxies whose class we don't know (the root proxy, or anything from a remote that predates this) keep a cache of
+ * their own as before.
+ *
+ * Each connection may only fill its share of the cache, so that one remote with many classes can't keep the others
+ * out. Once a connection's share is used up, its proxies go back to keeping the signatures they learn themselves.
+ */
+
+// Guards against a remote making us cache signatures for an absurd number of classes.
+#define SIGNATURE_CACHE_MAX_ENTRIES 8192
+#define SIGNATURE_CACHE_MAX_ENTRIES_PER_CONNECTION 1024
+
+typedef struct {
+    DCNSConnection *connection;
+    unsigned long long remoteClass;
+    SEL selector;
+} DCNSSignatureKey;
+
+static const void *_DCNSSignatureKeyRetain(CFAllocatorRef allocator, const void *value) {
+    DCNSSignatureKey *copy = malloc(sizeof(DCNSSignatureKey));
+    
+    *copy = *(const DCNSSignatureKey *)value;
+    return copy;
+}
+
+static void _DCNSSignatureKeyRelease(CFAllocatorRef allocator, const void *value) {
+    free((void *)value);
+}
+
+static Boolean _DCNSSignatureKeyEqual(const void *a, const void *b) {
+    const DCNSSignatureKey *x = a, *y = b;
+    return x->connection == y->connection && x->remoteClass == y->remoteClass && x->selector == y->selector;
+}
+
+static CFHashCode _DCNSSignatureKeyHash(const void *value) {
+    const DCNSSignatureKey *key = value;
+    return (CFHashCode)(uintptr_t)key->connection ^ (CFHashCode)(key->remoteClass * 31) ^ (CFHashCode)(uintptr_t)key->selector;
+}
+
+static NSLock *_signaturesLock;
+static CFMutableDictionaryRef _signatures;	// DCNSSignatureKey -> NSMethodSignature
+static CFMutableDictionaryRef _signatureCounts;	// DCNSConnection * -> number of its entries in _signatures
+
+// Signatures of the messages we send to any proxy ourselves, which we don't need to ask for.
+static NSMethodSignature *_methodDescriptionSignature;
+static NSMethodSignature *_respondsToSelectorSignature;
+static NSMethodSignature *_rootObjectSignature;
+static NSMethodSignature *_valuesForKeysSignature;
+static NSMethodSignature *_packedValuesForKeysSignature;
+
+static NSMethodSignature *_DCNSSharedSignature(DCNSConnection *connection, unsigned long long remoteClass, SEL selector) {
+    DCNSSignatureKey key = { connection, remoteClass, selector };
+    NSMethodSignature *sig;
+    
+    [_signaturesLock lock];
+    sig = [[(NSMethodSignature *)CFDictionaryGetValue(_signatures, &key) retain] autorelease];
+    [_signaturesLock unlock];
+    
+    return sig;
+}
+
+static BOOL _DCNSSetSharedSignature(DCNSConnection *connection, unsigned long long remoteClass, SEL selector, NSMethodSignature *sig) {
+    // Returns NO if the connection has no room left in the cache, for the caller to keep the signature itself.
+    DCNSSignatureKey key = { connection, remoteClass, selector };
+    BOOL stored = YES;
+    
+    [_signaturesLock lock];
+    if (!CFDictionaryContainsKey(_signatures, &key)) {
+        uintptr_t count = (uintptr_t)CFDictionaryGetValue(_signatureCounts, connection);
+        
+        if (count < SIGNATURE_CACHE_MAX_ENTRIES_PER_CONNECTION && CFDictionaryGetCount(_signatures) < SIGNATURE_CACHE_MAX_ENTRIES)
+            CFDictionarySetValue(_signatureCounts, connection, (const void *)(count + 1));
+        else
+            stored = NO;
+    }
+    if (stored)
+        CFDictionarySetValue(_signatures, &key, sig);
+    [_signaturesLock unlock];
+    
+    return stored;
+}
+
+static void _DCNSCollectSignaturesForConnection(const void *key, const void *value, void *context) {
+    void **args = context;
+    
+    if (((const DCNSSignatureKey *)key)->connection == args[0])
+        CFArrayAppendValue((CFMutableArrayRef)args[1], key);
+}
+
 @implementation DCNSDistantObject
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -109,8 +398,97 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
 + (void) initialize {
     _doClass = [DCNSDistantObject class];
     
-    distantObjects = NSCreateHashTable(NSNonRetainedObjectHashCallBacks, 100);
-    distantObjectsByRef = NSCreateMapTable(NSIntegerMapKeyCallBacks, NSNonRetainedObjectMapValueCallBacks, 100);
+    if (!_cachedNil)
+        _cachedNil = [[NSObject alloc] init];
+    
+    for (unsigned int i = 0; i < PROXY_TABLE_STRIPES; i++)
+        if (!_proxyTable[i].lock)
+            _proxyTable[i].lock = [[NSLock alloc] init];
+    
+    if (!_signaturesLock) {
+        CFDictionaryKeyCallBacks callbacks = { 0, _DCNSSignatureKeyRetain, _DCNSSignatureKeyRelease, NULL, _DCNSSignatureKeyEqual, _DCNSSignatureKeyHash };
+        
+        _signaturesLock = [[NSLock alloc] init];
+        _signatures = CFDictionaryCreateMutable(NULL, 0, &callbacks, &kCFTypeDictionaryValueCallBacks);
+        _signatureCounts = CFDictionaryCreateMutable(NULL, 0, NULL, NULL);
+        
+        _methodDescriptionSignature = [[NSObject instanceMethodSignatureForSelector:@selector(methodDescriptionForSelector:)] retain];
+        _respondsToSelectorSignature = [[NSObject instanceMethodSignatureForSelector:@selector(respondsToSelector:)] retain];
+        _rootObjectSignature = [[DCNSConnection instanceMethodSignatureForSelector:@selector(rootObject)] retain];
+        _valuesForKeysSignature = [[NSObject instanceMethodSignatureForSelector:@selector(_dc_valuesForKeys:)] retain];
+        _packedValuesForKeysSignature = [[NSObject instanceMethodSignatureForSelector:@selector(_dc_packedValuesForKeys:objCTypes:)] retain];
+    }
+}
+
++ (void)_setSignature:(NSMethodSignature *)sig forSelector:(SEL)selector remoteClass:(unsigned long long)remoteClass connection:(DCNSConnection *)connection {
+    // For signatures the remote has told us about in advance, such as in a ClassDescription.
+    // Any that don't fit are asked for again when they are needed.
+    _DCNSSetSharedSignature(connection, remoteClass, selector, sig);
+}
+
++ (void)_removeSignaturesForConnection:(DCNSConnection *)connection {
+    CFMutableArrayRef keys = CFArrayCreateMutable(NULL, 0, NULL);
+    void *args[2] = { connection, keys };
+    CFIndex i;
+    
+    [_signaturesLock lock];
+    CFDictionaryApplyFunction(_signatures, _DCNSCollectSignaturesForConnection, args);
+    for (i = 0; i < CFArrayGetCount(keys); i++)
+        CFDictionaryRemoveValue(_signatures, CFArrayGetValueAtIndex(keys, i));	// the key is freed here
+    CFDictionaryRemoveValue(_signatureCounts, connection);
+    [_signaturesLock unlock];
+    
+    CFRelease(keys);
+}
+
++ (void)_releaseLocalReference:(unsigned int)ref wireCount:(unsigned int)count connection:(DCNSConnection *)connection {
+    // The remote's proxy went away after receiving our reference count times.
+    DCNSProxyTableStripe *stripe = _DCNSProxyTableStripe(ref);
+    DCNSDistantObject *proxy;
+    BOOL drop = NO;
+    
+    [stripe->lock lock];
+    proxy = _DCNSProxyTableGet(ref);
+    if (proxy && proxy->_connection == connection && proxy->_wireCount != 0) {
+        // A confused remote mustn't take away references that other proxies may still be holding.
+        proxy->_wireCount -= MIN(count, proxy->_wireCount);
+        drop = (proxy->_wireCount == 0);
+    }
+    [stripe->lock unlock];
+    
+    if (drop)
+        [proxy release];	// balances the retain of the first -encodeWithCoder:
+}
+
++ (void)_releaseLocalReferencesForConnection:(DCNSConnection *)connection {
+    NSMutableArray *proxies = [NSMutableArray array];
+    NSLock *lock = [connection _proxiesLock];
+    NSMapEnumerator e;
+    void *key;
+    DCNSDistantObject *proxy;
+    NSUInteger i;
+    
+    [lock lock];
+    e = NSEnumerateMapTable(connection.localObjects);
+    while (NSNextMapEnumeratorPair(&e, &key, (void **)&proxy)) {
+        DCNSProxyTableStripe *stripe = _DCNSProxyTableStripe(proxy->_remote);
+        BOOL held;
+        
+        [stripe->lock lock];
+        held = (proxy->_wireCount != 0);
+        proxy->_wireCount = 0;
+        [stripe->lock unlock];
+        
+        if (held)
+            [proxies addObject:proxy];
+    }
+    NSEndMapTableEnumeration(&e);
+    [lock unlock];
+    
+    // Releasing takes the lock, and deallocating changes the table, so wait until we have finished with it.
+    for (i = 0; i < [proxies count]; i++)
+        [[proxies objectAtIndex:i] release];	// balances the retain of the first -encodeWithCoder:
+    [proxies removeAllObjects];
 }
 
 + (instancetype)proxyWithLocal:(id)anObject connection:(DCNSConnection*)aConnection {
@@ -130,13 +508,7 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
 - (instancetype)init {
     // *** No need to [super init] because we are subclass of NSProxy
     
-    _selectorCache = [[NSMutableDictionary alloc] initWithCapacity:10];
-    
-    // FIXME: Should there be a global cache? If yes, how to handle conflicting signatures for different classes?
-    
-    // Pre-define NSMethodSignature cache
-    [_selectorCache setObject:[NSObject instanceMethodSignatureForSelector:@selector(methodDescriptionForSelector:)] forKey:@"methodDescriptionForSelector:"];
-    [_selectorCache setObject:[NSObject instanceMethodSignatureForSelector:@selector(respondsToSelector:)] forKey:@"respondsToSelector:"];
+    // Method signatures are cached in the shared cache, or in _selectorCache if that is not possible.
     
     return self;
 }
@@ -144,9 +516,8 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
 - (instancetype)initWithLocal:(id)localObject connection:(DCNSConnection*)aConnection {
     // This is initialization for vending objects
     
-    unsigned int remoteObjectId;
-    static unsigned int nextReference = 1;	// shared between all connections and unique for this address space
     DCNSDistantObject *proxy;
+    NSLock *lock;
     
     // If missing data, return nil.
     if(!aConnection || !localObject) {
@@ -157,65 +528,51 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
     _connection = aConnection;
     [_connection retain];
     
-    _local = localObject;
+    lock = [aConnection _proxiesLock];
+    [lock lock];
     
-    // Returns nil or any object that -isEqual:
-    proxy = NSHashGet(distantObjects, self);
+    proxy = [aConnection _getLocal:localObject];
     
     if (proxy) {
         // Already known
+        [proxy retain];	// retain and substitute the existing proxy
+        [lock unlock];
         
 #if DEBUG_LOG_LEVEL>=1
         NSLog(@"local proxy for %@ already known: %@", localObject, proxy);
 #endif
-        // Avoid that the proxy is deleted from the NSHashTable!
-        _local = nil;
         
         [self release];	// release current object
-        return [proxy retain];	// retain and substitute the existing proxy
+        return proxy;
+    }
+    
+    // Reference numbers rather than addresses, to be able to mix 32 and 64 bit address spaces
+    _remote = _DCNSProxyTableInsert(self, aConnection);
+    
+    if (_remote == 0) {
+        [lock unlock];
+        [self release];
+        [NSException raise:NSInternalInconsistencyException format:@"Too many objects have been sent by reference"];
     }
     
+    _local = localObject;
+    [aConnection _addLocalDistantObject:self forLocal:_local andRemote:(id)(uintptr_t)_remote];
     [aConnection _incrementLocalProxyCount];
     
+    [lock unlock];
+    
     // Retain the local object as long as we exist
     [_local retain];
     
     // initialize more parts
     self = [self init];
     
-    remoteObjectId = nextReference++;	// assign serial numbers to be able to mix 32 and 64 bit address spaces
-    
-    _remote = remoteObjectId;
-    
-    NSHashInsertKnownAbsent(distantObjects, self);
-    NSMapInsertKnownAbsent(distantObjectsByRef, INT2VOIDP(_remote), self);
-    
 #if DEBUG_LOG_LEVEL>=1
-    NSLog(@"distantObjects: %lu byRef: %lu", (unsigned long)NSCountHashTable(distantObjects), (unsigned long)NSCountMapTable(distantObjectsByRef));
+    NSLog(@"new local proxy (ref=%u) for %@", _remote, localObject);
 #endif
     
-    // FIXME: life cycle management is still broken
-    
-    /*
-     * what is the issue?
-     * if we send a local object byref, it gets wrapped into this initWithLocal object
-     * and we have to retain the NSDistantObject until...
-     * ... until when?
-     * basically as long a the connection exists
-     * because the peer can retain its NSDistantObject
-     * and ask to access our local object hours later.
-     *
-     * So we may need to observe NSConnectionDidDieNotification
-     * and release all local objects of that connection
-     *
-     * Unless there is a mechanism that the other end can notify that
-     * it has deallocated its last reference.
-     *
-     * But I have not yet found a hint that such a mechanism exists
-     * in the protocol.
-     */
-    
-    [self retain];
+    // We don't keep ourselves (and so the local object) alive until our reference is sent to the remote,
+    // which then keeps us alive until it tells us it is done with it; see -encodeWithCoder:.
     
     return self;
 }
@@ -223,6 +580,7 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
 - (instancetype)initWithTarget:(unsigned int)remoteObject connection:(DCNSConnection*)aConnection {
     // remoteObject is an id (without local meaning!) in another thread or another application in their address space!
     DCNSDistantObject *proxy;
+    NSLock *lock;
     
     // No connection, no object
     if (!aConnection) {
@@ -230,33 +588,33 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
         return nil;
     }
     
-    _connection = aConnection;	// we are retained by the connection so don't leak
-    _remote = (unsigned int)remoteObject;
+    _connection = aConnection;	// retained, as our reference number means nothing without it
+    [_connection retain];
     
-    // Returns nil or any object that -isEqual:
-    proxy = NSHashGet(distantObjects, self);
+    lock = [aConnection _proxiesLock];
+    [lock lock];
+    
+    proxy = [aConnection _getRemote:(id)(uintptr_t)remoteObject];
     
     if (proxy) {
         // We already have a proxy for this target
+        [proxy retain];	// retain the existing proxy once
+        [lock unlock];
+        
 #if DEBUG_LOG_LEVEL>=1
         NSLog(@"remote proxy for %d already known: %@", remoteObject, proxy);
 #endif
         
         [self release];	// release newly allocated object
-        return [proxy retain];	// retain the existing proxy once
+        return proxy;
     }
     
-    self = [self init];
+    _remote = (unsigned int)remoteObject;
+    [aConnection _addRemoteDistantObject:self forRemote:(id)(uintptr_t)_remote];
     
-    // root proxy
-    if (remoteObject == 0) {
-        NSMethodSignature *ms = [aConnection methodSignatureForSelector:@selector(rootObject)];
-        
-        if(ms)	// don't assume it exists
-            [_selectorCache setObject:ms forKey:@"rootObject"]; 	// predefine NSMethodSignature cache
-    }
+    [lock unlock];
     
-    NSHashInsertKnownAbsent(distantObjects, self);
+    self = [self init];
     
 #if DEBUG_LOG_LEVEL>=2
     NSLog(@"new remote proxy (ref=%u) initialized: %@", (unsigned int) remoteObject, self);
@@ -268,28 +626,34 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
 - (instancetype)initWithCoder:(NSCoder *)coder {
     unsigned int ref;
     BOOL flag1, flag2 = NO;
+    unsigned long long remoteClass = 0;
     DCNSDistantObject *proxy;
     DCNSConnection *c = [(DCNSPortCoder *)coder connection];
 
     [coder decodeValueOfObjCType:@encode(unsigned int) at:&ref];
-    _remote = ref;
     
     [coder decodeValueOfObjCType:@encode(char) at:&flag1];
 
 #if DEBUG_LOG_LEVEL>=2
-    NSLog(@"DCNSDistantObject %p initWithCoder -> ref=%u flag1=%d flag2=%d", self, _remote, flag1, flag2);
+    NSLog(@"DCNSDistantObject %p initWithCoder -> ref=%u flag1=%d flag2=%d", self, ref, flag1, flag2);
 #endif
     
+    if (flag1 == 2) {
+        // Remote object, followed by the identity of its class
+        [coder decodeValueOfObjCType:@encode(unsigned long long) at:&remoteClass];
+        flag1 = NO;
+    }
+    
     if (flag1) {
         // Local (i.e. remote seen from sender's perspective)
         // latest unit testing shows that there is no flag2!?!
         [coder decodeValueOfObjCType:@encode(char) at:&flag2];
         
 #if DEBUG_LOG_LEVEL>=2
-        NSLog(@"DCNSDistantObject %p initWithCoder -> ref=%u flag1=%d flag2=%d", self, _remote, flag1, flag2);
+        NSLog(@"DCNSDistantObject %p initWithCoder -> ref=%u flag1=%d flag2=%d", self, ref, flag1, flag2);
 #endif
         
-        if(_remote == 0) {
+        if(ref == 0) {
             
 #if DEBUG_LOG_LEVEL>=1
             NSLog(@"replace (ref=%u) by connection", ref);
@@ -298,12 +662,20 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
             return (DCNSDistantObject*)[c retain];	// refers to the connection object
         }
         
-        proxy = NSMapGet(distantObjectsByRef, INT2VOIDP(_remote));
+        // The proxy can't be released for the last time while we hold its connection's lock.
+        [[c _proxiesLock] lock];
+        [_DCNSProxyTableStripe(ref)->lock lock];
+        proxy = _DCNSProxyTableGet(ref);
+        if (proxy && proxy->_connection != c)
+            proxy = nil;	// only the remote we sent it to may use a reference
+        [_DCNSProxyTableStripe(ref)->lock unlock];
+        [proxy retain];	// retain the existing proxy once
+        [[c _proxiesLock] unlock];
         
 #if DEBUG_LOG_LEVEL>=3
         NSLog(@"proxy=%p", proxy);
 #endif
-        if(proxy && [proxy connectionForProxy] == c) {
+        if(proxy) {
             // Local proxy for this target found
             
 #if DEBUG_LOG_LEVEL>=1
@@ -311,7 +683,7 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
 #endif
             
             [self release];	// release newly allocated object
-            return [proxy retain];	// retain the existing proxy once
+            return proxy;
         }
         
 #if DEBUG_LOG_LEVEL>=1
@@ -329,7 +701,56 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
     NSLog(@"remote object reference (ref=%u) received", ref);
 #endif
     
-    return [self initWithTarget:_remote connection:c];	// initialize and replace if already known
+    self = [self initWithTarget:ref connection:c];	// initialize and replace if already known
+    
+    // Tell the remote how many times we were sent this reference when we go away.
+    if (self)
+        __sync_add_and_fetch(&_wireCount, 1);
+    
+    if (self && !_remoteClass)
+        _remoteClass = remoteClass;
+    
+    return self;
+}
+
+- (oneway void)release {
+    /*
+     * Proxies are found in their connection's tables and retained under its lock. For that to be safe, our last
+     * release has to take us out of the tables under the same lock, before anyone else can find us; so every
+     * release of a proxy with a connection is made under it, which also makes checking for the last one reliable.
+     */
+    NSLock *lock = [_connection _proxiesLock];
+    
+    if (!lock) {
+        [super release];
+        return;
+    }
+    
+    [lock lock];
+    
+    if ([self retainCount] > 1) {
+        [super release];
+        [lock unlock];
+        return;
+    }
+    
+    // Proxies that turned out to be duplicates were never added to any table.
+    if (_local) {
+        DCNSProxyTableStripe *stripe = _DCNSProxyTableStripe(_remote);
+        
+        [stripe->lock lock];
+        _DCNSProxyTableRemove(_remote);
+        [stripe->lock unlock];
+        
+        [_connection _removeLocalDistantObjectForLocal:_local andRemote:(id)(uintptr_t)_remote];
+        [_connection _decrementLocalProxyCount];
+    } else if ([_connection _getRemote:(id)(uintptr_t)_remote] == self) {
+        [_connection _removeRemoteDistantObjectForRemote:(id)(uintptr_t)_remote];
+    }
+    
+    [lock unlock];
+    
+    [super release];	// deallocates us
 }
 
 - (void)dealloc {
@@ -337,16 +758,21 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
     NSLog(@"DCNSDistantObject %p dealloc local=%p remote=%u", self, _local, _remote);
 #endif
     
+    // We were taken out of the tables by our last -release.
     if(_local) {
-        NSMapRemove(distantObjectsByRef, INT2VOIDP(_remote));
-        
         [_local release];
-        // CHECKME: _connection is not retained, i.e. may be already invalidated!
-        [_connection _decrementLocalProxyCount];
-        [_connection release];
+    } else if (_remote != 0 && _wireCount != 0) {
+        // The remote can let go of the object once it has heard from every proxy it sent the reference to.
+        [DCNSConnection _queueReleaseOfReference:_remote wireCount:_wireCount connection:_connection];
     }
     
-    NSHashRemove(distantObjects, self);
+    if (_cacheableSelectors) {
+        if (!_local)
+            [_connection _removeCachedResultsForReference:_remote];
+        NSFreeHashTable(_cacheableSelectors);
+    }
+    
+    [_connection release];
     [_selectorCache release];
     
 #if DEBUG_LOG_LEVEL>=1
@@ -416,6 +842,409 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
     return _connection;
 }
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Cached results
+
+/*
+ * A call to a method that was declared to have no side effects is looked up in the connection's cache by our
+ * reference, the selector and its arguments, and only sent if nothing was found. So that a key compares equal
+ * for equal calls, it is only made if each argument is a number or struct of numbers, taken as its bytes, a
+ * selector, taken as its name, nil, or a property list object, which is copied. Results are kept the same way.
+ *
+ * Property list objects are also the only objects that cannot share state with the remote, or keep a proxy,
+ * and with it its cached results, alive. Anything else is sent every time.
+ */
+
+static const char *_DCNSSkipTypeQualifiers(const char *type) {
+    while (*type && strchr("rnNoORV", *type))
+        type++;
+    return type;
+}
+
+// Whether a type has anything in it that only means something in this process. Struct and union names are skipped.
+static BOOL _DCNSTypeHasPointers(const char *type, const char *end) {
+    for (; type < end; type++) {
+        if (*type == _C_STRUCT_B || *type == _C_UNION_B) {
+            const char *name = type + 1;
+            
+            while (name < end && *name != '=' && *name != _C_STRUCT_E && *name != _C_UNION_E)
+                name++;
+            if (name < end && *name == '=')
+                type = name;
+        } else if (strchr("@#:*^?", *type)) {
+            return YES;
+        }
+    }
+    
+    return NO;
+}
+
+static BOOL _DCNSIsPlainType(const char *type) {
+    // Numbers, and structs, unions and arrays of them.
+    if (*type == _C_VOID || *type == '\0')
+        return NO;
+    return !_DCNSTypeHasPointers(type, type + strlen(type));
+}
+
+static NSUInteger _DCNSResultCost(id value) {
+    // The rough number of bytes it takes to keep the value, or NSNotFound if it mustn't be cached.
+    NSUInteger cost = 16;
+    
+    if (value == nil || value == _cachedNil || [value isProxy])
+        return value ? NSNotFound : cost;
+    
+    if ([value isKindOfClass:[NSString class]])
+        return cost + [(NSString *)value length] * sizeof(unichar);
+    if ([value isKindOfClass:[NSData class]])
+        return cost + [(NSData *)value length];
+    if ([value isKindOfClass:[NSNumber class]] || [value isKindOfClass:[NSDate class]] || [value isKindOfClass:[NSNull class]])
+        return cost;
+    
+    if ([value isKindOfClass:[NSArray class]]) {
+        for (id element in (NSArray *)value) {
+            NSUInteger c = _DCNSResultCost(element);
+            if (c == NSNotFound)
+                return NSNotFound;
+            cost += c;
+        }
+        return cost;
+    }
+    
+    if ([value isKindOfClass:[NSDictionary class]]) {
+        for (id key in (NSDictionary *)value) {
+            NSUInteger k = _DCNSResultCost(key);
+            NSUInteger c = _DCNSResultCost([(NSDictionary *)value objectForKey:key]);
+            if (k == NSNotFound || c == NSNotFound)
+                return NSNotFound;
+            cost += k + c;
+        }
+        return cost;
+    }
+    
+    return NSNotFound;
+}
+
+- (void)dc_cacheResultsForSelector:(SEL)selector {
+    @synchronized (self) {
+        if (!_cacheableSelectors)
+            _cacheableSelectors = NSCreateHashTable(NSNonOwnedPointerHashCallBacks, 8);
+        NSHashInsert(_cacheableSelectors, selector);
+    }
+}
+
+- (void)dc_cacheResultsForProtocol:(Protocol *)protocol {
+    Protocol * __unsafe_unretained *adopted;
+    unsigned int count, i;
+    int required;
+    
+    for (required = 0; required <= 1; required++) {
+        struct objc_method_description *methods = protocol_copyMethodDescriptionList(protocol, (BOOL)required, YES, &count);
+        
+        for (i = 0; i < count; i++)
+            [self dc_cacheResultsForSelector:methods[i].name];
+        free(methods);
+    }
+    
+    adopted = protocol_copyProtocolList(protocol, &count);
+    for (i = 0; i < count; i++) {
+        // Nothing NSObject declares is worth caching, and some of it, like -retain, mustn't be.
+        if (!protocol_isEqual(adopted[i], @protocol(NSObject)))
+            [self dc_cacheResultsForProtocol:adopted[i]];
+    }
+    free(adopted);
+}
+
++ (void)dc_invalidateCachedResultsForObject:(id)object {
+    NSArray *connections = [DCNSConnection allConnections];
+    NSUInteger i;
+    
+    for (i = 0; i < [connections count]; i++) {
+        DCNSConnection *connection = [connections objectAtIndex:i];
+        NSLock *lock = [connection _proxiesLock];
+        DCNSDistantObject *proxy;
+        BOOL sent = NO;
+        
+        if (!([connection _peerWireFeatures] & DCNS_WIRE_FEATURE_RESULT_INVALIDATION))
+            continue;
+        
+        [lock lock];
+        proxy = [[connection _getLocal:object] retain];
+        [lock unlock];
+        
+        if (proxy) {
+            // Only a remote we have sent the object to can have cached anything from it.
+            DCNSProxyTableStripe *stripe = _DCNSProxyTableStripe(proxy->_remote);
+            
+            [stripe->lock lock];
+            sent = (proxy->_wireCount != 0);
+            [stripe->lock unlock];
+            
+            if (sent)
+                [connection _sendInvalidationOfReference:proxy->_remote];
+            [proxy release];
+        }
+    }
+}
+
+- (NSArray *)_cacheKeyForInvocation:(NSInvocation *)invocation {
+    NSMethodSignature *sig = [invocation methodSignature];
+    NSMutableArray *key;
+    NSUInteger i;
+    BOOL cacheable;
+    
+    @synchronized (self) {
+        cacheable = (_cacheableSelectors && NSHashGet(_cacheableSelectors, [invocation selector]));
+    }
+    
+    if (!cacheable || !([_connection _peerWireFeatures] & DCNS_WIRE_FEATURE_RESULT_INVALIDATION))
+        return nil;
+    
+    if (!_DCNSIsPlainType(_DCNSSkipTypeQualifiers([sig methodReturnType])) &&
+        *_DCNSSkipTypeQualifiers([sig methodReturnType]) != _C_ID)
+        return nil;
+    
+    key = [NSMutableArray arrayWithCapacity:[sig numberOfArguments]];
+    [key addObject:[NSNumber numberWithUnsignedInt:_remote]];
+    [key addObject:NSStringFromSelector([invocation selector])];
+    
+    for (i = 2; i < [sig numberOfArguments]; i++) {
+        const char *type = _DCNSSkipTypeQualifiers([sig getArgumentTypeAtIndex:i]);
+        
+        if (*type == _C_ID) {
+            id arg;
+            
+            [invocation getArgument:&arg atIndex:i];
+            if (_DCNSResultCost(arg) == NSNotFound)
+                return nil;
+            [key addObject:arg ? [[arg copy] autorelease] : _cachedNil];
+        } else if (*type == _C_SEL) {
+            SEL arg;
+            
+            [invocation getArgument:&arg atIndex:i];
+            [key addObject:arg ? NSStringFromSelector(arg) : _cachedNil];
+        } else if (_DCNSIsPlainType(type)) {
+            NSUInteger size;
+            void *buffer;
+            
+            NSGetSizeAndAlignment(type, &size, NULL);
+            buffer = malloc(size);
+            [invocation getArgument:buffer atIndex:i];
+            [key addObject:[NSData dataWithBytesNoCopy:buffer length:size freeWhenDone:YES]];
+        } else {
+            return nil;
+        }
+    }
+    
+    return key;
+}
+
+- (void)_forwardCacheableInvocation:(NSInvocation *)invocation key:(NSArray *)key {
+    NSMethodSignature *sig = [invocation methodSignature];
+    BOOL isObject = (*_DCNSSkipTypeQualifiers([sig methodReturnType]) == _C_ID);
+    id result = [_connection _cachedResultForKey:key];
+    unsigned int generation;
+    NSUInteger cost;
+    
+    if (result) {
+        if (isObject) {
+            if (result == _cachedNil)
+                result = nil;
+            [invocation setReturnValue:&result];
+        } else {
+            [invocation setReturnValue:(void *)[(NSData *)result bytes]];
+        }
+        return;
+    }
+    
+    generation = [_connection _resultCacheGeneration];
+    [_connection sendInvocation:invocation internal:NO];
+    
+    if (isObject) {
+        [invocation getReturnValue:&result];
+        cost = _DCNSResultCost(result);
+        if (cost == NSNotFound)
+            return;
+        result = result ? [[result copy] autorelease] : _cachedNil;
+    } else {
+        NSMutableData *data = [NSMutableData dataWithLength:[sig methodReturnLength]];
+        
+        [invocation getReturnValue:[data mutableBytes]];
+        result = data;
+        cost = 16 + [data length];
+    }
+    
+    [_connection _cacheResult:result cost:cost forKey:key generation:generation];
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Reading several values
+
+/*
+ * A screenful of fields read one getter at a time costs a round trip for each. Instead, the keys are sent in one
+ * message, which the real object answers with -valueForKey: for each of them (see NSObject (NSDOAdditions) above),
+ * and the values come back together. Scalars can be fetched packed into a block rather than as an NSNumber or
+ * NSValue apiece, and are then laid out in the caller's struct here, by our own alignment. Numbers in the block
+ * are little-endian, as in bulk arrays and value layouts.
+ *
+ * Remotes that can't do this are asked for each key in turn, with the same result.
+ */
+
+#define _DCNS_PACK_NUMBER(ctype, getter) { ctype n = [value getter]; [data appendBytes:&n length:sizeof(n)]; break; }
+
+#ifdef __BIG_ENDIAN__
+static const char *_DCNSSwapPackedValue(char *bytes, const char *type) {
+    // Swaps each number within a value of the type between host and little-endian order. Returns the end of the type.
+    NSUInteger size, alignment, offset = 0;
+    const char *end = NSGetSizeAndAlignment(type, &size, NULL);
+    
+    if (*type == _C_STRUCT_B) {
+        const char *member = type + 1;
+        
+        while (*member != '=' && *member != _C_STRUCT_E)
+            member++;
+        if (*member == '=')
+            member++;
+        
+        while (*member != _C_STRUCT_E) {
+            NSGetSizeAndAlignment(member, &size, &alignment);
+            offset = (offset + alignment - 1) / alignment * alignment;
+            member = _DCNSSwapPackedValue(bytes + offset, member);
+            offset += size;
+        }
+    } else if (*type == _C_ARY_B) {
+        char *element;
+        unsigned long i, count = strtoul(type + 1, &element, 10);
+        
+        NSGetSizeAndAlignment(element, &size, NULL);
+        for (i = 0; i < count; i++)
+            _DCNSSwapPackedValue(bytes + i * size, element);
+    } else if (*type != _C_UNION_B) {
+        // Which member of a union is in use can't be known, so its bytes are left as they are.
+        switch (size) {
+            case 2: *(unsigned short *)bytes = NSSwapShort(*(unsigned short *)bytes); break;
+            case 4: *(unsigned int *)bytes = NSSwapInt(*(unsigned int *)bytes); break;
+            case 8: *(unsigned long long *)bytes = NSSwapLongLong(*(unsigned long long *)bytes); break;
+        }
+    }
+    
+    return end;
+}
+#endif
+
+// Appends the value of each key, converted to its type in turn, to a block with no padding between them.
+static NSData *_DCNSPackValuesForKeys(NSDictionary *values, NSArray *keys, const char *types) {
+    NSMutableData *data = [NSMutableData data];
+    NSUInteger i;
+    
+    for (i = 0; i < [keys count]; i++) {
+        NSString *key = [keys objectAtIndex:i];
+        id value = [values objectForKey:key];
+        const char *type = types;
+        NSUInteger size, start = [data length];
+        
+        if (*types == '\0')
+            [NSException raise:NSInvalidArgumentException format:@"no type given for key %@", key];
+        types = NSGetSizeAndAlignment(types, &size, NULL);
+        
+        if (*type == _C_STRUCT_B || *type == _C_ARY_B || *type == _C_UNION_B) {
+            // Pointers would mean nothing to the other side.
+            if (![value isKindOfClass:[NSValue class]] || strlen([value objCType]) != (size_t)(types - type) ||
+                strncmp([value objCType], type, types - type) != 0 || _DCNSTypeHasPointers(type, types))
+                [NSException raise:NSInvalidArgumentException format:@"value of key %@ is not a %.*s: %@", key, (int)(types - type), type, value];
+            
+            [data increaseLengthBy:size];
+            [value getValue:(char *)[data mutableBytes] + start];
+        } else {
+            if (![value isKindOfClass:[NSNumber class]])
+                [NSException raise:NSInvalidArgumentException format:@"value of key %@ is not a number: %@", key, value];
+            
+            switch (*type) {
+                case _C_CHR: _DCNS_PACK_NUMBER(char, charValue)
+                case _C_UCHR: _DCNS_PACK_NUMBER(unsigned char, unsignedCharValue)
+                case _C_SHT: _DCNS_PACK_NUMBER(short, shortValue)
+                case _C_USHT: _DCNS_PACK_NUMBER(unsigned short, unsignedShortValue)
+                case _C_INT: _DCNS_PACK_NUMBER(int, intValue)
+                case _C_UINT: _DCNS_PACK_NUMBER(unsigned int, unsignedIntValue)
+                case _C_LNG: _DCNS_PACK_NUMBER(long, longValue)
+                case _C_ULNG: _DCNS_PACK_NUMBER(unsigned long, unsignedLongValue)
+                case _C_LNG_LNG: _DCNS_PACK_NUMBER(long long, longLongValue)
+                case _C_ULNG_LNG: _DCNS_PACK_NUMBER(unsigned long long, unsignedLongLongValue)
+                case _C_FLT: _DCNS_PACK_NUMBER(float, floatValue)
+                case _C_DBL: _DCNS_PACK_NUMBER(double, doubleValue)
+                case _C_BOOL: _DCNS_PACK_NUMBER(BOOL, boolValue)
+                default:
+                    [NSException raise:NSInvalidArgumentException format:@"cannot read key %@ as type %c", key, *type];
+            }
+        }
+        
+#ifdef __BIG_ENDIAN__
+        _DCNSSwapPackedValue((char *)[data mutableBytes] + start, type);
+#endif
+    }
+    
+    return data;
+}
+
+- (NSDictionary *)dc_valuesForKeys:(NSArray *)keys {
+    NSMutableDictionary *values;
+    NSUInteger i;
+    
+    if (_local || ([_connection _peerWireFeatures] & DCNS_WIRE_FEATURE_KEY_VALUE_SNAPSHOTS))
+        return [(id)self _dc_valuesForKeys:keys];
+    
+    values = [NSMutableDictionary dictionaryWithCapacity:[keys count]];
+    for (i = 0; i < [keys count]; i++) {
+        NSString *key = [keys objectAtIndex:i];
+        id value = [(id)self valueForKey:key];
+        
+        [values setObject:(value ? value : [NSNull null]) forKey:key];
+    }
+    
+    return values;
+}
+
+- (void)dc_getValues:(void *)values ofObjCType:(const char *)type forKeys:(NSArray *)keys {
+    const char *end = type + strlen(type) - 1;
+    const char *members = strchr(type, '=');
+    const char *member;
+    NSString *types;
+    NSData *data;
+    NSUInteger offset = 0, packed = 0, count = 0;
+    
+    if (*type != _C_STRUCT_B || !members || *end != _C_STRUCT_E)
+        [NSException raise:NSInvalidArgumentException format:@"not a struct type: %s", type];
+    members++;
+    types = [[[NSString alloc] initWithBytes:members length:end - members encoding:NSUTF8StringEncoding] autorelease];
+    
+    for (member = members; member < end; count++)
+        member = NSGetSizeAndAlignment(member, NULL, NULL);
+    if (count != [keys count])
+        [NSException raise:NSInvalidArgumentException format:@"%s has %lu members for %lu keys", type, (unsigned long)count, (unsigned long)[keys count]];
+    
+    if (_local || ([_connection _peerWireFeatures] & DCNS_WIRE_FEATURE_KEY_VALUE_SNAPSHOTS))
+        data = [(id)self _dc_packedValuesForKeys:keys objCTypes:types];
+    else
+        data = _DCNSPackValuesForKeys([self dc_valuesForKeys:keys], keys, [types UTF8String]);
+    
+    for (member = members; member < end; ) {
+        NSUInteger size, alignment;
+        const char *next = NSGetSizeAndAlignment(member, &size, &alignment);
+        
+        offset = (offset + alignment - 1) / alignment * alignment;
+        
+        if (packed + size > [data length])
+            [NSException raise:NSInternalInconsistencyException format:@"remote sent %lu bytes for %s", (unsigned long)[data length], type];
+        
+        memcpy((char *)values + offset, (const char *)[data bytes] + packed, size);
+#ifdef __BIG_ENDIAN__
+        _DCNSSwapPackedValue((char *)values + offset, member);
+#endif
+        member = next;
+        offset += size;
+        packed += size;
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark Sending of messages to local or remote proxies
 
@@ -429,7 +1258,12 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
     if(_local) {
         [invocation invokeWithTarget:_local];	// have our local target receive the message for which we are the original target
     } else {
-        [_connection sendInvocation:invocation internal:NO];	// send to peer and insert return value
+        NSArray *key = (_cacheableSelectors ? [self _cacheKeyForInvocation:invocation] : nil);
+        
+        if (key)
+            [self _forwardCacheableInvocation:invocation key:key];	// answer from the cache if we can
+        else
+            [_connection sendInvocation:invocation internal:NO];	// send to peer and insert return value
     }
     
 #if DEBUG_LOG_LEVEL>=3
@@ -447,7 +1281,24 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
      */
     
     struct objc_method_description *md = NULL;
-    NSMethodSignature *ret = [_selectorCache objectForKey:NSStringFromSelector(aSelector)];
+    NSMethodSignature *ret = nil;
+    
+    // Messages we send to proxies ourselves
+    if (aSelector == @selector(methodDescriptionForSelector:))
+        return _methodDescriptionSignature;
+    if (aSelector == @selector(respondsToSelector:))
+        return _respondsToSelectorSignature;
+    if (aSelector == @selector(rootObject) && _remote == 0 && !_local && _rootObjectSignature)
+        return _rootObjectSignature;
+    if (aSelector == @selector(_dc_valuesForKeys:))
+        return _valuesForKeysSignature;
+    if (aSelector == @selector(_dc_packedValuesForKeys:objCTypes:))
+        return _packedValuesForKeysSignature;
+    
+    if (_remoteClass)
+        ret = _DCNSSharedSignature(_connection, _remoteClass, aSelector);
+    if (!ret)
+        ret = [_selectorCache objectForKey:NSStringFromSelector(aSelector)];
     if (ret)
         return ret;	// known from cache
         // FIXME: what about methodSignature of the methods in NSDistantObject/NSProxy?
@@ -474,7 +1325,7 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
         
     } else {
         // We must ask the peer for a methodDescription
-        NSMethodSignature *sig = [_selectorCache objectForKey:@"methodDescriptionForSelector:"];
+        NSMethodSignature *sig = _methodDescriptionSignature;
         NSInvocation *i = [NSInvocation invocationWithMethodSignature:sig];
         
         NSAssert(sig, @"methodsignature for methodDescriptionForSelector: must be known");
@@ -509,7 +1360,13 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
     if (md) {
         // a NSMethodSignature is always a local object and never a NSDistantObject
         ret = [NSMethodSignature signatureWithObjCTypes:md->types];
-        [_selectorCache setObject:ret forKey:NSStringFromSelector(aSelector)];	// add to cache
+        
+        // add to cache
+        if (!_remoteClass || !_DCNSSetSharedSignature(_connection, _remoteClass, aSelector, ret)) {
+            if (!_selectorCache)
+                _selectorCache = [[NSMutableDictionary alloc] initWithCapacity:10];
+            [_selectorCache setObject:ret forKey:NSStringFromSelector(aSelector)];
+        }
     }
     
 #if DEBUG_LOG_LEVEL>=1
@@ -587,7 +1444,32 @@ NSString *const DCNSMethodSignatureException = @"DCNSMethodSignatureException";
     // encode as a reference into the address space and not the real object
     [coder encodeValueOfObjCType:@encode(unsigned int) at:&ref];
     
+    // Keep the local object alive while the remote may be holding a proxy for it.
+    if (_local) {
+        DCNSProxyTableStripe *stripe = _DCNSProxyTableStripe(_remote);
+        
+        [stripe->lock lock];
+        if (_wireCount++ == 0)
+            [self retain];
+        [stripe->lock unlock];
+    }
+    
     flag = (_local == nil);	// local(0) vs. remote(1) flag
+    
+    // A remote that can share signatures between proxies gets told the class of our local objects as well (2).
+    if (!flag && ([(DCNSPortCoder *)coder wireFeatures] & DCNS_WIRE_FEATURE_PROXY_CLASSES) && ![_local isProxy]) {
+        Class c = [_local _classForProxySignatures];
+        
+        if (c) {
+            unsigned long long remoteClass = [_connection _numberForProxyClass:c];
+            char tag = 2;
+            
+            [coder encodeValueOfObjCType:@encode(char) at:&tag];
+            [coder encodeValueOfObjCType:@encode(unsigned long long) at:&remoteClass];
+            return;
+        }
+    }
+    
     [coder encodeValueOfObjCType:@encode(char) at:&flag];
     
     if (flag) {
@@ -18,6 +18,7 @@
 
 #import <Foundation/NSObjCRuntime.h>
 #import <Foundation/NSCoder.h>
+#import <CoreFoundation/CoreFoundation.h>
 
 #import "DCNSConnection-Delegate.h"
 
@@ -26,20 +27,83 @@ typedef double NSTimeInterval;
 @class NSArray;
 @class NSMutableArray;
 @class NSMutableDictionary;
+@class NSMutableData;
 @class DCNSConnection;
 @class NSPort;
 @class NSMapTable;
+@class NSMutableIndexSet;
+@class NSIndexSet;
+@class NSLock;
+
+/*
+ * One direction of a connection's interned class names, selectors and method signatures. The sending side
+ * hands out an id for each Class, SEL or type string, and the receiving side keeps what each id resolved
+ * to when it was defined.
+ */
+@interface DCNSNameTable : NSObject {
+	NSLock *_lock;
+	NSMapTable *_idsByKey;	// Class or SEL -> NSNumber, for encoding
+	NSMutableDictionary *_idsByName;	// type string -> NSNumber, for encoding
+	NSMutableIndexSet *_confirmed;	// ids the remote is known to have decoded a definition of
+	unsigned int _lastId;
+	const void **_resolved;	// id -> Class, SEL or retained NSMethodSignature, for decoding
+	unsigned char *_defined;	// id -> whether it has been defined yet, and if so whether as an object
+	unsigned int _capacity;
+}
+
+- (unsigned int)idForKey:(const void *)key confirmed:(BOOL *)confirmed;	// 0 once the table is full
+- (unsigned int)idForName:(NSString *)name confirmed:(BOOL *)confirmed;	// 0 once the table is full
+- (void)confirmIds:(NSIndexSet *)ids;
+- (void)setResolved:(const void *)value forId:(unsigned int)nameId;
+- (void)setResolvedObject:(id)object forId:(unsigned int)nameId;
+- (BOOL)getResolved:(const void **)value forId:(unsigned int)nameId;
+
+@end
+
+/*
+ * The classes and selectors a connection has decoded, looked up by the bytes of their names as they appear
+ * in a message, so that each name only goes through the runtime once. Names that resolve to nothing are
+ * remembered too. Unlike DCNSNameTable, this needs nothing from the remote.
+ */
+@interface DCNSNameCache : NSObject {
+	NSLock *_lock;
+	CFMutableDictionaryRef _classes;	// name -> Class, or kCFNull
+	CFMutableDictionaryRef _selectors;	// name -> SEL
+}
+
+- (Class)classNamed:(const char *)name length:(NSUInteger)length;
+- (SEL)selectorNamed:(const char *)name length:(NSUInteger)length;
+
+@end
+
+// The version the remote encoded an object's class (or one of its superclasses) with.
+typedef struct {
+	Class cls;
+	int version;
+} DCNSClassVersion;
+
+#define DCNS_CLASS_VERSION_STACK_INLINE 16
 
 @interface DCNSPortCoder : NSCoder {
 	NSPort *_recv;
 	NSPort *_send;
 	NSArray *_components;
 	NSMutableArray *_imports;
-	NSMutableDictionary *_classVersions;
+	DCNSClassVersion *_classVersions;	// versions in scope for the objects being decoded, innermost last
+	unsigned int _classVersionCount;
+	unsigned int _classVersionCapacity;
+	DCNSClassVersion _classVersionsInline[DCNS_CLASS_VERSION_STACK_INLINE];	// enough for all but the deepest graphs
 	const unsigned char *_pointer;	// used for decoding
 	const unsigned char *_eod;	// used for decoding
 	BOOL _isByref;
 	BOOL _isBycopy;
+	unsigned int _channel;	// the channel of the connection we belong to
+	DCNSNameTable *_outgoingNames;	// nil unless the remote understands interned names
+	DCNSNameTable *_incomingNames;
+	NSMutableIndexSet *_definedNames;	// ids defined so far by this message
+	unsigned int _wireFeatures;	// the optional parts of the protocol the remote supports
+	BOOL _lastComponentIsAuthentication;	// if so, out-of-line data may not claim it
+	DCNSNameCache *_nameCache;	// names decoded so far on our connection
 }
 
 + (DCNSPortCoder *)portCoderWithReceivePort:(NSPort *)recv sendPort:(NSPort *)send components:(NSArray *)cmp;
@@ -52,6 +116,19 @@ typedef double NSTimeInterval;
 - (BOOL)isBycopy;
 - (BOOL)isByref;
 - (void)sendBeforeTime:(NSTimeInterval)time sendReplyPort:(BOOL)flag;	// undocumented private method
+- (unsigned int)channel;
+- (void)setChannel:(unsigned int)channel;
+- (void)setOutgoingNames:(DCNSNameTable *)outgoing incomingNames:(DCNSNameTable *)incoming;
+- (void)setNameCache:(DCNSNameCache *)cache;
+- (unsigned int)wireFeatures;
+- (void)setWireFeatures:(unsigned int)features;
+- (void)setLastComponentIsAuthentication:(BOOL)flag;	// set before decoding when the delegate authenticates
+- (NSInteger)versionForClass:(Class)cls;
+- (NSIndexSet *)definedNames;
+
+// Large NSData values, for peers that can take them as a component of their own.
+- (BOOL)_encodeOutOfLineData:(NSData *)data;
+- (NSData *)_decodeOutOfLineData;	// nil if the next value is not out-of-line data
 
 @end
 
@@ -24,16 +24,25 @@
 #import <Foundation/NSArray.h>
 #import <Foundation/NSDate.h>
 #import "DCNSDistantObject.h"
+#import "DCNSValueCoding.h"
 #import <Foundation/NSInvocation.h>
 #import <Foundation/NSMethodSignature.h>
 #import <Foundation/NSRunLoop.h>
 #import <Foundation/NSNull.h>
 #import <Foundation/NSByteOrder.h>
 #import <Foundation/NSDictionary.h>
+#import <Foundation/NSMapTable.h>
+#import <Foundation/NSIndexSet.h>
+#import <Foundation/NSLock.h>
+#import <Foundation/NSValue.h>
+#import <Foundation/NSException.h>
+#import <CoreFoundation/CoreFoundation.h>
+#import <objc/runtime.h>
 
 #include <stdlib.h>
 #include <ctype.h> // isdigit
 #include <string.h>
+#include <pthread.h>
 
 #ifdef __APPLE__
 // make us work on Apple objc-runtime
@@ -153,6 +162,519 @@ const char *objc_skip_typespec(const char *type) {
 
 #import "DCNSPrivate.h"
 
+#pragma mark Type plans
+
+/*
+ * Encoding a struct walks its type encoding member by member, working out each one's size and alignment
+ * as it goes. As the same few struct types are sent over and over, each is instead compiled once into a
+ * flat list of its scalar members and their offsets, laid out exactly as that walk would lay them out.
+ * Members that aren't plain scalars (objects, pointers, arrays...) are handed back to the coder as before.
+ *
+ * Plans are compiled under a lock, but once compiled they never change or go away, so each is also published
+ * in a small open-addressed table that is read without one: the plan is stored before its key, and a reader
+ * that finds the key is guaranteed to see the plan. Types that don't fit there are looked up under the lock.
+ *
+ * Finding a plan that way still means measuring, copying and hashing the type first. The type encodings we are
+ * given mostly come from the same few method signatures, so each thread also remembers the plans it used
+ * last by the address of the type it was given. The address alone isn't enough, as a signature's memory may
+ * be reused for another once it is freed, so a hit is checked against the plan's own copy of the type.
+ */
+
+typedef struct {
+    char kind;              // the type of a scalar member, or 0 to hand the member back to the coder
+    unsigned int offset;    // from the start of the struct
+    const char *type;       // the member's own type encoding, within the plan's copy of the struct's
+} DCNSTypeOp;
+
+typedef struct {
+    unsigned int count;
+    DCNSTypeOp ops[1];
+} DCNSTypePlan;
+
+// Cached for types that can't be planned, so that we don't try again.
+static DCNSTypePlan _DCNSNoTypePlan;
+
+static NSLock *_DCNSTypePlansLock;
+static CFMutableDictionaryRef _DCNSTypePlans; // type encoding -> DCNSTypePlan *, never freed
+
+#define TYPE_PLAN_SLOTS 1024	// a power of 2
+#define TYPE_PLAN_PROBES 16
+
+typedef struct {
+    const char *key;        // the dictionary's copy of the type encoding, set last
+    DCNSTypePlan *plan;
+} DCNSTypePlanSlot;
+
+static DCNSTypePlanSlot _DCNSPublishedTypePlans[TYPE_PLAN_SLOTS];
+
+#define TYPE_PLAN_RECENT 32	// per thread, a power of 2
+
+typedef struct {
+    const char *type;       // as we were given it, only ever compared by address
+    const char *key;        // the dictionary's copy of the type encoding
+    size_t length;          // of the key
+    DCNSTypePlan *plan;
+} DCNSRecentTypePlan;
+
+static pthread_key_t _DCNSRecentTypePlansKey;
+
+static const void *_DCNSTypeKeyRetain(CFAllocatorRef allocator, const void *value) {
+    return strdup(value);
+}
+
+static void _DCNSTypeKeyRelease(CFAllocatorRef allocator, const void *value) {
+    free((void *)value);
+}
+
+static Boolean _DCNSTypeKeyEqual(const void *a, const void *b) {
+    return strcmp(a, b) == 0;
+}
+
+static CFHashCode _DCNSTypeKeyHash(const void *value) {
+    // FNV-1a
+    CFHashCode hash = 2166136261U;
+    const unsigned char *c;
+    for (c = value; *c; c++)
+        hash = (hash ^ *c) * 16777619U;
+    return hash;
+}
+
+static DCNSTypePlanSlot *_DCNSFindPublishedTypePlan(const char *key, BOOL *found) {
+    // Returns the slot holding the key, or the empty slot it would go in, or NULL if neither is in reach.
+    CFHashCode hash = _DCNSTypeKeyHash(key);
+    unsigned int i;
+    
+    for (i = 0; i < TYPE_PLAN_PROBES; i++) {
+        DCNSTypePlanSlot *slot = &_DCNSPublishedTypePlans[(hash + i) & (TYPE_PLAN_SLOTS - 1)];
+        const char *slotKey = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        
+        if (!slotKey || strcmp(slotKey, key) == 0) {
+            *found = (slotKey != NULL);
+            return slot;
+        }
+    }
+    
+    *found = NO;
+    return NULL;
+}
+
+static BOOL _DCNSCompileTypeOps(const char *type, unsigned int offset, DCNSTypeOp **ops, unsigned int *count, unsigned int *capacity) {
+    // Skip qualifiers, as the coder does
+    while (*type == _C_CONST)
+        type++;
+    
+    char kind = *type;
+    
+    switch (kind) {
+        case _C_VOID:
+            return YES;
+        case _C_STRUCT_B: {
+            while (*type != 0 && *type != '=' && *type != _C_STRUCT_E)
+                type++;
+            
+            if (*type++ == 0)
+                return NO;
+            
+            while (*type != 0 && *type != _C_STRUCT_E) {
+                int align = objc_alignof_type(type);
+                
+                if (offset%align != 0)
+                    offset += align-(offset%align);
+                
+                if (!_DCNSCompileTypeOps(type, offset, ops, count, capacity))
+                    return NO;
+                
+                offset += objc_aligned_size(type);
+                type = objc_skip_typespec(type);
+            }
+            return YES;
+        }
+        case _C_CHR:
+        case _C_UCHR:
+        case _C_SHT:
+        case _C_USHT:
+        case _C_INT:
+        case _C_UINT:
+        case _C_LNG:
+        case _C_ULNG:
+        case _C_LNG_LNG:
+        case _C_ULNG_LNG:
+        case _C_FLT:
+        case _C_DBL:
+        case 'B':
+            break;
+        case _C_ID:
+        case _C_CLASS:
+        case _C_SEL:
+        case _C_ATOM:
+        case _C_CHARPTR:
+        case _C_PTR:
+        case _C_ARY_B:
+            kind = 0;
+            break;
+        default:
+            return NO;
+    }
+    
+    if (*count == *capacity) {
+        *capacity = *capacity ? 2 * *capacity : 8;
+        *ops = realloc(*ops, *capacity * sizeof(DCNSTypeOp));
+    }
+    
+    (*ops)[*count].kind = kind;
+    (*ops)[*count].offset = offset;
+    (*ops)[*count].type = type;
+    (*count)++;
+    
+    return YES;
+}
+
+static DCNSTypePlan *_DCNSLookUpTypePlan(const char *type, const char **types) {
+    // Returns the plan for the type, or &_DCNSNoTypePlan, and the dictionary's copy of the type if there is one.
+    char key[256];
+    size_t len = objc_skip_typespec(type) - type;
+    
+    if (len >= sizeof(key))
+        return &_DCNSNoTypePlan;
+    
+    memcpy(key, type, len);
+    key[len] = 0;
+    
+    BOOL found;
+    DCNSTypePlanSlot *slot = _DCNSFindPublishedTypePlan(key, &found);
+    
+    if (found) {
+        *types = slot->key;
+        return slot->plan;
+    }
+    
+    [_DCNSTypePlansLock lock];
+    
+    if (!_DCNSTypePlans) {
+        CFDictionaryKeyCallBacks callbacks = { 0, _DCNSTypeKeyRetain, _DCNSTypeKeyRelease, NULL, _DCNSTypeKeyEqual, _DCNSTypeKeyHash };
+        _DCNSTypePlans = CFDictionaryCreateMutable(NULL, 0, &callbacks, NULL);
+    }
+    
+    DCNSTypePlan *plan = (DCNSTypePlan *)CFDictionaryGetValue(_DCNSTypePlans, key);
+    
+    if (plan) {
+        CFDictionaryGetKeyIfPresent(_DCNSTypePlans, key, (const void **)types);
+    } else {
+        DCNSTypeOp *ops = NULL;
+        unsigned int count = 0, capacity = 0;
+        
+        // The ops point into the dictionary's copy of the key, which lives as long as the plan.
+        CFDictionaryAddValue(_DCNSTypePlans, key, &_DCNSNoTypePlan);
+        
+        if (CFDictionaryGetKeyIfPresent(_DCNSTypePlans, key, (const void **)types) && _DCNSCompileTypeOps(*types, 0, &ops, &count, &capacity) && count > 0) {
+            plan = malloc(sizeof(DCNSTypePlan) + (count-1) * sizeof(DCNSTypeOp));
+            plan->count = count;
+            memcpy(plan->ops, ops, count * sizeof(DCNSTypeOp));
+            
+            CFDictionaryReplaceValue(_DCNSTypePlans, key, plan);
+        } else {
+            plan = &_DCNSNoTypePlan;
+        }
+        
+        free(ops);
+        
+        // Only ever filled in under the lock, so the slot found now is still the right one to use.
+        slot = _DCNSFindPublishedTypePlan(key, &found);
+        if (slot && !found && *types) {
+            slot->plan = plan;
+            __atomic_store_n(&slot->key, *types, __ATOMIC_RELEASE);
+        }
+    }
+    
+    [_DCNSTypePlansLock unlock];
+    
+    return plan;
+}
+
+static DCNSTypePlan *_DCNSTypePlanForType(const char *type) {
+    // Returns NULL if the type must be coded the long way.
+    DCNSRecentTypePlan *recent = pthread_getspecific(_DCNSRecentTypePlansKey);
+    
+    if (!recent) {
+        recent = calloc(TYPE_PLAN_RECENT, sizeof(DCNSRecentTypePlan));
+        pthread_setspecific(_DCNSRecentTypePlansKey, recent);
+    }
+    
+    DCNSRecentTypePlan *entry = &recent[((uintptr_t)type >> 3) & (TYPE_PLAN_RECENT - 1)];
+    
+    if (entry->type != type || strncmp(entry->key, type, entry->length) != 0) {
+        const char *types = NULL;
+        DCNSTypePlan *plan = _DCNSLookUpTypePlan(type, &types);
+        
+        // Without a key of its own to check against, the plan can't be remembered.
+        if (!types)
+            return plan == &_DCNSNoTypePlan ? NULL : plan;
+        
+        entry->type = type;
+        entry->key = types;
+        entry->length = strlen(types);
+        entry->plan = plan;
+    }
+    
+    return entry->plan == &_DCNSNoTypePlan ? NULL : entry->plan;
+}
+
+#pragma mark Value layouts
+
+/*
+ * Instances of classes adopting DCNSValueCoding are sent as a copy of the instance variables the class
+ * names. Each class's layout is worked out once: its numbers, including those within structs and arrays,
+ * become runs of bytes gathered into a single block, and anything else is handed back to the coder. Unlike
+ * type plans, offsets come from the runtime and NSGetSizeAndAlignment(), as they describe real memory.
+ */
+
+typedef struct {
+    char kind;              // the type of the scalars in a run, or 0 to hand the member back to the coder
+    unsigned int offset;    // from the start of the object
+    unsigned int length;    // of the run, in bytes
+    unsigned int width;     // of each scalar in the run
+    unsigned int block;     // offset of the run within the block
+    const char *type;       // of a member handed back to the coder
+} DCNSValueOp;
+
+typedef struct {
+    unsigned int hash;      // of the layout's type encodings, checked by the receiver
+    unsigned int blockSize;
+    unsigned int count;
+    DCNSValueOp ops[1];
+} DCNSValueLayout;
+
+static NSLock *_DCNSValueLayoutsLock;
+static CFMutableDictionaryRef _DCNSValueLayouts; // Class -> DCNSValueLayout *, only for adopting classes, never freed
+
+static char *_DCNSCanonicalType(const char *type) {
+    // Drops the names of struct members and object classes that ivar encodings carry. Caller frees.
+    char *result = malloc(strlen(type) + 1);
+    char *c = result;
+    
+    for (; *type; type++) {
+        if (*type == '"') {
+            while (*++type && *type != '"');
+            if (!*type)
+                break;
+        } else {
+            *c++ = *type;
+        }
+    }
+    
+    *c = 0;
+    return result;
+}
+
+static void _DCNSAddValueOp(DCNSValueOp **ops, unsigned int *count, unsigned int *capacity, DCNSValueOp op) {
+    if (*count > 0 && op.kind) {
+        DCNSValueOp *last = &(*ops)[*count - 1];
+        
+        // Neighbours in memory are neighbours in the block too, so copy them in one go.
+#ifdef __BIG_ENDIAN__
+        if (last->kind && last->width == op.width && last->offset + last->length == op.offset) {
+#else
+        if (last->kind && last->offset + last->length == op.offset) {
+#endif
+            last->length += op.length;
+            return;
+        }
+    }
+    
+    if (*count == *capacity) {
+        *capacity = *capacity ? 2 * *capacity : 8;
+        *ops = realloc(*ops, *capacity * sizeof(DCNSValueOp));
+    }
+    
+    (*ops)[(*count)++] = op;
+}
+
+static void _DCNSCompileValueOps(const char *type, unsigned int offset, unsigned int *blockSize, DCNSValueOp **ops, unsigned int *count, unsigned int *capacity) {
+    NSUInteger size, align;
+    DCNSValueOp op = { 0, offset, 0, 0, 0, NULL };
+    
+    while (*type == _C_CONST)
+        type++;
+    
+    switch (*type) {
+        case _C_STRUCT_B: {
+            while (*type != 0 && *type != '=' && *type != _C_STRUCT_E)
+                type++;
+            
+            if (*type++ != '=')
+                [NSException raise:NSInvalidArgumentException format:@"DCNSValueCoding: cannot lay out an opaque struct"];
+            
+            while (*type != 0 && *type != _C_STRUCT_E) {
+                const char *next = NSGetSizeAndAlignment(type, &size, &align);
+                
+                if (align > 0 && offset%align != 0)
+                    offset += (unsigned int)(align-(offset%align));
+                
+                _DCNSCompileValueOps(type, offset, blockSize, ops, count, capacity);
+                
+                offset += (unsigned int)size;
+                type = next;
+            }
+            return;
+        }
+        case _C_ARY_B: {
+            unsigned int n = 0, i;
+            
+            type++;
+            while (isdigit(*type))
+                n = 10*n+(*type++)-'0';
+            
+            NSGetSizeAndAlignment(type, &size, &align);
+            
+            for (i = 0; i < n; i++)
+                _DCNSCompileValueOps(type, offset + i*(unsigned int)size, blockSize, ops, count, capacity);
+            return;
+        }
+        case _C_CHR:
+        case _C_UCHR:
+        case _C_SHT:
+        case _C_USHT:
+        case _C_INT:
+        case _C_UINT:
+        case _C_LNG:
+        case _C_ULNG:
+        case _C_LNG_LNG:
+        case _C_ULNG_LNG:
+        case _C_FLT:
+        case _C_DBL:
+        case 'B':
+            NSGetSizeAndAlignment(type, &size, &align);
+            
+            op.kind = *type;
+            op.length = op.width = (unsigned int)size;
+            op.block = *blockSize;
+            *blockSize += (unsigned int)size;
+            break;
+        case _C_ID:
+            op.type = @encode(id);
+            break;
+        case _C_CLASS:
+            op.type = @encode(Class);
+            break;
+        case _C_SEL:
+            op.type = @encode(SEL);
+            break;
+        default:
+            [NSException raise:NSInvalidArgumentException format:@"DCNSValueCoding: cannot send a member of type %s by value", type];
+    }
+    
+    _DCNSAddValueOp(ops, count, capacity, op);
+}
+
+static DCNSValueLayout *_DCNSCompileValueLayout(Class class) {
+    DCNSValueOp *ops = NULL;
+    unsigned int count = 0, capacity = 0, blockSize = 0;
+    NSMutableArray *ivars = [NSMutableArray array];
+    CFHashCode hash = 2166136261U;
+    
+    if ([class respondsToSelector:@selector(dc_valueCodingKeys)]) {
+        for (NSString *key in [class dc_valueCodingKeys]) {
+            Ivar ivar = class_getInstanceVariable(class, [key UTF8String]);
+            
+            if (!ivar)
+                ivar = class_getInstanceVariable(class, [[@"_" stringByAppendingString:key] UTF8String]);
+            
+            if (!ivar)
+                [NSException raise:NSInvalidArgumentException format:@"DCNSValueCoding: %@ has no instance variable named %@", class, key];
+            
+            [ivars addObject:[NSValue valueWithPointer:ivar]];
+        }
+    } else if ([class respondsToSelector:@selector(dc_valueCodingType)]) {
+        unsigned int n, i;
+        Ivar *list = class_copyIvarList(class, &n);
+        NSMutableString *declared = [NSMutableString string];
+        
+        for (i = 0; i < n; i++) {
+            char *type = _DCNSCanonicalType(ivar_getTypeEncoding(list[i]));
+            [declared appendString:[NSString stringWithUTF8String:type]];
+            free(type);
+            
+            [ivars addObject:[NSValue valueWithPointer:list[i]]];
+        }
+        
+        free(list);
+        
+        char *expected = _DCNSCanonicalType([[class dc_valueCodingType] UTF8String]);
+        BOOL matches = strcmp(expected, [declared UTF8String]) == 0;
+        free(expected);
+        
+        if (!matches)
+            [NSException raise:NSInvalidArgumentException format:@"DCNSValueCoding: %@ declares instance variables of type %@, not %@", class, declared, [class dc_valueCodingType]];
+    } else {
+        [NSException raise:NSInvalidArgumentException format:@"DCNSValueCoding: %@ implements neither +dc_valueCodingKeys nor +dc_valueCodingType", class];
+    }
+    
+    @try {
+        for (NSValue *value in ivars) {
+            Ivar ivar = [value pointerValue];
+            char *type = _DCNSCanonicalType(ivar_getTypeEncoding(ivar));
+            const char *c;
+            
+            // FNV-1a, over every member's type in order, so that the receiver can tell if its layout differs.
+            for (c = type; *c; c++)
+                hash = (hash ^ (unsigned char)*c) * 16777619U;
+            
+            @try {
+                _DCNSCompileValueOps(type, (unsigned int)ivar_getOffset(ivar), &blockSize, &ops, &count, &capacity);
+            } @finally {
+                free(type);
+            }
+        }
+    } @catch (NSException *e) {
+        free(ops);
+        @throw;
+    }
+    
+    DCNSValueLayout *layout = malloc(sizeof(DCNSValueLayout) + (count > 0 ? count-1 : 0) * sizeof(DCNSValueOp));
+    layout->hash = (unsigned int)hash;
+    layout->blockSize = blockSize;
+    layout->count = count;
+    memcpy(layout->ops, ops, count * sizeof(DCNSValueOp));
+    free(ops);
+    
+    return layout;
+}
+
+static DCNSValueLayout *_DCNSValueLayoutForClass(Class class) {
+    // Returns NULL if the class doesn't adopt DCNSValueCoding, which is checked first so that the lock
+    // is only ever taken for value classes.
+    if (![class conformsToProtocol:@protocol(DCNSValueCoding)])
+        return NULL;
+    
+    [_DCNSValueLayoutsLock lock];
+    
+    if (!_DCNSValueLayouts)
+        _DCNSValueLayouts = CFDictionaryCreateMutable(NULL, 0, NULL, NULL);
+    
+    DCNSValueLayout *layout = (DCNSValueLayout *)CFDictionaryGetValue(_DCNSValueLayouts, class);
+    
+    [_DCNSValueLayoutsLock unlock];
+    
+    if (!layout) {
+        // Compiled outside the lock, as it calls out to the class.
+        layout = _DCNSCompileValueLayout(class);
+        
+        [_DCNSValueLayoutsLock lock];
+        
+        DCNSValueLayout *existing = (DCNSValueLayout *)CFDictionaryGetValue(_DCNSValueLayouts, class);
+        if (existing) {
+            free(layout);
+            layout = existing;
+        } else {
+            CFDictionarySetValue(_DCNSValueLayouts, class, layout);
+        }
+        
+        [_DCNSValueLayoutsLock unlock];
+    }
+    
+    return layout;
+}
+
 /*
  this is how an Apple Cocoa request for [connection rootProxy] arrives in the first component of a NSPortMessage (with msgid=0)
  
@@ -198,8 +720,309 @@ const char *objc_skip_typespec(const char *type) {
 NSString *const DCNSTransmissionException = @"DCNSTransmissionException";
 NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
 
+// Flags that may precede a class name or selector, in place of the plain non-nil flag.
+#define NAME_DEFINITION 2	// an id follows, then the name it stands for from now on
+#define NAME_REFERENCE 3	// only the id of an earlier definition follows
+
+// Marks an array of fixed-width numbers sent as one block, followed by the width of each element.
+// Otherwise each element starts with its length byte, which is never more than 8.
+#define BULK_ARRAY_MARKER 0x7f
+
+// Arrays of fewer integers than this are smaller sent element by element.
+#define BULK_ARRAY_MIN_INTEGERS 16
+
+// Marks a large NSData sent as a component of its own, followed by the index of that component.
+#define OUT_OF_LINE_DATA_MARKER 0x7e
+
+// Anything shorter is cheaper copied into the first component than framed separately.
+#define OUT_OF_LINE_DATA_MIN_LENGTH (32*1024)
+
+// A non-nil flag that says the object is sent as a tagged property list.
+#define PLIST_OBJECT 2
+
+// A non-nil flag that says the object is sent as a flat copy of its value layout.
+#define VALUE_OBJECT 3
+
+// Tags of property list values.
+#define PLIST_TAG_NULL 'z'
+#define PLIST_TAG_TRUE 't'
+#define PLIST_TAG_FALSE 'f'
+#define PLIST_TAG_NUMBER 'n'	// then the objCType, then the value as coded for that type
+#define PLIST_TAG_STRING 's'	// then the length in bytes, then UTF-8
+#define PLIST_TAG_DATA 'd'	// then the length, then the bytes
+#define PLIST_TAG_ARRAY 'a'	// then the count, then the elements
+#define PLIST_TAG_DICTIONARY 'm'	// then the count, then each key followed by its value
+#define PLIST_TAG_MUTABLE 0x80	// set on the tag of mutable data, arrays and dictionaries
+
+// Guards against running out of stack on a malicious or cyclic graph.
+#define PLIST_MAX_DEPTH 512
+
+// Guards against a remote making us allocate an absurdly large table. Once we have handed out this many
+// ids ourselves, anything new is sent by name, which the remote always accepts.
+#define NAME_TABLE_MAX_IDS 65536
+
+// Guards against a remote making us cache an absurd number of names.
+#define NAME_CACHE_MAX_NAMES 4096
+
+// How an id in a name table has been defined.
+#define NAME_UNDEFINED 0
+#define NAME_POINTER 1
+#define NAME_OBJECT 2	// retained by the table
+
+@implementation DCNSNameTable
+
+- (instancetype)init {
+    self = [super init];
+    
+    if (self) {
+        _lock = [[NSLock alloc] init];
+        _idsByKey = [[NSMapTable alloc] initWithKeyOptions:NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality
+                                              valueOptions:NSPointerFunctionsStrongMemory
+                                                  capacity:32];
+        _idsByName = [[NSMutableDictionary alloc] initWithCapacity:32];
+        _confirmed = [[NSMutableIndexSet alloc] init];
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    unsigned int i;
+    for (i = 0; i < _capacity; i++) {
+        if (_defined[i] == NAME_OBJECT)
+            [(id)_resolved[i] release];
+    }
+    
+    [_lock release];
+    [_idsByKey release];
+    [_idsByName release];
+    [_confirmed release];
+    free(_resolved);
+    free(_defined);
+    [super dealloc];
+}
+
+- (unsigned int)idForKey:(const void *)key confirmed:(BOOL *)confirmed {
+    unsigned int nameId;
+    
+    [_lock lock];
+    NSNumber *existing = [_idsByKey objectForKey:(id)key];
+    
+    if (existing) {
+        nameId = [existing unsignedIntValue];
+    } else if (_lastId < NAME_TABLE_MAX_IDS) {
+        nameId = ++_lastId;
+        [_idsByKey setObject:[NSNumber numberWithUnsignedInt:nameId] forKey:(id)key];
+    } else {
+        [_lock unlock];
+        *confirmed = NO;
+        return 0;	// full
+    }
+    
+    *confirmed = [_confirmed containsIndex:nameId];
+    [_lock unlock];
+    
+    return nameId;
+}
+
+- (unsigned int)idForName:(NSString *)name confirmed:(BOOL *)confirmed {
+    unsigned int nameId;
+    
+    [_lock lock];
+    NSNumber *existing = [_idsByName objectForKey:name];
+    
+    if (existing) {
+        nameId = [existing unsignedIntValue];
+    } else if (_lastId < NAME_TABLE_MAX_IDS) {
+        nameId = ++_lastId;
+        [_idsByName setObject:[NSNumber numberWithUnsignedInt:nameId] forKey:name];
+    } else {
+        [_lock unlock];
+        *confirmed = NO;
+        return 0;	// full
+    }
+    
+    *confirmed = [_confirmed containsIndex:nameId];
+    [_lock unlock];
+    
+    return nameId;
+}
+
+- (void)confirmIds:(NSIndexSet *)ids {
+    if (!ids)
+        return;
+    
+    [_lock lock];
+    [_confirmed addIndexes:ids];
+    [_lock unlock];
+}
+
+- (void)setResolved:(const void *)value forId:(unsigned int)nameId {
+    [self _setResolved:value kind:NAME_POINTER forId:nameId];
+}
+
+- (void)setResolvedObject:(id)object forId:(unsigned int)nameId {
+    [self _setResolved:[object retain] kind:NAME_OBJECT forId:nameId];
+}
+
+- (void)_setResolved:(const void *)value kind:(unsigned char)kind forId:(unsigned int)nameId {
+    if (nameId == 0 || nameId > NAME_TABLE_MAX_IDS) {
+        if (kind == NAME_OBJECT)
+            [(id)value release];
+        [NSException raise:DCNSPortCoderException format:@"invalid interned name id %u", nameId];
+    }
+    
+    [_lock lock];
+    
+    if (nameId >= _capacity) {
+        unsigned int capacity = MAX(2*_capacity, nameId+1);
+        _resolved = realloc(_resolved, capacity*sizeof(const void *));
+        _defined = realloc(_defined, capacity);
+        memset(_defined+_capacity, 0, capacity-_capacity);
+        _capacity = capacity;
+    }
+    
+    // A resent message defines the same id again.
+    if (_defined[nameId] == NAME_OBJECT)
+        [(id)_resolved[nameId] release];
+    
+    _resolved[nameId] = value;
+    _defined[nameId] = kind;
+    [_lock unlock];
+}
+
+- (BOOL)getResolved:(const void **)value forId:(unsigned int)nameId {
+    BOOL found = NO;
+    
+    [_lock lock];
+    if (nameId < _capacity && _defined[nameId] != NAME_UNDEFINED) {
+        *value = _resolved[nameId];
+        found = YES;
+    }
+    [_lock unlock];
+    
+    return found;
+}
+
+@end
+
+// A name as it appears in a message. Lookups use one on the stack pointing into the message; the cache's
+// own copies carry their bytes along behind them.
+typedef struct {
+    const char *bytes;
+    NSUInteger length;
+    CFHashCode hash;
+} DCNSNameKey;
+
+static CFHashCode _DCNSHashName(const char *bytes, NSUInteger length) {
+    // FNV-1a
+    CFHashCode hash = 2166136261U;
+    NSUInteger i;
+    for (i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)bytes[i]) * 16777619U;
+    return hash;
+}
+
+static const void *_DCNSNameKeyRetain(CFAllocatorRef allocator, const void *value) {
+    const DCNSNameKey *key = value;
+    DCNSNameKey *copy = malloc(sizeof(DCNSNameKey) + key->length);
+    
+    memcpy(copy + 1, key->bytes, key->length);
+    copy->bytes = (const char *)(copy + 1);
+    copy->length = key->length;
+    copy->hash = key->hash;
+    
+    return copy;
+}
+
+static void _DCNSNameKeyRelease(CFAllocatorRef allocator, const void *value) {
+    free((void *)value);
+}
+
+static Boolean _DCNSNameKeyEqual(const void *a, const void *b) {
+    const DCNSNameKey *x = a, *y = b;
+    return x->hash == y->hash && x->length == y->length && memcmp(x->bytes, y->bytes, x->length) == 0;
+}
+
+static CFHashCode _DCNSNameKeyHash(const void *value) {
+    return ((const DCNSNameKey *)value)->hash;
+}
+
+@implementation DCNSNameCache
+
+- (instancetype)init {
+    self = [super init];
+    
+    if (self) {
+        CFDictionaryKeyCallBacks callbacks = { 0, _DCNSNameKeyRetain, _DCNSNameKeyRelease, NULL, _DCNSNameKeyEqual, _DCNSNameKeyHash };
+        
+        _lock = [[NSLock alloc] init];
+        _classes = CFDictionaryCreateMutable(NULL, 0, &callbacks, NULL);
+        _selectors = CFDictionaryCreateMutable(NULL, 0, &callbacks, NULL);
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    [_lock release];
+    CFRelease(_classes);
+    CFRelease(_selectors);
+    [super dealloc];
+}
+
+- (const void *)_valueNamed:(const char *)name length:(NSUInteger)length inDictionary:(CFMutableDictionaryRef)dictionary isClass:(BOOL)isClass {
+    DCNSNameKey key = { name, length, _DCNSHashName(name, length) };
+    const void *value;
+    
+    [_lock lock];
+    value = CFDictionaryGetValue(dictionary, &key);
+    [_lock unlock];
+    
+    if (value)
+        return value == kCFNull ? NULL : value;
+    
+    // Names are sent with their terminating 0 byte.
+    NSString *s = [[NSString alloc] initWithBytes:name length:(length > 0 && name[length-1] == 0 ? length-1 : length) encoding:NSUTF8StringEncoding];
+    
+    if (isClass) {
+        // May not really be needed unless someone defines a class named "Nil"
+        value = (s && ![s isEqualToString:@"Nil"]) ? (const void *)NSClassFromString(s) : NULL;
+    } else {
+        value = s ? (const void *)NSSelectorFromString(s) : NULL;
+    }
+    
+    [s release];
+    
+    [_lock lock];
+    // A remote sending endless made up names shouldn't be able to grow this without bound.
+    if (CFDictionaryGetCount(dictionary) < NAME_CACHE_MAX_NAMES)
+        CFDictionarySetValue(dictionary, &key, value ? value : kCFNull);
+    [_lock unlock];
+    
+    return value;
+}
+
+- (Class)classNamed:(const char *)name length:(NSUInteger)length {
+    return (Class)[self _valueNamed:name length:length inDictionary:_classes isClass:YES];
+}
+
+- (SEL)selectorNamed:(const char *)name length:(NSUInteger)length {
+    return (SEL)[self _valueNamed:name length:length inDictionary:_selectors isClass:NO];
+}
+
+@end
+
 @implementation DCNSPortCoder
 
++ (void)initialize {
+    if (!_DCNSTypePlansLock) {
+        _DCNSTypePlansLock = [[NSLock alloc] init];
+        _DCNSValueLayoutsLock = [[NSLock alloc] init];
+        pthread_key_create(&_DCNSRecentTypePlansKey, free);
+    }
+}
+
 + (DCNSPortCoder *)portCoderWithReceivePort:(NSPort *)recv sendPort:(NSPort *)send components:(NSArray *)cmp {
     return [[[self alloc] initWithReceivePort:recv sendPort:send components:cmp] autorelease];
 }
@@ -208,10 +1031,12 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
 - (void)sendBeforeTime:(NSTimeInterval)time sendReplyPort:(BOOL)flag {
     NSPortMessage *pm = [[NSPortMessage alloc] initWithSendPort:_send
                                                   receivePort:_recv
-                                                   components:_components];
+                                                   components:[self components]];
     NSDate *due = [NSDate dateWithTimeIntervalSinceReferenceDate:time];
     BOOL r;
-    int _msgid = 0;
+    
+    // The message id carries our channel; its top bit is reserved by the port.
+    unsigned int _msgid = _channel & 0x7fffffff;
     
 #if DEBUG_LOG_LEVEL>=2
     NSLog(@"DCNSPortCoder: -sendBeforeTime %@ msgid=%d replyPort:%d _send:%@ _recv:%@", due, _msgid, flag, _send, _recv);
@@ -244,11 +1069,11 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
     // We don't cache the connection!
     
     // Get our connection object if it exists
-    DCNSConnection *c = [DCNSConnection lookUpConnectionWithReceivePort:_recv sendPort:_send];
+    DCNSConnection *c = [DCNSConnection lookUpConnectionWithReceivePort:_recv sendPort:_send channel:_channel];
     
     // Create one if needed.
     if (!c)
-        c = [[[DCNSConnection alloc] initWithReceivePort:_recv sendPort:_send] autorelease];
+        c = [[[DCNSConnection alloc] initWithReceivePort:_recv sendPort:_send channel:_channel] autorelease];
     
     return c;
 }
@@ -276,85 +1101,645 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
         // Set read pointer
         _pointer = [first bytes];
         
-        // Only relevant for decoding but initialize always
-        _eod = (unsigned char *) [first bytes] + [first length];
+        // Only relevant for decoding but initialize always
+        _eod = (unsigned char *) [first bytes] + [first length];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [self invalidate];
+    [super dealloc];
+}
+
+- (unsigned int)channel { return _channel; }
+- (void)setChannel:(unsigned int)channel { _channel = channel; }
+
+- (void)setOutgoingNames:(DCNSNameTable *)outgoing incomingNames:(DCNSNameTable *)incoming {
+    [_outgoingNames autorelease];
+    _outgoingNames = [outgoing retain];
+    [_incomingNames autorelease];
+    _incomingNames = [incoming retain];
+}
+
+- (void)setNameCache:(DCNSNameCache *)cache {
+    [_nameCache autorelease];
+    _nameCache = [cache retain];
+}
+
+- (NSIndexSet *)definedNames {
+    return _definedNames;
+}
+
+- (unsigned int)wireFeatures { return _wireFeatures; }
+- (void)setWireFeatures:(unsigned int)features { _wireFeatures = features; }
+- (void)setLastComponentIsAuthentication:(BOOL)flag { _lastComponentIsAuthentication = flag; }
+
+- (BOOL)isBycopy { return _isBycopy; }
+- (BOOL)isByref { return _isByref; }
+
+#pragma mark Core encoding
+
+- (void)_encodeInteger:(long long)val {
+    NSMutableData *data = [_components objectAtIndex:0];
+    union {
+        long long val;
+        unsigned char data[8];
+    } d;
+    signed char len = 8;
+    
+#if DEBUG_LOG_LEVEL>=3
+    NSLog(@"encode %lld", val);
+#endif
+    
+    // NOTE: this has been unit-tested to be correct on big and little endian machines
+    d.val = NSSwapHostLongLongToLittle(val);
+    
+    if (val < 0) {
+        while (len > 1 && d.data[len-1] == (unsigned char) 0xff)
+            len--;	// get first non-0xff byte which determines length
+        
+        len = -len;	// encode by negative length
+#if DEBUG_LOG_LEVEL>=2
+        NSLog(@"DCNSPortCoder: -_encodeInteger len = %d", len);
+#endif
+        
+    } else {
+        while (len > 0 && d.data[len-1] == 0)
+            len--;	// get first non-0 byte which determines length
+    }
+    
+    // Encode length of int, then its significant bytes
+    unsigned char bytes[9];
+    int count = len < 0 ? -len : len;
+    
+    bytes[0] = (unsigned char)len;
+    memcpy(bytes+1, d.data, count);
+    [data appendBytes:bytes length:1+count];
+}
+
+- (BOOL)_encodeInternedKey:(const void *)key name:(const char *)name {
+    // Writes the flag and id for a Class or SEL, followed by its name if this defines the id. Returns NO, having
+    // written nothing, if the table is full, in which case the caller sends the name the plain way.
+    BOOL confirmed;
+    unsigned int nameId = [_outgoingNames idForKey:key confirmed:&confirmed];
+    
+    if (nameId == 0)
+        return NO;
+    
+    if (![self _encodeInternedId:nameId confirmed:confirmed])
+        [self encodeBytes:name length:strlen(name)+1];
+    
+    return YES;
+}
+
+- (BOOL)_encodeInternedId:(unsigned int)nameId confirmed:(BOOL)confirmed {
+    signed char flag;
+    
+    // Until the remote has decoded a message defining the id, each message must carry its own definition.
+    if (confirmed || [_definedNames containsIndex:nameId]) {
+        flag = NAME_REFERENCE;
+        [self encodeValueOfObjCType:@encode(signed char) at:&flag];
+        [self _encodeInteger:nameId];
+        
+        return YES;
+    }
+    
+    if (!_definedNames)
+        _definedNames = [[NSMutableIndexSet alloc] init];
+    [_definedNames addIndex:nameId];
+    
+    flag = NAME_DEFINITION;
+    [self encodeValueOfObjCType:@encode(signed char) at:&flag];
+    [self _encodeInteger:nameId];
+    
+    return NO;
+}
+
+- (void)_encodeWithTypePlan:(DCNSTypePlan *)plan at:(const void *)address {
+    NSMutableData *data = [_components objectAtIndex:0];
+    unsigned int i;
+    
+    for (i = 0; i < plan->count; i++) {
+        const DCNSTypeOp *op = &plan->ops[i];
+        const void *member = (const char *)address + op->offset;
+        
+        switch (op->kind) {
+            case _C_CHR:
+            case _C_UCHR:
+                [data appendBytes:member length:1];
+                break;
+            case _C_SHT:
+            case _C_USHT:
+                [self _encodeInteger:*((short *) member)];
+                break;
+            case _C_INT:
+            case _C_UINT:
+                [self _encodeInteger:*((int *) member)];
+                break;
+            case _C_LNG:
+            case _C_ULNG:
+                [self _encodeInteger:*((long *) member)];
+                break;
+            case _C_LNG_LNG:
+            case _C_ULNG_LNG:
+                [self _encodeInteger:*((long long *) member)];
+                break;
+            case _C_FLT: {
+                NSSwappedFloat val = NSSwapHostFloatToLittle(*(float *)member);
+                unsigned char bytes[1+sizeof(float)] = { sizeof(float) };
+                
+                memcpy(bytes+1, &val, sizeof(float));
+                [data appendBytes:bytes length:sizeof(bytes)];
+                break;
+            }
+            case _C_DBL: {
+                NSSwappedDouble val = NSSwapHostDoubleToLittle(*(double *)member);
+                unsigned char bytes[1+sizeof(double)] = { sizeof(double) };
+                
+                memcpy(bytes+1, &val, sizeof(double));
+                [data appendBytes:bytes length:sizeof(bytes)];
+                break;
+            }
+            case 'B':
+                [self _encodeInteger:*((bool *) member)];
+                break;
+            default:
+                [self encodeValueOfObjCType:op->type at:member];
+                break;
+        }
+    }
+}
+
+- (void)encodePortObject:(NSPort *)port {
+    // psymac :: Check to ensure that we are actually trying to encode a port object.
+    if (![port isKindOfClass:[NSPort class]]) {
+        [NSException raise:DCNSPortCoderException format:@"DCNSPortCoder: -encodePortObject: NSPort expected, got %@", port];
+    }
+    
+    [(NSMutableArray *) _components addObject:port];
+}
+
+#ifdef __BIG_ENDIAN__
+static void _DCNSSwapArrayElements(void *array, NSUInteger count, int size) {
+    NSUInteger i;
+    
+    switch (size) {
+        case 2:
+            for (i = 0; i < count; i++)
+                ((unsigned short *)array)[i] = NSSwapShort(((unsigned short *)array)[i]);
+            break;
+        case 4:
+            for (i = 0; i < count; i++)
+                ((unsigned int *)array)[i] = NSSwapInt(((unsigned int *)array)[i]);
+            break;
+        case 8:
+            for (i = 0; i < count; i++)
+                ((unsigned long long *)array)[i] = NSSwapLongLong(((unsigned long long *)array)[i]);
+            break;
+    }
+}
+#endif
+
+static NSUInteger _DCNSBulkArrayMinCount(const char *type) {
+    // The fewest elements worth sending as one block, or 0 if arrays of the type are never sent that way.
+    while (*type == _C_CONST)
+        type++;
+    
+    switch (*type) {
+        case _C_FLT:
+        case _C_DBL:
+            return 2;
+        case _C_SHT:
+        case _C_USHT:
+        case _C_INT:
+        case _C_UINT:
+        case _C_LNG:
+        case _C_ULNG:
+        case _C_LNG_LNG:
+        case _C_ULNG_LNG:
+            return BULK_ARRAY_MIN_INTEGERS;
+        default:
+            return 0;
+    }
+}
+
+- (BOOL)_encodeBulkArrayOfObjCType:(const char *)type count:(NSUInteger)count at:(const void *)array size:(int)size {
+    // Returns NO if the array is better sent element by element.
+    NSUInteger minCount = _DCNSBulkArrayMinCount(type);
+    
+    if (minCount == 0 || count < minCount)
+        return NO;
+    
+    NSMutableData *data = [_components objectAtIndex:0];
+    unsigned char header[2] = { BULK_ARRAY_MARKER, (unsigned char)size };
+    [data appendBytes:header length:2];
+    
+#ifdef __BIG_ENDIAN__
+    NSUInteger offset = [data length];
+    [data appendBytes:array length:count*size];
+    _DCNSSwapArrayElements((char *)[data mutableBytes]+offset, count, size);
+#else
+    // Already in wire order, so no need to look at each element.
+    [data appendBytes:array length:count*size];
+#endif
+    
+    return YES;
+}
+
+- (void)encodeArrayOfObjCType:(const char*)type count:(NSUInteger) count at:(const void*)array {
+    int size = objc_sizeof_type(type);
+    
+#if DEBUG_LOG_LEVEL>=2
+    NSLog(@"DCNSPortCoder: -encodeArrayOfObjCType %s count %lu size %d", type, (unsigned long)count, size);
+#endif
+    
+    // FIXME: handle alignment
+    if (size == 1) {
+        // Encode bytes directly
+        [[_components objectAtIndex:0] appendBytes:array length:count];
+        return;
+    }
+    
+    if ((_wireFeatures & DCNS_WIRE_FEATURE_BULK_ARRAYS) && [self _encodeBulkArrayOfObjCType:type count:count at:array size:size])
+        return;
+    
+    while(count-- > 0) {
+        [self encodeValueOfObjCType:type at:array];
+        array = size + (char *) array;
+    }
+}
+
+#pragma mark Out-of-line data
+
+/*
+ * A large NSData used to be copied into the first component when encoded, then copied twice more when
+ * decoded. For peers that understand it, it is instead added to the message as a component of its own,
+ * with only its index written in place of the bytes. The port writes such a component straight from the
+ * object's storage, and hands it over on receipt as a slice of the buffer the message arrived in.
+ */
+
+- (BOOL)_encodeOutOfLineData:(NSData *)data {
+    // Returns NO if data should be encoded inline.
+    if (!(_wireFeatures & DCNS_WIRE_FEATURE_OUT_OF_LINE_DATA) || [data length] < OUT_OF_LINE_DATA_MIN_LENGTH)
+        return NO;
+    
+    unsigned char marker = OUT_OF_LINE_DATA_MARKER;
+    [[_components objectAtIndex:0] appendBytes:&marker length:1];
+    [self _encodeInteger:[_components count]];
+    
+    // Only mutable data is actually copied, as it may change before it has been written.
+    NSData *component = [data copy];
+    [(NSMutableArray *)_components addObject:component];
+    [component release];
+    
+    return YES;
+}
+
+- (NSData *)_decodeOutOfLineData {
+    if (_pointer >= _eod || *_pointer != OUT_OF_LINE_DATA_MARKER)
+        return nil;
+    
+    _pointer++;
+    long long index = [self _decodeInteger];
+    
+    // Otherwise a sender could pass off the authentication data as a value and leave none to check.
+    long long count = (long long)[_components count] - (_lastComponentIsAuthentication ? 1 : 0);
+    
+    if (index < 1 || index >= count || ![[_components objectAtIndex:(NSUInteger)index] isKindOfClass:[NSData class]])
+        [NSException raise:DCNSPortCoderException format:@"invalid out-of-line data component %lld (%@)", index, [self _location]];
+    
+    return [_components objectAtIndex:(NSUInteger)index];
+}
+
+#pragma mark Values
+
+- (void)_encodeValue:(id)obj withLayout:(DCNSValueLayout *)layout {
+    NSMutableData *data = [_components objectAtIndex:0];
+    unsigned int i;
+    
+    [self _encodeInteger:layout->hash];
+    [self _encodeInteger:layout->blockSize];
+    
+    // Every number goes into the one block, in little-endian order.
+    NSUInteger offset = [data length];
+    [data increaseLengthBy:layout->blockSize];
+    char *block = (char *)[data mutableBytes] + offset;
+    
+    for (i = 0; i < layout->count; i++) {
+        DCNSValueOp *op = &layout->ops[i];
+        
+        if (op->kind) {
+            memcpy(block + op->block, (char *)obj + op->offset, op->length);
+#ifdef __BIG_ENDIAN__
+            _DCNSSwapArrayElements(block + op->block, op->length / op->width, op->width);
+#endif
+        }
+    }
+    
+    // Then everything else, in order.
+    for (i = 0; i < layout->count; i++) {
+        DCNSValueOp *op = &layout->ops[i];
+        
+        if (!op->kind)
+            [self encodeValueOfObjCType:op->type at:(char *)obj + op->offset];
     }
-    return self;
 }
 
-- (void)dealloc {
-    [self invalidate];
-    [super dealloc];
+- (id)_decodeRetainedValueOfClass:(Class)class withLayout:(DCNSValueLayout *)layout {
+    unsigned int hash = (unsigned int)[self _decodeInteger];
+    unsigned int blockSize = (unsigned int)[self _decodeInteger];
+    unsigned int i;
+    
+    if (hash != layout->hash || blockSize != layout->blockSize)
+        [NSException raise:DCNSPortCoderException format:@"the remote's layout of %@ differs from ours (%@)", class, [self _location]];
+    
+    if (_pointer+blockSize > _eod)
+        [NSException raise:DCNSPortCoderException format:@"not enough data to decode %@ (%@)", class, [self _location]];
+    
+    // Nothing is called on the new instance; it is filled in as is.
+    id obj = [class alloc];
+    const unsigned char *block = _pointer;
+    _pointer += blockSize;
+    
+    for (i = 0; i < layout->count; i++) {
+        DCNSValueOp *op = &layout->ops[i];
+        
+        if (op->kind) {
+            memcpy((char *)obj + op->offset, block + op->block, op->length);
+#ifdef __BIG_ENDIAN__
+            _DCNSSwapArrayElements((char *)obj + op->offset, op->length / op->width, op->width);
+#endif
+        }
+    }
+    
+    @try {
+        for (i = 0; i < layout->count; i++) {
+            DCNSValueOp *op = &layout->ops[i];
+            
+            // Objects come back retained, which is what the instance variable should hold.
+            if (!op->kind)
+                [self decodeValueOfObjCType:op->type at:(char *)obj + op->offset];
+        }
+    } @catch (NSException *e) {
+        [obj release];
+        @throw;
+    }
+    
+    return obj;
 }
 
-- (BOOL)isBycopy { return _isBycopy; }
-- (BOOL)isByref { return _isByref; }
+#pragma mark Property lists
 
-#pragma mark Core encoding
+/*
+ * By-copy graphs of strings, numbers, data, arrays, dictionaries and nulls are common arguments and return
+ * values, but encoding each object generically costs a class name, a walk over its superclass versions and
+ * a trailing flag. For peers that understand it, such a graph is instead sent in place of the object as a
+ * tree of tagged values, after a non-nil flag of PLIST_OBJECT. If it turns out to hold anything else, what
+ * has been written is dropped and the object is encoded the usual way.
+ */
 
-- (void)_encodeInteger:(long long)val {
+- (BOOL)_encodePropertyList:(id)obj depth:(unsigned int)depth {
+    // Returns NO if obj is not a property list we can tag.
     NSMutableData *data = [_components objectAtIndex:0];
-    union {
-        long long val;
-        unsigned char data[8];
-    } d;
-    signed char len = 8;
+    Class class;
+    unsigned char tag;
     
-#if DEBUG_LOG_LEVEL>=3
-    NSLog(@"encode %lld", val);
-#endif
+    // Proxies go by reference, and can't be asked for their class without a round trip.
+    if ([obj isProxy] || depth > PLIST_MAX_DEPTH)
+        return NO;
     
-    // NOTE: this has been unit-tested to be correct on big and little endian machines
-    d.val = NSSwapHostLongLongToLittle(val);
+    // The top level has already been replaced. Anything within it that would be sent as something else,
+    // such as a proxy, can only be replaced in the generic encoding.
+    if (depth > 0 && [obj replacementObjectForPortCoder:self] != obj)
+        return NO;
     
-    if (val < 0) {
-        while (len > 1 && d.data[len-1] == (unsigned char) 0xff)
-            len--;	// get first non-0xff byte which determines length
+    class = [obj classForPortCoder];
+    
+    if (class == [NSString class] || class == [NSMutableString class]) {
+        NSUInteger len = [obj lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+        NSUInteger offset;
         
-        len = -len;	// encode by negative length
-#if DEBUG_LOG_LEVEL>=2
-        NSLog(@"DCNSPortCoder: -_encodeInteger len = %d", len);
-#endif
+        tag = PLIST_TAG_STRING;
+        [data appendBytes:&tag length:1];
+        [self _encodeInteger:len];
+        
+        // Convert straight into the buffer.
+        offset = [data length];
+        [data increaseLengthBy:len];
+        [obj getBytes:(char *)[data mutableBytes]+offset maxLength:len usedLength:NULL encoding:NSUTF8StringEncoding
+              options:0 range:NSMakeRange(0, [obj length]) remainingRange:NULL];
+    } else if (class == [NSNumber class]) {
+        const char *type = [obj objCType];
+        
+        if ((CFBooleanRef)obj == kCFBooleanTrue || (CFBooleanRef)obj == kCFBooleanFalse) {
+            tag = (CFBooleanRef)obj == kCFBooleanTrue ? PLIST_TAG_TRUE : PLIST_TAG_FALSE;
+            [data appendBytes:&tag length:1];
+            return YES;
+        }
         
+        switch (*type) {
+            case _C_CHR:
+            case _C_UCHR:
+            case _C_SHT:
+            case _C_USHT:
+            case _C_INT:
+            case _C_UINT:
+            case _C_LNG:
+            case _C_ULNG:
+            case _C_LNG_LNG:
+            case _C_ULNG_LNG: {
+                unsigned char header[2] = { PLIST_TAG_NUMBER, *type };
+                [data appendBytes:header length:2];
+                
+                if (isupper(*type))
+                    [self _encodeInteger:(long long)[obj unsignedLongLongValue]];
+                else
+                    [self _encodeInteger:[obj longLongValue]];
+                break;
+            }
+            case _C_FLT: {
+                unsigned char header[2] = { PLIST_TAG_NUMBER, *type };
+                float value = [obj floatValue];
+                
+                [data appendBytes:header length:2];
+                [self encodeValueOfObjCType:@encode(float) at:&value];
+                break;
+            }
+            case _C_DBL: {
+                unsigned char header[2] = { PLIST_TAG_NUMBER, *type };
+                double value = [obj doubleValue];
+                
+                [data appendBytes:header length:2];
+                [self encodeValueOfObjCType:@encode(double) at:&value];
+                break;
+            }
+            default:
+                return NO;
+        }
+    } else if (class == [NSData class] || class == [NSMutableData class]) {
+        // Better sent out-of-line, which the plain object encoding takes care of.
+        if ((_wireFeatures & DCNS_WIRE_FEATURE_OUT_OF_LINE_DATA) && [obj length] >= OUT_OF_LINE_DATA_MIN_LENGTH)
+            return NO;
+        
+        tag = PLIST_TAG_DATA | (class == [NSMutableData class] ? PLIST_TAG_MUTABLE : 0);
+        [data appendBytes:&tag length:1];
+        [self _encodeInteger:[obj length]];
+        [data appendData:obj];
+    } else if (class == [NSArray class] || class == [NSMutableArray class]) {
+        tag = PLIST_TAG_ARRAY | (class == [NSMutableArray class] ? PLIST_TAG_MUTABLE : 0);
+        [data appendBytes:&tag length:1];
+        [self _encodeInteger:[obj count]];
+        
+        for (id element in obj) {
+            if (![self _encodePropertyList:element depth:depth+1])
+                return NO;
+        }
+    } else if (class == [NSDictionary class] || class == [NSMutableDictionary class]) {
+        tag = PLIST_TAG_DICTIONARY | (class == [NSMutableDictionary class] ? PLIST_TAG_MUTABLE : 0);
+        [data appendBytes:&tag length:1];
+        [self _encodeInteger:[obj count]];
+        
+        for (id key in obj) {
+            if (![self _encodePropertyList:key depth:depth+1] || ![self _encodePropertyList:[obj objectForKey:key] depth:depth+1])
+                return NO;
+        }
+    } else if (class == [NSNull class]) {
+        tag = PLIST_TAG_NULL;
+        [data appendBytes:&tag length:1];
     } else {
-        while (len > 0 && d.data[len-1] == 0)
-            len--;	// get first non-0 byte which determines length
+        return NO;
     }
     
-    // Encode length of int
-    [data appendBytes:&len length:1];
-    
-    // Encode significant bytes
-    [data appendBytes:&d.data length:len < 0 ? -len : len];
+    return YES;
 }
 
-- (void)encodePortObject:(NSPort *)port {
-    // psymac :: Check to ensure that we are actually trying to encode a port object.
-    if (![port isKindOfClass:[NSPort class]]) {
-        [NSException raise:DCNSPortCoderException format:@"DCNSPortCoder: -encodePortObject: NSPort expected, got %@", port];
-    }
+- (NSUInteger)_decodePropertyListLength {
+    // Every element takes at least a byte, so a length can never be more than what is left.
+    long long len = [self _decodeInteger];
     
-    [(NSMutableArray *) _components addObject:port];
+    if (len < 0 || len > _eod-_pointer)
+        [NSException raise:DCNSPortCoderException format:@"invalid property list length %lld (%@)", len, [self _location]];
+    
+    return (NSUInteger)len;
 }
 
-- (void)encodeArrayOfObjCType:(const char*)type count:(NSUInteger) count at:(const void*)array {
-    int size = objc_sizeof_type(type);
+- (id)_decodeRetainedPropertyListWithDepth:(unsigned int)depth {
+    unsigned char tag;
+    BOOL isMutable;
+    id obj = nil;
     
-#if DEBUG_LOG_LEVEL>=2
-    NSLog(@"DCNSPortCoder: -encodeArrayOfObjCType %s count %lu size %d", type, (unsigned long)count, size);
-#endif
+    if (depth > PLIST_MAX_DEPTH)
+        [NSException raise:DCNSPortCoderException format:@"property list nested too deeply (%@)", [self _location]];
     
-    // FIXME: handle alignment
-    if (size == 1) {
-        // Encode bytes directly
-        [[_components objectAtIndex:0] appendBytes:array length:count];
-        return;
-    }
+    if (_pointer >= _eod)
+        [NSException raise:DCNSPortCoderException format:@"no more data to decode (%@)", [self _location]];
     
-    while(count-- > 0) {
-        [self encodeValueOfObjCType:type at:array];
-        array = size + (char *) array;
+    tag = *_pointer++;
+    isMutable = (tag & PLIST_TAG_MUTABLE) != 0;
+    
+    switch (tag & ~PLIST_TAG_MUTABLE) {
+        case PLIST_TAG_NULL:
+            return [[NSNull null] retain];
+        case PLIST_TAG_TRUE:
+            return [[NSNumber numberWithBool:YES] retain];
+        case PLIST_TAG_FALSE:
+            return [[NSNumber numberWithBool:NO] retain];
+        case PLIST_TAG_NUMBER: {
+            char type;
+            
+            if (_pointer >= _eod)
+                [NSException raise:DCNSPortCoderException format:@"no more data to decode (%@)", [self _location]];
+            
+            type = *_pointer++;
+            
+            switch (type) {
+                case _C_CHR: return [[NSNumber alloc] initWithChar:(char)[self _decodeInteger]];
+                case _C_UCHR: return [[NSNumber alloc] initWithUnsignedChar:(unsigned char)[self _decodeInteger]];
+                case _C_SHT: return [[NSNumber alloc] initWithShort:(short)[self _decodeInteger]];
+                case _C_USHT: return [[NSNumber alloc] initWithUnsignedShort:(unsigned short)[self _decodeInteger]];
+                case _C_INT: return [[NSNumber alloc] initWithInt:(int)[self _decodeInteger]];
+                case _C_UINT: return [[NSNumber alloc] initWithUnsignedInt:(unsigned int)[self _decodeInteger]];
+                case _C_LNG: return [[NSNumber alloc] initWithLong:(long)[self _decodeInteger]];
+                case _C_ULNG: return [[NSNumber alloc] initWithUnsignedLong:(unsigned long)[self _decodeInteger]];
+                case _C_LNG_LNG: return [[NSNumber alloc] initWithLongLong:[self _decodeInteger]];
+                case _C_ULNG_LNG: return [[NSNumber alloc] initWithUnsignedLongLong:(unsigned long long)[self _decodeInteger]];
+                case _C_FLT: {
+                    float value;
+                    [self decodeValueOfObjCType:@encode(float) at:&value];
+                    return [[NSNumber alloc] initWithFloat:value];
+                }
+                case _C_DBL: {
+                    double value;
+                    [self decodeValueOfObjCType:@encode(double) at:&value];
+                    return [[NSNumber alloc] initWithDouble:value];
+                }
+                default:
+                    [NSException raise:DCNSPortCoderException format:@"can't decode number of type %c (%@)", type, [self _location]];
+            }
+            break;
+        }
+        case PLIST_TAG_STRING: {
+            NSUInteger len = [self _decodePropertyListLength];
+            
+            obj = [[(isMutable ? [NSMutableString class] : [NSString class]) alloc] initWithBytes:_pointer length:len encoding:NSUTF8StringEncoding];
+            _pointer += len;
+            
+            if (!obj)
+                [NSException raise:DCNSPortCoderException format:@"invalid UTF-8 in string (%@)", [self _location]];
+            
+            return obj;
+        }
+        case PLIST_TAG_DATA: {
+            NSUInteger len = [self _decodePropertyListLength];
+            
+            obj = [[(isMutable ? [NSMutableData class] : [NSData class]) alloc] initWithBytes:_pointer length:len];
+            _pointer += len;
+            
+            return obj;
+        }
+        case PLIST_TAG_ARRAY:
+        case PLIST_TAG_DICTIONARY: {
+            BOOL isDictionary = (tag & ~PLIST_TAG_MUTABLE) == PLIST_TAG_DICTIONARY;
+            NSUInteger count = [self _decodePropertyListLength];
+            NSUInteger total = isDictionary ? 2*count : count;
+            NSUInteger decoded = 0, i;
+            id *objects = malloc(MAX(total, 1)*sizeof(id));
+            
+            @try {
+                for (decoded = 0; decoded < total; decoded++)
+                    objects[decoded] = [self _decodeRetainedPropertyListWithDepth:depth+1];
+                
+                if (isDictionary) {
+                    // Decoded as key, value, key, value...
+                    id *keys = malloc(MAX(count, 1)*sizeof(id));
+                    id *values = malloc(MAX(count, 1)*sizeof(id));
+                    
+                    for (i = 0; i < count; i++) {
+                        keys[i] = objects[2*i];
+                        values[i] = objects[2*i+1];
+                    }
+                    
+                    obj = [[(isMutable ? [NSMutableDictionary class] : [NSDictionary class]) alloc] initWithObjects:values forKeys:keys count:count];
+                    
+                    free(keys);
+                    free(values);
+                } else {
+                    obj = [[(isMutable ? [NSMutableArray class] : [NSArray class]) alloc] initWithObjects:objects count:count];
+                }
+            } @finally {
+                for (i = 0; i < decoded; i++)
+                    [objects[i] release];
+                free(objects);
+            }
+            
+            return obj;
+        }
+        default:
+            [NSException raise:DCNSPortCoderException format:@"unknown property list tag %02x (%@)", tag, [self _location]];
     }
+    
+    return nil;
 }
 
 - (void)encodeObject:(id)obj {
@@ -374,8 +1759,32 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
         class = [robj classForPortCoder];	// only available for NSObject but not for NSProxy
     else
         class = [robj class];
+    
+    // Values are sent as a flat copy, for peers that understand it.
+    DCNSValueLayout *valueLayout = NULL;
+    if (flag && ![robj isProxy] && (_wireFeatures & DCNS_WIRE_FEATURE_VALUE_CODING))
+        valueLayout = _DCNSValueLayoutForClass(class);
+    
+    if (flag && !_isByref && (_wireFeatures & DCNS_WIRE_FEATURE_PROPERTY_LISTS) && ![robj isProxy]) {
+        NSMutableData *data = [_components objectAtIndex:0];
+        NSUInteger length = [data length];
+        
+        flag = PLIST_OBJECT;
+        [self encodeValueOfObjCType:@encode(signed char) at:&flag];
+        
+        if ([self _encodePropertyList:robj depth:0]) {
+            _isBycopy = _isByref = NO;
+            return;
+        }
+        
+        // Not a property list after all.
+        [data setLength:length];
+        flag = YES;
+    }
 
     // the first byte is the non-nil/nil flag
+    if (valueLayout)
+        flag = VALUE_OBJECT;
     [self encodeValueOfObjCType:@encode(signed char) at:&flag];
     
     if (flag) {
@@ -421,6 +1830,8 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
         
         if (class == [NSInvocation class])
             [self encodeInvocation:robj];
+        else if (valueLayout)
+            [self _encodeValue:robj withLayout:valueLayout];
         else if (![robj isProxy] && [class instancesRespondToSelector:@selector(_encodeWithPortCoder:)])
             [robj _encodeWithPortCoder:self];	// this allows to define different encoding
         else
@@ -497,6 +1908,10 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
         }
         case _C_CLASS: {
             Class c = *((Class *)address);
+            
+            if (c && _outgoingNames && [self _encodeInternedKey:c name:[NSStringFromClass(c) UTF8String]])
+                break;
+            
             signed char flag = YES;
             const char *class = c ? [NSStringFromClass(c) UTF8String] : "nil";
             
@@ -507,6 +1922,10 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
         }
         case _C_SEL: {
             SEL s = *((SEL *) address);
+            
+            if (s && _outgoingNames && [self _encodeInternedKey:s name:[NSStringFromSelector(s) UTF8String]])
+                break;
+            
             signed char flag = (s != NULL);
             const char *sel = s != NULL ? [NSStringFromSelector(s) UTF8String] : "null";
             [self encodeValueOfObjCType:@encode(signed char) at:&flag];
@@ -547,17 +1966,18 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
             // mclarke :: PPC is suitably old enough now (Nov 2016) to not worry too much about it.
             NSSwappedFloat val = NSSwapHostFloatToLittle(*(float *)address);
             
-            char len = sizeof(float);
-            [data appendBytes:&len length:1];
-            [data appendBytes:&val length:len];
+            unsigned char bytes[1+sizeof(float)] = { sizeof(float) };
+            memcpy(bytes+1, &val, sizeof(float));
+            [data appendBytes:bytes length:sizeof(bytes)];
             break;
         }
         case _C_DBL: {
             NSMutableData *data = [_components objectAtIndex:0];
             NSSwappedDouble val = NSSwapHostDoubleToLittle(*(double *)address);
-            char len = sizeof(double);
-            [data appendBytes:&len length:1];
-            [data appendBytes:&val length:len];
+            
+            unsigned char bytes[1+sizeof(double)] = { sizeof(double) };
+            memcpy(bytes+1, &val, sizeof(double));
+            [data appendBytes:bytes length:sizeof(bytes)];
             break;
         }
         case _C_ATOM:
@@ -599,6 +2019,12 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
         case _C_STRUCT_B: {
             // Recursively encode components! type is e.g. "{testStruct=c*}"
             
+            DCNSTypePlan *plan = _DCNSTypePlanForType(type);
+            if (plan) {
+                [self _encodeWithTypePlan:plan at:address];
+                break;
+            }
+            
             while (*type != 0 && *type != '=' && *type != _C_STRUCT_E)
                 type++;
             
@@ -683,10 +2109,177 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
     return NSSwapLittleLongLongToHost(d.val);
 }
 
+- (const char *)_decodeNameWithReturnedLength:(NSUInteger *)length {
+    // Left in the message, rather than copied out as -decodeBytesWithReturnedLength: would.
+    unsigned long len = (unsigned long)[self _decodeInteger];
+    const char *name = (const char *)_pointer;
+    
+    if (_pointer+len > _eod)
+        [NSException raise:DCNSPortCoderException format:@"not enough data to decode name (length=%lu): %@", len, [self _location]];
+    
+    _pointer += len;
+    *length = len;
+    
+    return name;
+}
+
+- (unsigned int)_decodeNameDefinitionIfFlagged:(signed char)flag {
+    // Returns the id being defined, or 0 for a name sent the plain way.
+    if (flag != NAME_DEFINITION)
+        return 0;
+    
+    return (unsigned int)[self _decodeInteger];
+}
+
+- (const void *)_decodeNameReference {
+    const void *value = NULL;
+    unsigned int nameId = (unsigned int)[self _decodeInteger];
+    
+    if (![_incomingNames getResolved:&value forId:nameId])
+        [NSException raise:DCNSPortCoderException format:@"reference to undefined interned name %u (%@)", nameId, [self _location]];
+    
+    return value;
+}
+
+- (void)_decodeWithTypePlan:(DCNSTypePlan *)plan at:(void *)address {
+    unsigned int i;
+    
+    for (i = 0; i < plan->count; i++) {
+        const DCNSTypeOp *op = &plan->ops[i];
+        void *member = (char *)address + op->offset;
+        
+        switch (op->kind) {
+            case _C_CHR:
+            case _C_UCHR:
+                if (_pointer >= _eod)
+                    [NSException raise:DCNSPortCoderException format:@"not enough data to decode char: %@", [self _location]];
+                
+                *((char *) member) = *_pointer++;
+                break;
+            case _C_SHT:
+            case _C_USHT:
+                *((short *) member) = [self _decodeInteger];
+                break;
+            case _C_INT:
+            case _C_UINT:
+                *((int *) member) = (int)[self _decodeInteger];
+                break;
+            case _C_LNG:
+            case _C_ULNG:
+                *((long *) member) = (long)[self _decodeInteger];
+                break;
+            case _C_LNG_LNG:
+            case _C_ULNG_LNG:
+                *((long long *) member) = [self _decodeInteger];
+                break;
+            case _C_FLT: {
+                NSSwappedFloat val;
+                
+                if (_pointer+sizeof(float) >= _eod || *_pointer != sizeof(float))
+                    [NSException raise:DCNSPortCoderException format:@"can't decode float (%@)", [self _location]];
+                
+                memcpy(&val, _pointer+1, sizeof(float));
+                _pointer += 1+sizeof(float);
+                
+                *((float *) member) = NSSwapLittleFloatToHost(val);
+                break;
+            }
+            case _C_DBL: {
+                NSSwappedDouble val;
+                
+                if (_pointer+sizeof(double) >= _eod || *_pointer != sizeof(double))
+                    [NSException raise:DCNSPortCoderException format:@"can't decode double (%@)", [self _location]];
+                
+                memcpy(&val, _pointer+1, sizeof(double));
+                _pointer += 1+sizeof(double);
+                
+                *((double *) member) = NSSwapLittleDoubleToHost(val);
+                break;
+            }
+            case 'B':
+                *((bool *) member) = [self _decodeInteger] != 0;
+                break;
+            default:
+                [self decodeValueOfObjCType:op->type at:member];
+                break;
+        }
+    }
+}
+
 - (NSPort *)decodePortObject {
     return NIMP;
 }
 
+- (void)_decodeBulkArrayOfObjCType:(const char *)type count:(NSUInteger)count at:(void *)array size:(int)size {
+    NSUInteger i;
+    int width;
+    
+    while (*type == _C_CONST)
+        type++;
+    
+    if (_pointer+2 > _eod)
+        [NSException raise:DCNSPortCoderException format:@"not enough data to decode bulk array (%@)", [self _location]];
+    
+    width = _pointer[1];
+    _pointer += 2;
+    
+    if ((width != 2 && width != 4 && width != 8) || count > (NSUInteger)(_eod-_pointer)/width)
+        [NSException raise:DCNSPortCoderException format:@"invalid bulk array of %lu elements of width %d (%@)", (unsigned long)count, width, [self _location]];
+    
+    if (width == size) {
+        memcpy(array, _pointer, count*size);
+#ifdef __BIG_ENDIAN__
+        _DCNSSwapArrayElements(array, count, size);
+#endif
+        _pointer += count*size;
+        return;
+    }
+    
+    // The remote's longs may not be the same width as ours.
+    switch (*type) {
+        case _C_SHT:
+        case _C_USHT:
+        case _C_INT:
+        case _C_UINT:
+        case _C_LNG:
+        case _C_ULNG:
+        case _C_LNG_LNG:
+        case _C_ULNG_LNG:
+            break;
+        default:
+            [NSException raise:DCNSPortCoderException format:@"can't decode bulk array of %s with width %d", type, width];
+    }
+    
+    for (i = 0; i < count; i++) {
+        union {
+            long long val;
+            unsigned char data[8];
+        } d;
+        
+        // Sign-extend for the signed types, which are the lower case ones.
+        d.val = (islower(*type) && (_pointer[width-1] & 0x80)) ? -1 : 0;
+        memcpy(d.data, _pointer, width);
+        _pointer += width;
+        
+        long long val = NSSwapLittleLongLongToHost(d.val);
+        void *element = (char *)array + i*size;
+        
+        switch (size) {
+            case 2:
+                *((short *) element) = (short)val;
+                break;
+            case 4:
+                *((int *) element) = (int)val;
+                break;
+            case 8:
+                *((long long *) element) = val;
+                break;
+            default:
+                [NSException raise:DCNSPortCoderException format:@"can't decode bulk array of %s", type];
+        }
+    }
+}
+
 - (void)decodeArrayOfObjCType:(const char*)type count:(NSUInteger)count at:(void*)array {
     int size = objc_sizeof_type(type);
     
@@ -700,6 +2293,13 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
         return;
     }
     
+    // Any peer may send us a bulk array once we have said we understand them, but only of fixed-width numbers;
+    // for anything else the first byte belongs to the first element, whatever its value.
+    if (_pointer < _eod && *_pointer == BULK_ARRAY_MARKER && _DCNSBulkArrayMinCount(type) > 0) {
+        [self _decodeBulkArrayOfObjCType:type count:count at:array size:size];
+        return;
+    }
+    
     while (count-- > 0) {
         [self decodeValueOfObjCType:type at:array];
         array = size + (char *) array;
@@ -770,17 +2370,27 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
             
             [self decodeValueOfObjCType:@encode(signed char) at:&flag];
             
-            if (flag) {
+            if (flag == NAME_REFERENCE) {
+                class = (Class)[self _decodeNameReference];
+            } else if (flag) {
+                unsigned int nameId = [self _decodeNameDefinitionIfFlagged:flag];
                 NSUInteger len;
-                char *str = [self decodeBytesWithReturnedLength:&len];	// include terminating 0 byte
+                const char *str = [self _decodeNameWithReturnedLength:&len];	// include terminating 0 byte
                 
-                // check if last byte is 00
-                
-                NSString *s = [NSString stringWithUTF8String:str];
+                if (_nameCache) {
+                    class = [_nameCache classNamed:str length:len];
+                } else {
+                    // check if last byte is 00
+                    
+                    NSString *s = [[[NSString alloc] initWithBytes:str length:(len > 0 ? len-1 : 0) encoding:NSUTF8StringEncoding] autorelease];
+                    
+                    // May not really be needed unless someone defines a class named "Nil"
+                    if (s && ![s isEqualToString:@"Nil"])
+                        class = NSClassFromString(s);
+                }
                 
-                // May not really be needed unless someone defines a class named "Nil"
-                if (![s isEqualToString:@"Nil"])
-                    class = NSClassFromString(s);
+                if (nameId)
+                    [_incomingNames setResolved:class forId:nameId];
             }
             *((Class *)address) = class;
             return;
@@ -791,14 +2401,24 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
             
             [self decodeValueOfObjCType:@encode(signed char) at:&flag];
             
-            if (flag) {
+            if (flag == NAME_REFERENCE) {
+                sel = (SEL)[self _decodeNameReference];
+            } else if (flag) {
+                unsigned int nameId = [self _decodeNameDefinitionIfFlagged:flag];
                 NSUInteger len;
-                char *str = [self decodeBytesWithReturnedLength:&len];	// include terminating 0 byte
+                const char *str = [self _decodeNameWithReturnedLength:&len];	// include terminating 0 byte
                 
-                // check if last byte is really 00
+                if (_nameCache) {
+                    sel = [_nameCache selectorNamed:str length:len];
+                } else {
+                    // check if last byte is really 00
+                    
+                    NSString *s = [[[NSString alloc] initWithBytes:str length:(len > 0 ? len-1 : 0) encoding:NSUTF8StringEncoding] autorelease];
+                    sel = NSSelectorFromString(s);
+                }
                 
-                NSString *s = [NSString stringWithUTF8String:str];
-                sel = NSSelectorFromString(s);
+                if (nameId)
+                    [_incomingNames setResolved:sel forId:nameId];
             }
             *((SEL *)address) = sel;
             return;
@@ -916,6 +2536,12 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
         case _C_STRUCT_B: {
             // Recursively decode components! type is e.g. "{testStruct=c*}"
             
+            DCNSTypePlan *plan = _DCNSTypePlanForType(type);
+            if (plan) {
+                [self _decodeWithTypePlan:plan at:address];
+                break;
+            }
+            
             while (*type != 0 && *type != '=' && *type != _C_STRUCT_E)
                 type++;
             
@@ -941,6 +2567,11 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
             }
             break;
         }
+        case 'B': {
+            // C++ BOOL, as encoded.
+            *((bool *) address) = [self _decodeInteger] != 0;
+            break;
+        }
         case _C_UNION_B:
         default:
             NSLog(@"DCNSPortCoder: -decodeValueOfObjCType: can't decodeValueOfObjCType:%s", type);
@@ -951,13 +2582,47 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
 - (NSInteger)versionForClassName:(NSString *)className {
     // Can be called within initWithCoder to find out which version(s) to decode
     
-    NSNumber *version = [_classVersions objectForKey:className];
-    if (version)
-        return [version intValue];	// defined by sender
+    Class cls = NSClassFromString(className);
+    if (cls)
+        return [self versionForClass:cls];
     
     return [[self connection] versionForClassNamed:className];
 }
 
+- (NSInteger)versionForClass:(Class)cls {
+    unsigned int i = _classVersionCount;
+    
+    // The innermost object's versions take precedence.
+    while (i-- > 0) {
+        if (_classVersions[i].cls == cls)
+            return _classVersions[i].version;	// defined by sender
+    }
+    
+    return [[self connection] versionForClassNamed:NSStringFromClass(cls)];
+}
+
+- (void)_pushVersion:(int)version forClass:(Class)cls {
+    if (!_classVersions) {
+        _classVersions = _classVersionsInline;
+        _classVersionCapacity = DCNS_CLASS_VERSION_STACK_INLINE;
+    }
+    
+    if (_classVersionCount == _classVersionCapacity) {
+        DCNSClassVersion *grown = malloc(2*_classVersionCapacity*sizeof(DCNSClassVersion));
+        memcpy(grown, _classVersions, _classVersionCount*sizeof(DCNSClassVersion));
+        
+        if (_classVersions != _classVersionsInline)
+            free(_classVersions);
+        
+        _classVersions = grown;
+        _classVersionCapacity *= 2;
+    }
+    
+    _classVersions[_classVersionCount].cls = cls;
+    _classVersions[_classVersionCount].version = version;
+    _classVersionCount++;
+}
+
 @end
 
 @implementation DCNSPortCoder (NSConcretePortCoder)
@@ -970,8 +2635,22 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
     _send=nil;
     [_components release];
     _components=nil;
+    
     [_imports release];
     _imports=nil;
+    [_outgoingNames release];
+    _outgoingNames=nil;
+    [_incomingNames release];
+    _incomingNames=nil;
+    [_definedNames release];
+    _definedNames=nil;
+    [_nameCache release];
+    _nameCache=nil;
+    
+    if (_classVersions != _classVersionsInline)
+        free(_classVersions);
+    _classVersions=NULL;
+    _classVersionCount=0;
 }
 
 - (NSArray *)components {
@@ -1036,7 +2715,8 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
     
     // NOTE: if we move this to NSInvocation we don't even need the private methods
     //const char *type = [sig _methodType];	// would be a little faster
-    const char *type = [[sig _typeString] UTF8String];
+    NSString *typeString = [sig _typeString];
+    const char *type = [typeString UTF8String];
 
     [self encodeValueOfObjCType:@encode(id) at:&target];
     
@@ -1044,8 +2724,16 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
     [self encodeValueOfObjCType:@encode(int) at:&cnt];
     [self encodeValueOfObjCType:@encode(SEL) at:&selector];
     
-    // Method type
-    [self encodeValueOfObjCType:@encode(char *) at:&type];
+    // Method type, which is interned like the selector when the remote allows and the table has room.
+    BOOL confirmed = NO;
+    unsigned int nameId = _outgoingNames ? [_outgoingNames idForName:typeString confirmed:&confirmed] : 0;
+    
+    if (nameId) {
+        if (![self _encodeInternedId:nameId confirmed:confirmed])
+            [self encodeBytes:type length:strlen(type)+1];	// include final 0-byte
+    } else {
+        [self encodeValueOfObjCType:@encode(char *) at:&type];
+    }
 
     NS_DURING
     
@@ -1092,9 +2780,10 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
      */
 
     NSInvocation *i;
-    NSMethodSignature *sig;
+    NSMethodSignature *sig = nil;
     void *buffer;
-    char *type;
+    char *type = NULL;
+    signed char flag;
     int cnt;	// number of arguments (incl. target&selector)
     unsigned char len;
     id target;
@@ -1109,18 +2798,30 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
 #endif
     
     [self decodeValueOfObjCType:@encode(SEL) at:&selector];
-    [self decodeValueOfObjCType:@encode(char *) at:&type];
+    
+    // Method type, or a reference to a signature the remote has already sent us.
+    [self decodeValueOfObjCType:@encode(signed char) at:&flag];
+    
+    if (flag == NAME_REFERENCE) {
+        sig = (id)[self _decodeNameReference];
+    } else if (flag) {
+        unsigned int nameId = [self _decodeNameDefinitionIfFlagged:flag];
+        
+        type = [self decodeBytesWithReturnedLength:NULL];
+        sig = [NSMethodSignature signatureWithObjCTypes:type];
+        
+        if (nameId)
+            [_incomingNames setResolvedObject:sig forId:nameId];
+    }
+    
+    if (!sig)
+        [NSException raise:DCNSPortCoderException format:@"missing method signature for invocation (%@)", [self _location]];
     
     // FIXME: we must check if it is big enough...
     // should set the buffer size internal to the NSInvocation
     [self decodeValueOfObjCType:@encode(unsigned char) at:&len];
     
-#if 0
-    type = translateSignatureFromNetwork(type);
-#endif
-    
     // Create NSInvocation
-    sig = [NSMethodSignature signatureWithObjCTypes:type];
     i = [NSInvocation invocationWithMethodSignature:sig];
     
     // Allocate a buffer
@@ -1174,14 +2875,22 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
     Class class;
     id obj;
     signed char flag;
-    NSMutableDictionary *savedClassVersions;
+    unsigned int savedClassVersionCount;
     int version;
+    DCNSValueLayout *valueLayout = NULL;
+    BOOL isValue;
     
     // The first byte is the non-nil/nil flag
     [self decodeValueOfObjCType:@encode(signed char) at:&flag];
     if (!flag)
         return nil;
     
+    if (flag == PLIST_OBJECT)
+        return [self _decodeRetainedPropertyListWithDepth:0];
+    
+    // Only the sender knows whether it used the value layout, e.g. a peer without it sends the same class as usual.
+    isValue = (flag == VALUE_OBJECT);
+    
     [self decodeValueOfObjCType:@encode(Class) at:&class];
     
     if (!class) {
@@ -1190,13 +2899,12 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
         return nil; // psymac :: Is this reached?
     }
     
+    if (isValue && !(valueLayout = _DCNSValueLayoutForClass(class)))
+        [NSException raise:DCNSPortCoderException format:@"%@ was sent as a value, but doesn't adopt DCNSValueCoding here (%@)", class, [self _location]];
+    
     // FIXME: This all is handled by [connection addClassNamed: version:]
-    // But, how do we know to pop the stack?
-    savedClassVersions = _classVersions;
-    if (_classVersions)
-        _classVersions = [_classVersions mutableCopy];
-    else
-        _classVersions = [[NSMutableDictionary alloc] initWithCapacity:5];
+    // Versions sent with this object are in scope until it has been decoded, as are those of enclosing objects.
+    savedClassVersionCount = _classVersionCount;
     
     // Version flag
     [self decodeValueOfObjCType:@encode(signed char) at:&flag];
@@ -1205,7 +2913,7 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
         [self decodeValueOfObjCType:@encode(int) at:&version];
 
         // Save class version
-        [_classVersions setObject:[NSNumber numberWithInt:version] forKey:NSStringFromClass(class)];
+        [self _pushVersion:version forClass:class];
         
         while (YES) {
             // Decode versionForClass info
@@ -1221,13 +2929,17 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
             [self decodeValueOfObjCType:@encode(int) at:&version];
 
             // Save class version
-            [_classVersions setObject:[NSNumber numberWithInt:version] forKey:NSStringFromClass(otherClass)];
+            [self _pushVersion:version forClass:otherClass];
         }
     }
     
     if (class == [NSInvocation class]) {
         // Special handling as long as we can't call initWithCoder: for NSInovocation
         obj = [[self decodeInvocation] retain];
+    } else if (valueLayout) {
+        obj = [self _decodeRetainedValueOfClass:class withLayout:valueLayout];
+    } else if (class == [NSData class] && (obj = [[self _decodeOutOfLineData] retain])) {
+        // Out-of-line data is already immutable, so it is handed over as is rather than copied.
     } else if ([class instancesRespondToSelector:@selector(_initWithPortCoder:)]) {
         // This allows to define a different encoding - currently used for NSString
         obj = [[class alloc] _initWithPortCoder:self];
@@ -1240,8 +2952,7 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
     // almost always 1 - only seen as 0 in some NSInvocation and then the invocation has less data
     [self decodeValueOfObjCType:@encode(signed char) at:&flag];
 
-    [_classVersions release];
-    _classVersions = savedClassVersions;
+    _classVersionCount = savedClassVersionCount;
     
     if (!obj)
         [NSException raise:DCNSPortCoderException format:@"decodeRetainedObject: class %@ not instantiated %@", NSStringFromClass(class), [self _location]];
@@ -1285,7 +2996,7 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
          * For most authentication requests, there will only be two components - data, and credentials.
          */
         
-        // Auth data is present within the components array.
+        // Auth data is always the last component, after any out-of-line data.
         if (len >= 2) {
             // FIXME: what do we do with the other components?
             NSData *data = [components objectAtIndex:len-1];
@@ -1394,6 +3105,11 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
     // such as NSString, NSArray, NSDictionary..., to improve perfomance.
     
     id rep = [self replacementObjectForCoder:coder];
+    
+    // Values go by copy, unless explicitly asked to go by reference.
+    if (rep && ![coder isByref] && ([coder wireFeatures] & DCNS_WIRE_FEATURE_VALUE_CODING) && _DCNSValueLayoutForClass([rep classForPortCoder]))
+        return rep;
+    
     if (rep) {
         // This will be encoded and decoded into a remote proxy
         rep = [DCNSDistantObject proxyWithLocal:rep connection:[coder connection]];
@@ -1474,6 +3190,9 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
 // mclarke :: Changes to correctly encode/decode NSData
 
 - (void)_encodeWithPortCoder:(NSCoder *)coder {
+    if ([coder isKindOfClass:[DCNSPortCoder class]] && [(DCNSPortCoder *)coder _encodeOutOfLineData:self])
+        return;
+    
     const void *bytes = [self bytes];
     unsigned int len = (unsigned int)[self length];
     
@@ -1485,6 +3204,11 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
     void *bytes;
     unsigned int len;
     
+    // Immutable data sent out-of-line never gets this far; mutable data has to be copied regardless.
+    NSData *outOfLine = [coder isKindOfClass:[DCNSPortCoder class]] ? [(DCNSPortCoder *)coder _decodeOutOfLineData] : nil;
+    if (outOfLine)
+        return [self initWithData:outOfLine];
+    
     [coder decodeValueOfObjCType:@encode(unsigned int) at:&len];
     
     bytes = malloc(len);
@@ -1551,8 +3275,10 @@ NSString *const DCNSPortCoderException = @"DCNSPortCoderException";
     char *str;
     unsigned int len;
     
-    if([coder versionForClassName:@"NSString"] != 1)
-        [NSException raise:DCNSPortCoderException format:@"Can't decode version %ld of NSString", (long)[coder versionForClassName:@"NSString"]];
+    NSInteger version = [(DCNSPortCoder *)coder versionForClass:[NSString class]];
+    
+    if(version != 1)
+        [NSException raise:DCNSPortCoderException format:@"Can't decode version %ld of NSString", (long)version];
     
     [coder decodeValueOfObjCType:@encode(unsigned int) at:&len];
 
@@ -60,6 +60,25 @@
 // Little trick from http://stackoverflow.com/a/30106751 so we can nicely cast to void *
 #define INT2VOIDP(i) (void*)(uintptr_t)(i)
 
+// Optional parts of the protocol, agreed between peers when a connection is established.
+// A peer that predates the agreement supports none of them.
+#define DCNS_WIRE_FEATURE_CHANNELS 0x1 // several connections can share one port pair, told apart by channel
+#define DCNS_WIRE_FEATURE_INTERNED_NAMES 0x2 // class names and selectors may be sent as a reference to an earlier definition
+#define DCNS_WIRE_FEATURE_BULK_ARRAYS 0x4 // arrays of fixed-width numbers may be sent as one block of little-endian bytes
+#define DCNS_WIRE_FEATURE_PROPERTY_LISTS 0x8 // by-copy property list graphs may be sent in a compact tagged form
+#define DCNS_WIRE_FEATURE_OUT_OF_LINE_DATA 0x10 // large NSData values may be sent as a component of their own
+#define DCNS_WIRE_FEATURE_VALUE_CODING 0x20 // instances of DCNSValueCoding classes may be sent as a flat copy
+#define DCNS_WIRE_FEATURE_PROXY_CLASSES 0x40 // a reference to an object may carry an identity for its class
+#define DCNS_WIRE_FEATURE_CLASS_DESCRIPTIONS 0x80 // a Distributed Classes server can describe a class and its methods in one reply
+#define DCNS_WIRE_FEATURE_METHOD_SNAPSHOTS 0x100 // a Distributed Classes client can take a MethodProxy by copy
+#define DCNS_WIRE_FEATURE_RELEASE_NOTICES 0x200 // proxies tell the remote when they go away, so it can let go of their objects
+#define DCNS_WIRE_FEATURE_RESULT_INVALIDATION 0x400 // the remote says when results cached from one of its objects may have changed
+#define DCNS_WIRE_FEATURE_KEY_VALUE_SNAPSHOTS 0x800 // several keys of an object may be read in one call
+#define DCNS_WIRE_FEATURES (DCNS_WIRE_FEATURE_CHANNELS | DCNS_WIRE_FEATURE_INTERNED_NAMES | DCNS_WIRE_FEATURE_BULK_ARRAYS | \
+                            DCNS_WIRE_FEATURE_PROPERTY_LISTS | DCNS_WIRE_FEATURE_OUT_OF_LINE_DATA | DCNS_WIRE_FEATURE_VALUE_CODING | \
+                            DCNS_WIRE_FEATURE_PROXY_CLASSES | DCNS_WIRE_FEATURE_CLASS_DESCRIPTIONS | DCNS_WIRE_FEATURE_METHOD_SNAPSHOTS | \
+                            DCNS_WIRE_FEATURE_RELEASE_NOTICES | DCNS_WIRE_FEATURE_RESULT_INVALIDATION | DCNS_WIRE_FEATURE_KEY_VALUE_SNAPSHOTS)
+
 // 0 - no logging, 1 - basic, 2 - somewhat verbose, 3 - can't see the wood for the trees
 #define DEBUG_LOG_LEVEL 0 // Note: in client, level 2 seems to break things.
 
@@ -67,6 +86,21 @@
 - (unsigned int)machPort; // Typically used in our debug logging.
 @end
 
+@interface NSObject (NSDOAdditions)
++ (Class)_classForProxySignatures;	// Nil if the signatures of the receiver can't be told from its class alone
+- (Class)_classForProxySignatures;
++ (Class)_classForProxySignaturesOfInstances;
+- (bycopy NSDictionary *)_dc_valuesForKeys:(bycopy NSArray *)keys;	// NSNull stands in for nil
+- (bycopy NSData *)_dc_packedValuesForKeys:(bycopy NSArray *)keys objCTypes:(bycopy NSString *)types;	// one type per key, unpadded
+@end
+
+@interface DCNSDistantObject (NSPrivate)
++ (void)_setSignature:(NSMethodSignature *)sig forSelector:(SEL)selector remoteClass:(unsigned long long)remoteClass connection:(DCNSConnection *)connection;
++ (void)_removeSignaturesForConnection:(DCNSConnection *)connection;
++ (void)_releaseLocalReference:(unsigned int)ref wireCount:(unsigned int)count connection:(DCNSConnection *)connection;
++ (void)_releaseLocalReferencesForConnection:(DCNSConnection *)connection;
+@end
+
 @interface NSMethodSignature (NSUndocumented)
 - (NSString *) _typeString;		// full method type
 @end
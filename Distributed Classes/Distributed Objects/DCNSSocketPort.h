@@ -44,6 +44,9 @@ typedef CFStringRef CFRunLoopMode;
     int _protocol;
     int _socketType;
     int _protocolFamily;
+    
+    // For remote ports, whether the peer has told us it can reassemble fragmented messages.
+    BOOL _acceptsFragments;
 }
 
 @property(readonly, copy) NSData *address;
@@ -55,6 +58,7 @@ typedef CFStringRef CFRunLoopMode;
 @property (nonatomic, strong) NSMutableDictionary *_connectors;
 @property (nonatomic) CFMutableDictionaryRef _loops;
 @property (nonatomic) CFMutableDictionaryRef _data;
+@property (nonatomic) CFMutableDictionaryRef _fragments;
 @property (nonatomic, strong) NSLock *_lock;
 
 // Runloops stuff.
@@ -77,6 +81,28 @@ typedef CFStringRef CFRunLoopMode;
 + (BOOL)sendBeforeTime:(double)arg1 streamData:(id)arg2 components:(NSArray*)arg3 to:(NSPort*)arg4 from:(NSPort*)arg5 msgid:(unsigned int)arg6 reserved:(unsigned long long)arg7;
 - (BOOL)sendBeforeTime:(double)arg1 streamData:(void *)arg2 components:(NSArray*)arg3 from:(NSPort*)arg4 msgid:(unsigned int)arg5;
 
+/**
+ Frames sent on a socket within the given number of microseconds of its last write are held back and
+ written together in a single writev(), until either the interval passes or the byte budget is reached.
+ A socket that has been idle for longer than the interval always writes straight away. Pass 0 for the
+ interval to disable coalescing.
+
+ Defaults to 200 microseconds and 64KB.
+ @param microseconds The coalescing window
+ @param bytes The number of held back bytes that triggers an early flush
+ */
++ (void)setWriteCoalescingInterval:(unsigned int)microseconds byteBudget:(NSUInteger)bytes;
+
+/**
+ Messages larger than the given size are sent as a series of fragments of at most that size, which are
+ interleaved with any other traffic on the same socket. This is only done for peers that have said they
+ can reassemble fragments. Pass 0 to always send messages whole.
+
+ Defaults to 64KB.
+ @param bytes The largest fragment to send
+ */
++ (void)setFragmentSize:(NSUInteger)bytes;
+
 // Initialisation.
 - (id)initWithProtocolFamily:(int)arg1 socketType:(int)arg2 protocol:(int)arg3 socket:(int)arg4;
 - (id)initWithProtocolFamily:(int)arg1 socketType:(int)arg2 protocol:(int)arg3 address:(NSData*)arg4;
@@ -23,6 +23,11 @@
 #include <stdio.h>
 #include <errno.h>
 #include <netdb.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #import "DCNSSocketPort.h"
 #import "DCNSConnection.h"
@@ -31,10 +36,12 @@
 
 #import <Foundation/NSArray.h>
 #import <Foundation/NSDictionary.h>
+#import <Foundation/NSSet.h>
 #import <Foundation/NSString.h>
 #import <Foundation/NSByteOrder.h>
 #import <Foundation/NSDate.h>
 #import <Foundation/NSAutoreleasePool.h>
+#import <Foundation/NSLock.h>
 
 #if TARGET_OS_MAC && !(TARGET_OS_EMBEDDED || TARGET_OS_IPHONE)
 #import <Foundation/NSHost.h>
@@ -73,6 +80,36 @@ struct PortFlags {
     uint8_t len;
 };
 
+/*
+ * Messages larger than the fragment size are cut up into fragments, each with this header in front.
+ * The fragment's payload is a slice of the original message, and the receiver appends each payload to
+ * a buffer for that stream until the last one arrives.
+ */
+struct FragmentHeader {
+    uint32_t magic;
+    uint32_t len;
+    uint32_t stream;
+    uint32_t flags;
+};
+
+#define DCNS_MESSAGE_MAGIC 0xd0cf50c0
+#define DCNS_FRAGMENT_MAGIC 0xd0cf50c1
+
+#define DCNS_FRAGMENT_FIRST 0x1
+#define DCNS_FRAGMENT_LAST 0x2
+
+// Set in the msgid of every message we send, to tell the peer that we can reassemble fragments.
+#define DCNS_MSGID_ACCEPTS_FRAGMENTS 0x80000000
+
+// The lengths in headers come from the peer, so they are not trusted any further than this.
+#define DCNS_MAX_MESSAGE_LENGTH (256 * 1024 * 1024)
+
+// How many fragmented messages a peer may have in flight on one socket before we hang up on it.
+#define DCNS_MAX_FRAGMENT_STREAMS 64
+
+// The most reserved up front for a reassembled message; beyond that it grows as its fragments arrive.
+#define DCNS_FRAGMENT_INITIAL_CAPACITY (64 * 1024)
+
 @interface DCNSSocketPort (Private)
 - (void)_handleMessage:(CFDataRef)arg1 from:(CFDataRef*)arg2 socket:(CFSocketRef*)arg3;
 - (void)handleConnectionDeath;
@@ -93,6 +130,9 @@ void _DCNSFireSocketData(CFSocketRef s, CFSocketCallBackType type, CFDataRef add
 void _DCNSAddSocketToLoop(const void *key, const void *value, void *context);
 NSString *_DCNSKeyForSocketInfo(unsigned int protocolFamily, unsigned int socketType, unsigned int protocol, NSData *address);
 NSString *_DCNSKeyForSocket(DCNSSocketPort *port);
+static void _DCNSRemoveWriteQueueForSocket(CFSocketRef socket);
+static CFMutableDataRef _DCNSAppendFragment(DCNSSocketPort *port, CFSocketRef s, struct FragmentHeader *fragment, const UInt8 *bytes, CFIndex length, BOOL *abusive);
+static void _DCNSDropSocket(DCNSSocketPort *port, CFSocketRef s);
 
 #pragma mark Callback and helper functions.
 
@@ -199,6 +239,14 @@ void _DCNSFireSocketData(CFSocketRef s, CFSocketCallBackType type, CFDataRef add
             CFDictionaryRemoveValue(port._data, s);
         }
         
+        // Any half-received messages are now never going to be completed.
+        if (port._fragments) {
+            CFDictionaryRemoveValue(port._fragments, s);
+        }
+        
+        // Nothing more can be written to this socket either.
+        _DCNSRemoveWriteQueueForSocket(s);
+        
         // Clear out this socket from _connectors.
         if (port._connectors) {
             NSMutableArray *array = [NSMutableArray array];
@@ -284,8 +332,58 @@ void _DCNSFireSocketData(CFSocketRef s, CFSocketCallBackType type, CFDataRef add
         // Grab header data
         memcpy(&header, buf, sizeof(struct MachHeader));
         
+        // Fragments are appended to their message as they arrive, and the message is handled once the last lands.
+        if (header.magic == NSSwapHostIntToBig(DCNS_FRAGMENT_MAGIC)) {
+            struct FragmentHeader fragment;
+            
+            if (len < (CFIndex)sizeof(struct FragmentHeader)) {
+                break;
+            }
+            
+            memcpy(&fragment, buf, sizeof(struct FragmentHeader));
+            fragment.len = (uint32_t)NSSwapBigIntToHost(fragment.len);
+            fragment.stream = (uint32_t)NSSwapBigIntToHost(fragment.stream);
+            fragment.flags = (uint32_t)NSSwapBigIntToHost(fragment.flags);
+            
+            if (fragment.len < sizeof(struct FragmentHeader)) {
+                CFDataDeleteBytes(result, CFRangeMake(0, len));
+#if DEBUG_LOG_LEVEL>=2
+                NSLog(@"Breaking for fragment.len < header");
+#endif
+                break;
+            }
+            
+            // Wait for the rest of this fragment.
+            if ((CFIndex)fragment.len > len) {
+                break;
+            }
+            
+            BOOL abusive = NO;
+            CFMutableDataRef message = _DCNSAppendFragment(port, s, &fragment, buf + sizeof(struct FragmentHeader), fragment.len - sizeof(struct FragmentHeader), &abusive);
+            
+            if (abusive) {
+                _DCNSDropSocket(port, s);
+                break;
+            }
+            
+            // The payload has been copied out, so just drop it from the front of the buffer.
+            CFDataDeleteBytes(result, CFRangeMake(0, fragment.len));
+            
+            if (message) {
+                [port._lock unlock];
+                [port _handleMessage:message from:&peerAddress socket:&s];
+                [port._lock lock];
+                
+                CFRelease(message);
+            }
+            
+            result = (CFMutableDataRef)CFDictionaryGetValue(port._data, s);
+            flag = result != NULL ? 1 : 0;
+            continue;
+        }
+        
         // First, check to ensure the magic is set correctly.
-        if (header.magic != NSSwapHostIntToBig(0xd0cf50c0)) {
+        if (header.magic != NSSwapHostIntToBig(DCNS_MESSAGE_MAGIC)) {
             CFDataDeleteBytes(result, CFRangeMake(0, len));
 #if DEBUG_LOG_LEVEL>=2
             NSLog(@"Breaking for bad magic: %u", header.magic);
@@ -295,6 +393,12 @@ void _DCNSFireSocketData(CFSocketRef s, CFSocketCallBackType type, CFDataRef add
         
         // Check the header's length; cannot have header+message less than 0x9.
         header.len = (uint32_t)NSSwapBigIntToHost(header.len);
+        if (header.len > DCNS_MAX_MESSAGE_LENGTH) {
+            // Anything larger should have come as fragments, and we won't buffer up to 4GB waiting for it.
+            _DCNSDropSocket(port, s);
+            break;
+        }
+        
         if (header.len < 0x9) {
             CFDataDeleteBytes(result, CFRangeMake(0, len));
 #if DEBUG_LOG_LEVEL>=2
@@ -304,7 +408,7 @@ void _DCNSFireSocketData(CFSocketRef s, CFSocketCallBackType type, CFDataRef add
         }
         
         // Check that the remaining data is more or equal to the amount of data the header says it has.
-        if (len - (int)header.len < 0x0) {
+        if ((CFIndex)header.len > len) {
 #if DEBUG_LOG_LEVEL>=2
              NSLog(@"Breaking for len - header.len < 0x0");
 #endif
@@ -345,6 +449,108 @@ void _DCNSFireSocketData(CFSocketRef s, CFSocketCallBackType type, CFDataRef add
     [port._lock unlock];
 }
 
+static void _DCNSDropSocket(DCNSSocketPort *port, CFSocketRef s) {
+    // Called with port._lock held, for a peer that has broken the limits above. Nothing it has sent is kept.
+    NSLog(@"[DCNSSocketPort] :: Peer exceeded message limits; closing its socket.");
+    
+    if (port._data) {
+        CFDictionaryRemoveValue(port._data, s);
+    }
+    
+    if (port._fragments) {
+        CFDictionaryRemoveValue(port._fragments, s);
+    }
+    
+    CFSocketInvalidate(s);
+}
+
+static CFMutableDataRef _DCNSAppendFragment(DCNSSocketPort *port, CFSocketRef s, struct FragmentHeader *fragment, const UInt8 *bytes, CFIndex length, BOOL *abusive) {
+    // Called with port._lock held. Returns a retained, complete message once the last fragment is in.
+    // A message that grows past its own header's length, or past the limit, is dropped, and a peer with
+    // too many messages in flight has *abusive set so its socket can be closed.
+    
+    if (!port._fragments) {
+        port._fragments = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+    }
+    
+    // socket -> (stream -> message so far)
+    CFMutableDictionaryRef streams = (CFMutableDictionaryRef)CFDictionaryGetValue(port._fragments, s);
+    if (!streams) {
+        streams = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+        CFDictionarySetValue(port._fragments, s, streams);
+        CFRelease(streams);
+    }
+    
+    const void *key = INT2VOIDP(fragment->stream);
+    CFMutableDataRef message = (CFMutableDataRef)CFDictionaryGetValue(streams, key);
+    
+    if (fragment->flags & DCNS_FRAGMENT_FIRST) {
+        // The first fragment starts with the message's own header, so we know up front how much is coming.
+        struct MachHeader header;
+        NSUInteger expected;
+        
+        if (!message && CFDictionaryGetCount(streams) >= DCNS_MAX_FRAGMENT_STREAMS) {
+            *abusive = YES;
+            return NULL;
+        }
+        
+        if (length < (CFIndex)sizeof(struct MachHeader)) {
+            CFDictionaryRemoveValue(streams, key);
+            return NULL;
+        }
+        
+        memcpy(&header, bytes, sizeof(struct MachHeader));
+        expected = (uint32_t)NSSwapBigIntToHost(header.len);
+        
+        if (expected > DCNS_MAX_MESSAGE_LENGTH || (NSUInteger)length > expected) {
+#if DEBUG_LOG_LEVEL>=1
+            NSLog(@"[DCNSSocketPort] :: Dropping stream %u of unreasonable length %lu", fragment->stream, (unsigned long)expected);
+#endif
+            CFDictionaryRemoveValue(streams, key);
+            return NULL;
+        }
+        
+        // The header is only the peer's word, so don't reserve all of it before the data turns up.
+        message = (CFMutableDataRef)[[NSMutableData alloc] initWithCapacity:MIN(expected, DCNS_FRAGMENT_INITIAL_CAPACITY)];
+        CFDictionarySetValue(streams, key, message);
+        CFRelease(message);
+    }
+    
+    if (!message) {
+#if DEBUG_LOG_LEVEL>=1
+        NSLog(@"[DCNSSocketPort] :: Dropping fragment for unknown stream %u", fragment->stream);
+#endif
+        return NULL;
+    }
+    
+    // Every message starts with its header, which was checked above; it mustn't grow past what that says.
+    struct MachHeader header;
+    if (CFDataGetLength(message) > 0) {
+        memcpy(&header, CFDataGetBytePtr(message), sizeof(struct MachHeader));
+    } else {
+        memcpy(&header, bytes, sizeof(struct MachHeader));
+    }
+    
+    if ((NSUInteger)(CFDataGetLength(message) + length) > (uint32_t)NSSwapBigIntToHost(header.len)) {
+#if DEBUG_LOG_LEVEL>=1
+        NSLog(@"[DCNSSocketPort] :: Dropping stream %u for overrunning its length", fragment->stream);
+#endif
+        CFDictionaryRemoveValue(streams, key);
+        return NULL;
+    }
+    
+    CFDataAppendBytes(message, bytes, length);
+    
+    if (fragment->flags & DCNS_FRAGMENT_LAST) {
+        CFRetain(message);
+        CFDictionaryRemoveValue(streams, key);
+        
+        return message;
+    }
+    
+    return NULL;
+}
+
 void _DCNSAddSocketToLoop(const void *key, const void *value, void *context) {
     // context is a CFSocketRef
     CFRunLoopSourceRef runloopSource = CFSocketCreateRunLoopSource(NULL, context, 0x258);
@@ -375,15 +581,562 @@ NSString *_DCNSKeyForSocket(DCNSSocketPort *port) {
 
 static NSLock *_DCNSSendingSocketsLock;
 static NSLock *_DCNSRemoteSocketPortsLock;
+static NSLock *_DCNSWriteQueuesLock;
 
 static CFMutableDictionaryRef _DCNSSendingSockets;
 static CFMutableDictionaryRef _DCNSRemoteSocketPorts;
+static CFMutableDictionaryRef _DCNSWriteQueues;
+
+// Defaults for new write queues, which each take their own copy under _DCNSWriteQueuesLock.
+
+// Frames arriving within this many microseconds of the last write to a socket are held back and coalesced.
+static unsigned int _DCNSWriteCoalescingInterval = 200;
+
+// Once this many bytes are held back for a socket, they are flushed without waiting out the interval.
+static NSUInteger _DCNSWriteCoalescingByteBudget = 64 * 1024;
+
+// Messages larger than this are sent as fragments, interleaved with everything else on the socket.
+static NSUInteger _DCNSFragmentSize = 64 * 1024;
+
+// Data components at least this large are written from, and received into, their own storage.
+static NSUInteger _DCNSLargeComponentLength = 32 * 1024;
+
+#pragma mark Large components
+
+/*
+ * A frame used to be built by copying every component into one buffer, and each data component was
+ * copied back out of the receive buffer on the way in. For a multi-megabyte NSData, that was two extra
+ * copies on top of those made by the coder.
+ *
+ * A frame is now a list of segments. Small components are still gathered into a shared buffer along
+ * with the headers, but large ones become segments of their own and are handed to writev() as they are.
+ * On receipt, a large component is a slice of the buffer its message was read into, keeping that buffer
+ * alive for as long as the slice is, so its bytes are only copied once, on their way in from the socket.
+ */
+
+@interface DCNSDataSlice : NSData {
+    NSData *_buffer;
+    const void *_bytes;
+    NSUInteger _length;
+}
+
+- (instancetype)initWithBuffer:(NSData*)buffer range:(NSRange)range;
+
+@end
+
+@implementation DCNSDataSlice
+
+- (instancetype)initWithBuffer:(NSData*)buffer range:(NSRange)range {
+    self = [super init];
+    
+    if (self) {
+        _buffer = [buffer retain];
+        _bytes = (const char *)[buffer bytes] + range.location;
+        _length = range.length;
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    [_buffer release];
+    [super dealloc];
+}
+
+- (const void *)bytes {
+    return _bytes;
+}
+
+- (NSUInteger)length {
+    return _length;
+}
+
+@end
+
+static NSUInteger _DCNSLengthOfSegments(NSArray *segments) {
+    NSUInteger length = 0;
+    
+    for (NSData *segment in segments) {
+        length += [segment length];
+    }
+    
+    return length;
+}
+
+#pragma mark Write coalescing
+
+/*
+ * Small frames (acks, one-word replies, the DH exchange) used to go out as one CFSocketSendData()
+ * call apiece, and so as one syscall and, with Nagle disabled, one TCP segment apiece.
+ *
+ * Each sending socket now has a write queue in front of it. If the socket has been idle for longer
+ * than the coalescing interval, a frame is written straight away so that latency is unaffected.
+ * Otherwise, the frame is held back until either the interval passes or the byte budget is reached,
+ * and everything held back is then written in a single writev(). Frames enqueued whilst a write is
+ * in progress are picked up by the writing thread once it finishes, which keeps frames in order.
+ *
+ * Large messages are not written in one go, as anything small queued behind them (acks, control
+ * calls) would have to wait for the whole thing. Instead, they become a stream that hands out one
+ * fragment at a time. Each pass over the queue writes every pending small frame, then one fragment
+ * from each stream in turn, so no single message can hold up the socket for more than a fragment.
+ *
+ * A write that was held back fails with nobody waiting on it, so the queue keeps the ports its held
+ * back frames were sent to, and on failure tells their connections that the port has gone away.
+ */
+
+@interface DCNSSocketWriteStream : NSObject {
+    NSUInteger _segment;
+    NSUInteger _segmentOffset;
+}
+
+@property (nonatomic, retain) NSArray *segments;
+@property (nonatomic, readwrite) NSUInteger length;
+@property (nonatomic, readwrite) NSUInteger offset;
+@property (nonatomic, readwrite) uint32_t identifier;
+@property (nonatomic, readwrite) NSUInteger fragmentSize;
+
+- (void)appendNextFragmentToArray:(NSMutableArray*)batch;
+- (BOOL)isComplete;
+
+@end
+
+@interface DCNSSocketWriteQueue : NSObject {
+    CFSocketRef _socket;
+    NSLock *_lock;
+    NSMutableArray *_frames;
+    NSMutableArray *_streams;
+    NSUInteger _pendingBytes;
+    uint32_t _nextStream;
+    double _lastWrite;
+    BOOL _writing;
+    BOOL _flushScheduled;
+    
+    // Settings, copied from the globals.
+    unsigned int _coalescingInterval;
+    NSUInteger _byteBudget;
+    NSUInteger _fragmentSize;
+    
+    // The ports that held back frames are addressed to, so that a failure can be reported.
+    NSMutableSet *_deferredPorts;
+}
+
+- (instancetype)initWithSocket:(CFSocketRef)socket;
+- (BOOL)enqueueFrame:(NSArray*)segments to:(DCNSSocketPort*)port acceptsFragments:(BOOL)acceptsFragments beforeTime:(double)limit;
+- (void)setCoalescingInterval:(unsigned int)microseconds byteBudget:(NSUInteger)bytes fragmentSize:(NSUInteger)fragmentSize;
+- (CFSocketRef)socket;
+
+@end
+
+static BOOL _DCNSSetSocketCork(int fd, BOOL cork) {
+    int value = cork ? 1 : 0;
+    
+#if defined(TCP_CORK)
+    return setsockopt(fd, IPPROTO_TCP, TCP_CORK, (void *)&value, sizeof(int)) == 0;
+#else
+    // Darwin's TCP_NOPUSH does not push out held data when it is cleared, so it cannot stand in
+    // for TCP_CORK here. writev() batches are already as large as IOV_MAX allows.
+    (void)value;
+    return NO;
+#endif
+}
+
+static BOOL _DCNSWaitForWritable(int fd, double limit) {
+    double remaining = limit - [NSDate timeIntervalSinceReferenceDate];
+    if (remaining <= 0) {
+        return NO;
+    }
+    
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    int result;
+    do {
+        result = poll(&pfd, 1, (int)(remaining * 1000.0) + 1);
+    } while (result < 0 && errno == EINTR);
+    
+    return result > 0 && (pfd.revents & POLLOUT);
+}
+
+static BOOL _DCNSWriteFrames(int fd, NSArray *frames, double limit) {
+    NSUInteger count = [frames count];
+    struct iovec stackVectors[16];
+    struct iovec *vectors = count > 16 ? malloc(sizeof(struct iovec) * count) : stackVectors;
+    
+    if (!vectors) {
+        errno = ENOMEM;
+        return NO;
+    }
+    
+    for (NSUInteger i = 0; i < count; i++) {
+        NSData *frame = [frames objectAtIndex:i];
+        vectors[i].iov_base = (void *)[frame bytes];
+        vectors[i].iov_len = [frame length];
+    }
+    
+    // Only worth corking if the batch cannot go out in one writev().
+    BOOL corked = count > IOV_MAX ? _DCNSSetSocketCork(fd, YES) : NO;
+    
+    struct iovec *iov = vectors;
+    NSUInteger remaining = count;
+    BOOL result = YES;
+    int savedErrno = 0;
+    
+    while (remaining > 0) {
+        ssize_t written = writev(fd, iov, (int)MIN(remaining, (NSUInteger)IOV_MAX));
+        
+        if (written < 0) {
+            if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && _DCNSWaitForWritable(fd, limit))) {
+                continue;
+            }
+            
+            savedErrno = errno;
+            result = NO;
+            break;
+        }
+        
+        // Step past everything that made it out; a partial write leaves us part way into a vector.
+        while (remaining > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            remaining--;
+        }
+        
+        if (remaining > 0 && written > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    
+    if (corked) {
+        _DCNSSetSocketCork(fd, NO);
+    }
+    
+    if (vectors != stackVectors) {
+        free(vectors);
+    }
+    
+    errno = savedErrno;
+    return result;
+}
+
+@implementation DCNSSocketWriteStream
+
+- (void)dealloc {
+    [_segments release];
+    [super dealloc];
+}
+
+- (void)appendNextFragmentToArray:(NSMutableArray*)batch {
+    NSUInteger length = _length - _offset;
+    if (_fragmentSize > 0) {
+        length = MIN(_fragmentSize, length);
+    }
+    
+    struct FragmentHeader header;
+    header.magic = (uint32_t)NSSwapHostIntToBig(DCNS_FRAGMENT_MAGIC);
+    header.len = (uint32_t)NSSwapHostIntToBig((unsigned int)(length + sizeof(struct FragmentHeader)));
+    header.stream = (uint32_t)NSSwapHostIntToBig(_identifier);
+    header.flags = (uint32_t)NSSwapHostIntToBig((_offset == 0 ? DCNS_FRAGMENT_FIRST : 0) | (_offset + length == _length ? DCNS_FRAGMENT_LAST : 0));
+    
+    [batch addObject:[NSData dataWithBytes:&header length:sizeof(struct FragmentHeader)]];
+    
+    // The payload may straddle several segments.
+    NSUInteger remaining = length;
+    while (remaining > 0 && _segment < [_segments count]) {
+        NSData *segment = [_segments objectAtIndex:_segment];
+        NSUInteger slice = MIN([segment length] - _segmentOffset, remaining);
+        
+        // Not a copy; the stream is kept alive by the writer until the batch has gone out.
+        if (slice > 0) {
+            [batch addObject:[NSData dataWithBytesNoCopy:(void *)((const char *)[segment bytes] + _segmentOffset) length:slice freeWhenDone:NO]];
+        }
+        
+        _segmentOffset += slice;
+        remaining -= slice;
+        
+        if (_segmentOffset >= [segment length]) {
+            _segment++;
+            _segmentOffset = 0;
+        }
+    }
+    
+    _offset += length;
+}
+
+- (BOOL)isComplete {
+    return _offset >= _length;
+}
+
+@end
+
+@implementation DCNSSocketWriteQueue
+
+- (instancetype)initWithSocket:(CFSocketRef)socket {
+    self = [super init];
+    
+    if (self) {
+        _socket = (CFSocketRef)CFRetain(socket);
+        _lock = [[NSLock alloc] init];
+        _frames = [[NSMutableArray alloc] initWithCapacity:8];
+        _streams = [[NSMutableArray alloc] init];
+        _deferredPorts = [[NSMutableSet alloc] init];
+        
+        // Created under _DCNSWriteQueuesLock, which guards the globals.
+        _coalescingInterval = _DCNSWriteCoalescingInterval;
+        _byteBudget = _DCNSWriteCoalescingByteBudget;
+        _fragmentSize = _DCNSFragmentSize;
+        
+        int fd = CFSocketGetNative(socket);
+        int set = 1;
+        
+        // This does have the potential for a write error via a SIGPIPE if the remote closed its socket early.
+        // So, we set to ignore that for this socket and handle it ourselves.
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(int));
+        
+        // We do our own batching, so Nagle would only add latency on top. Fails harmlessly on non-TCP sockets.
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&set, sizeof(int));
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    [_frames release];
+    [_streams release];
+    [_deferredPorts release];
+    [_lock release];
+    CFRelease(_socket);
+    
+    [super dealloc];
+}
+
+- (CFSocketRef)socket {
+    return _socket;
+}
+
+- (void)setCoalescingInterval:(unsigned int)microseconds byteBudget:(NSUInteger)bytes fragmentSize:(NSUInteger)fragmentSize {
+    [_lock lock];
+    _coalescingInterval = microseconds;
+    _byteBudget = bytes;
+    _fragmentSize = fragmentSize;
+    [_lock unlock];
+}
+
+// Must be called with _lock held; the lock is dropped whilst actually writing.
+- (BOOL)_drainBeforeTime:(double)limit {
+    BOOL result = YES;
+    _writing = YES;
+    
+    while ([_frames count] > 0 || [_streams count] > 0) {
+        NSMutableArray *batch = [[NSMutableArray alloc] initWithArray:_frames];
+        [_frames removeAllObjects];
+        _pendingBytes = 0;
+        
+        // One fragment from each stream per pass.
+        NSArray *streams = [_streams copy];
+        for (DCNSSocketWriteStream *stream in streams) {
+            [stream appendNextFragmentToArray:batch];
+            
+            if ([stream isComplete]) {
+                [_streams removeObjectIdenticalTo:stream];
+            }
+        }
+        
+        [_lock unlock];
+        result = _DCNSWriteFrames(CFSocketGetNative(_socket), batch, limit);
+        int savedErrno = errno;
+        [batch release];
+        [streams release];
+        [_lock lock];
+        
+        _lastWrite = [NSDate timeIntervalSinceReferenceDate];
+        
+        if (!result) {
+            // Anything queued behind a failed write cannot be delivered in order.
+            [_frames removeAllObjects];
+            [_streams removeAllObjects];
+            _pendingBytes = 0;
+            errno = savedErrno;
+            break;
+        }
+    }
+    
+    // Everything held back has gone out. On failure, the caller reports to these.
+    if (result)
+        [_deferredPorts removeAllObjects];
+    
+    _writing = NO;
+    return result;
+}
+
++ (void)_reportFailureToPorts:(NSSet*)ports except:(DCNSSocketPort*)except {
+    // Connections invalidate themselves when their send port does.
+    for (DCNSSocketPort *port in ports) {
+        if (port != except) {
+            [[NSNotificationCenter defaultCenter] postNotificationName:NSPortDidBecomeInvalidNotification object:port userInfo:nil];
+        }
+    }
+}
+
+- (void)_flushDeferred {
+    [_lock lock];
+    _flushScheduled = NO;
+    
+    BOOL result = YES;
+    int savedErrno = 0;
+    NSSet *ports = nil;
+    if (!_writing && ([_frames count] > 0 || [_streams count] > 0)) {
+        result = [self _drainBeforeTime:[NSDate timeIntervalSinceReferenceDate] + 10.0];
+        savedErrno = errno;
+    }
+    
+    if (!result) {
+        ports = [_deferredPorts copy];
+        [_deferredPorts removeAllObjects];
+    }
+    
+    [_lock unlock];
+    
+    if (!result) {
+        // Nobody is left to raise to, so treat it like the remote going away for everyone who queued a frame.
+        NSLog(@"[DCNSSocketPort] :: Deferred write failed with errno: %d; invalidating socket.", savedErrno);
+        CFSocketInvalidate(_socket);
+        
+        [DCNSSocketWriteQueue _reportFailureToPorts:ports except:nil];
+        [ports release];
+    }
+}
+
+- (BOOL)enqueueFrame:(NSArray*)segments to:(DCNSSocketPort*)port acceptsFragments:(BOOL)acceptsFragments beforeTime:(double)limit {
+    NSUInteger length = _DCNSLengthOfSegments(segments);
+    
+    [_lock lock];
+    
+    // Only fragment for peers that have told us they can put the pieces back together.
+    if (acceptsFragments && _fragmentSize > 0 && length > _fragmentSize) {
+        DCNSSocketWriteStream *stream = [[DCNSSocketWriteStream alloc] init];
+        stream.segments = segments;
+        stream.length = length;
+        stream.identifier = ++_nextStream;
+        stream.fragmentSize = _fragmentSize;
+        
+        [_streams addObject:stream];
+        [stream release];
+        
+        // Never worth holding back.
+        _pendingBytes += _byteBudget;
+    } else {
+        // Consecutive, so the frame still goes out in one piece.
+        [_frames addObjectsFromArray:segments];
+        _pendingBytes += length;
+    }
+    
+    // Until it is written, a failure has to be reported to the port's connections rather than to us.
+    if (port)
+        [_deferredPorts addObject:port];
+    
+    if (_writing) {
+        // The writing thread will pick this up once it is done.
+        [_lock unlock];
+        return YES;
+    }
+    
+    BOOL overBudget = _pendingBytes >= _byteBudget;
+    
+    if (!overBudget) {
+        if (_flushScheduled) {
+            [_lock unlock];
+            return YES;
+        }
+        
+        double sinceLastWrite = [NSDate timeIntervalSinceReferenceDate] - _lastWrite;
+        if (_coalescingInterval > 0 && sinceLastWrite * 1000000.0 < _coalescingInterval) {
+            // Traffic is flowing on this socket; hold back for the rest of the window.
+            _flushScheduled = YES;
+            
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)_coalescingInterval * NSEC_PER_USEC), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
+                [self _flushDeferred];
+            });
+            
+            [_lock unlock];
+            return YES;
+        }
+    }
+    
+    // Idle socket, or enough held back to be worth sending now.
+    BOOL result = [self _drainBeforeTime:limit];
+    int savedErrno = errno;
+    NSSet *ports = nil;
+    
+    if (!result) {
+        ports = [_deferredPorts copy];
+        [_deferredPorts removeAllObjects];
+    }
+    
+    [_lock unlock];
+    
+    // Our caller raises; anyone else whose frames were held back only hears of it this way.
+    if (ports) {
+        [DCNSSocketWriteQueue _reportFailureToPorts:ports except:port];
+        [ports release];
+    }
+    
+    errno = savedErrno;
+    return result;
+}
+
+@end
+
+static DCNSSocketWriteQueue *_DCNSWriteQueueForSocket(CFSocketRef socket) {
+    [_DCNSWriteQueuesLock lock];
+    
+    if (!_DCNSWriteQueues) {
+        _DCNSWriteQueues = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+    }
+    
+    DCNSSocketWriteQueue *queue = (DCNSSocketWriteQueue *)CFDictionaryGetValue(_DCNSWriteQueues, socket);
+    if (!queue) {
+        // Drop queues for any sockets that have since died, so that they don't pile up.
+        CFIndex count = CFDictionaryGetCount(_DCNSWriteQueues);
+        if (count > 0) {
+            const void **keys = malloc(sizeof(void *) * count);
+            const void **values = malloc(sizeof(void *) * count);
+            CFDictionaryGetKeysAndValues(_DCNSWriteQueues, keys, values);
+            
+            for (CFIndex i = 0; i < count; i++) {
+                if (!CFSocketIsValid([(DCNSSocketWriteQueue *)values[i] socket])) {
+                    CFDictionaryRemoveValue(_DCNSWriteQueues, keys[i]);
+                }
+            }
+            
+            free(keys);
+            free(values);
+        }
+        
+        queue = [[DCNSSocketWriteQueue alloc] initWithSocket:socket];
+        CFDictionarySetValue(_DCNSWriteQueues, socket, queue);
+        [queue release];
+    }
+    
+    [queue retain];
+    [_DCNSWriteQueuesLock unlock];
+    
+    return [queue autorelease];
+}
+
+static void _DCNSRemoveWriteQueueForSocket(CFSocketRef socket) {
+    [_DCNSWriteQueuesLock lock];
+    
+    if (_DCNSWriteQueues) {
+        CFDictionaryRemoveValue(_DCNSWriteQueues, socket);
+    }
+    
+    [_DCNSWriteQueuesLock unlock];
+}
 
 #pragma mark Initialisation
 
 @implementation DCNSSocketPort
 
-@synthesize _lock, _data, _connectors, _loops;
+@synthesize _lock, _data, _fragments, _connectors, _loops;
 
 + (void)initialize {
     if (!_DCNSSendingSocketsLock) {
@@ -393,6 +1146,40 @@ static CFMutableDictionaryRef _DCNSRemoteSocketPorts;
     if (!_DCNSRemoteSocketPortsLock) {
         _DCNSRemoteSocketPortsLock = [[NSLock alloc] init];
     }
+    
+    if (!_DCNSWriteQueuesLock) {
+        _DCNSWriteQueuesLock = [[NSLock alloc] init];
+    }
+}
+
++ (void)_applyWriteSettingsToQueues {
+    // Must be called with _DCNSWriteQueuesLock held.
+    if (_DCNSWriteQueues) {
+        CFIndex count = CFDictionaryGetCount(_DCNSWriteQueues);
+        const void **values = malloc(sizeof(void *) * MAX(count, 1));
+        CFDictionaryGetKeysAndValues(_DCNSWriteQueues, NULL, values);
+        
+        for (CFIndex i = 0; i < count; i++) {
+            [(DCNSSocketWriteQueue *)values[i] setCoalescingInterval:_DCNSWriteCoalescingInterval byteBudget:_DCNSWriteCoalescingByteBudget fragmentSize:_DCNSFragmentSize];
+        }
+        
+        free(values);
+    }
+}
+
++ (void)setWriteCoalescingInterval:(unsigned int)microseconds byteBudget:(NSUInteger)bytes {
+    [_DCNSWriteQueuesLock lock];
+    _DCNSWriteCoalescingInterval = microseconds;
+    _DCNSWriteCoalescingByteBudget = bytes;
+    [self _applyWriteSettingsToQueues];
+    [_DCNSWriteQueuesLock unlock];
+}
+
++ (void)setFragmentSize:(NSUInteger)bytes {
+    [_DCNSWriteQueuesLock lock];
+    _DCNSFragmentSize = bytes;
+    [self _applyWriteSettingsToQueues];
+    [_DCNSWriteQueuesLock unlock];
 }
 
 - (instancetype)init {
@@ -677,6 +1464,11 @@ static CFMutableDictionaryRef _DCNSRemoteSocketPorts;
         [(id)_data release];
         _data = nil;
     }
+    
+    if (_fragments) {
+        [(id)_fragments release];
+        _fragments = nil;
+    }
 
     if (_lock) {
         [_lock release];
@@ -820,17 +1612,19 @@ static CFMutableDictionaryRef _DCNSRemoteSocketPorts;
  This file is part of the mySTEP Library and is provided
  under the terms of the GNU Library General Public License.
  */
-+ (NSData *)_machMessageWithId:(NSUInteger)msgid forSendPort:(DCNSSocketPort *)sendPort receivePort:(DCNSSocketPort *)receivePort components:(NSArray *)components {
-    // Encode components as a binary message
++ (NSArray *)_machMessageWithId:(NSUInteger)msgid forSendPort:(DCNSSocketPort *)sendPort receivePort:(DCNSSocketPort *)receivePort components:(NSArray *)components {
+    // Encode components as a binary message, returned as the segments to write one after the other
     struct PortFlags port;
     
     // Some reasonable initial allocation
     NSMutableData *d = [NSMutableData dataWithCapacity:64+16*[components count]];
+    NSMutableData *first = d;
+    NSMutableArray *segments = [NSMutableArray arrayWithObject:d];
     NSEnumerator *e = [components objectEnumerator];
     id c;
     
     // Header magic
-    uint32_t value = (uint32_t)NSSwapHostIntToBig(0xd0cf50c0);
+    uint32_t value = (uint32_t)NSSwapHostIntToBig(DCNS_MESSAGE_MAGIC);
     
     // Header flags
     [d appendBytes:&value length:sizeof(uint32_t)];
@@ -864,7 +1658,16 @@ static CFMutableDictionaryRef _DCNSRemoteSocketPorts;
             
             value = (uint32_t)NSSwapHostIntToBig((unsigned int)[c length]);
             [d appendBytes:&value length:sizeof(value)];	// total record length
-            [d appendData:c];								// the data or port address
+            
+            if ([c length] >= _DCNSLargeComponentLength) {
+                // Written straight from the component; carry on with a fresh buffer behind it.
+                [segments addObject:c];
+                
+                d = [NSMutableData dataWithCapacity:64];
+                [segments addObject:d];
+            } else {
+                [d appendData:c];							// the data or port address
+            }
         } else {
             // Serialize an NSPort
             NSData *saddr = [(DCNSSocketPort *)c address];
@@ -890,10 +1693,14 @@ static CFMutableDictionaryRef _DCNSRemoteSocketPorts;
         }
     }
     
-    value = (uint32_t)NSSwapHostIntToBig((unsigned int)[d length]);
-    [d replaceBytesInRange:NSMakeRange(sizeof(uint32_t), sizeof(uint32_t)) withBytes:&value];	// insert total record length
+    if ([d length] == 0 && d != first) {
+        [segments removeLastObject];
+    }
+    
+    value = (uint32_t)NSSwapHostIntToBig((unsigned int)_DCNSLengthOfSegments(segments));
+    [first replaceBytesInRange:NSMakeRange(sizeof(uint32_t), sizeof(uint32_t)) withBytes:&value];	// insert total record length
 
-    return d;
+    return segments;
 }
 
 + (BOOL)sendBeforeTime:(double)arg1 streamData:(id)arg2 components:(NSArray*)arg3 to:(DCNSSocketPort*)arg4 from:(DCNSSocketPort*)arg5 msgid:(unsigned int)arg6 reserved:(unsigned long long)arg7 {
@@ -912,19 +1719,15 @@ static CFMutableDictionaryRef _DCNSRemoteSocketPorts;
             return NO;
         }
         
-        NSData *machMessage = [DCNSSocketPort _machMessageWithId:arg6 forSendPort:arg4 receivePort:arg5 components:arg3];
+        NSArray *machMessage = [DCNSSocketPort _machMessageWithId:(arg6 | DCNS_MSGID_ACCEPTS_FRAGMENTS) forSendPort:arg4 receivePort:arg5 components:arg3];
         
         // Example message after encoding:
         //  magic    length   msgid
         // <d0cf50c0 0000008b 00000000 1e01061c 1c1ec690 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 04edfe1f 0e010101 01010d4e 53496e76 6f636174 696f6e00 00010101 1244434e 53446973 74616e74 4f626a65 63740000 00010101 01020101 0b726f6f 744f626a 65637400 01010440 403a0008 00000000 00000000 010000>
         
-        // This does have the potential for a write error via a SIGPIPE if the remote closed its socket early.
-        // So, we set to ignore that for this socket and handle it ourselves.
-        int set = 1;
-        setsockopt(CFSocketGetNative(sendSocket), SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(int));
-        
-        CFSocketError error = CFSocketSendData(sendSocket, (CFDataRef)toAddress, (CFDataRef)machMessage, 0.0);
-        if (error != kCFSocketSuccess) {
+        // Goes out immediately if the socket is idle, otherwise it is coalesced with its neighbours.
+        DCNSSocketWriteQueue *queue = _DCNSWriteQueueForSocket(sendSocket);
+        if (![queue enqueueFrame:machMessage to:arg4 acceptsFragments:arg4->_acceptsFragments beforeTime:arg1]) {
             
             NSString *error = [NSString stringWithFormat:@"[DCNSSocketPort sendBeforeDate:] Cannot send (%d), with error code: %d", arg6, errno];
             
@@ -1083,9 +1886,11 @@ static CFMutableDictionaryRef _DCNSRemoteSocketPorts;
     NSPort *recievePort = [arg1 receivePort];
     NSPort *sendPort = [arg1 sendPort];
     
-    DCNSConnection *conn = [DCNSConnection lookUpConnectionWithReceivePort:recievePort sendPort:sendPort];
+    unsigned int channel = [arg1 msgid];
+    
+    DCNSConnection *conn = [DCNSConnection lookUpConnectionWithReceivePort:recievePort sendPort:sendPort channel:channel];
     if (recievePort && sendPort && !conn) {
-        conn = [DCNSConnection connectionWithReceivePort:recievePort sendPort:sendPort];
+        conn = [[[DCNSConnection alloc] initWithReceivePort:recievePort sendPort:sendPort channel:channel] autorelease];
     }
     
     if (!conn) {
@@ -1133,16 +1938,16 @@ static CFMutableDictionaryRef _DCNSRemoteSocketPorts;
                 memcpy(&header, buffer, sizeof(header));
                 
                 // First, check to ensure the magic is set correctly.
-                if (header.magic != NSSwapHostIntToBig(0xd0cf50c0)) {
+                if (header.magic != NSSwapHostIntToBig(DCNS_MESSAGE_MAGIC)) {
 #if DEBUG_LOG_LEVEL>=2
                     NSLog(@"[NSSocketPort _handleMessage]: bad magic");
 #endif
                     return;
                 }
                 
-                // Check the length is suitable.
+                // Check the length is suitable; large messages now arrive as fragments, but are still limited.
                 header.len = (uint32_t)NSSwapBigIntToHost(header.len);
-                if (header.len > 0x80000000) {
+                if ((CFIndex)header.len > dataLength || header.len > DCNS_MAX_MESSAGE_LENGTH) {
 #if DEBUG_LOG_LEVEL>=2
                     NSLog(@"[NSSocketPort _handleMessage]: unreasonable length");
 #endif
@@ -1152,6 +1957,9 @@ static CFMutableDictionaryRef _DCNSRemoteSocketPorts;
                 // Grab msgid from the header.
                 msgid = (unsigned int)NSSwapBigIntToHost(header.msgid);
                 
+                BOOL acceptsFragments = (msgid & DCNS_MSGID_ACCEPTS_FRAGMENTS) != 0;
+                msgid &= ~DCNS_MSGID_ACCEPTS_FRAGMENTS;
+                
                 // Total length
                 end = (char *)buffer + header.len;
                 
@@ -1196,6 +2004,11 @@ static CFMutableDictionaryRef _DCNSRemoteSocketPorts;
                     
                 recievePort = [[DCNSSocketPort alloc] initRemoteWithProtocolFamily:port.family socketType:port.type protocol:port.protocol address:addr];
                 
+                // Remote ports are shared by address, so anything else sending to this peer will see this too.
+                if (acceptsFragments) {
+                    ((DCNSSocketPort*)recievePort)->_acceptsFragments = YES;
+                }
+                
 #if DEBUG_LOG_LEVEL>=1
                 NSLog(@"Created recievePort, with key: %@", _DCNSKeyForSocket((DCNSSocketPort*)recievePort));
 #endif
@@ -1227,8 +2040,15 @@ static CFMutableDictionaryRef _DCNSRemoteSocketPorts;
                     // Decode component record.
                     switch(record.type) {
                         case 1: { // NSData
-                            // cut out and save a copy of the data fragment
-                            [components addObject:[NSData dataWithBytes:bp length:record.len]];
+                            if (record.len >= _DCNSLargeComponentLength) {
+                                // Left where it is, rather than copied out.
+                                DCNSDataSlice *slice = [[DCNSDataSlice alloc] initWithBuffer:(NSData *)arg1 range:NSMakeRange(bp - (char *)buffer, record.len)];
+                                [components addObject:slice];
+                                [slice release];
+                            } else {
+                                // cut out and save a copy of the data fragment
+                                [components addObject:[NSData dataWithBytes:bp length:record.len]];
+                            }
                             break;
                         }
                         case 2: { // decode NSPort
@@ -11,16 +11,30 @@
 
 #import <Foundation/Foundation.h>
 
+@class MethodProxy;
+
 /**
  This class acts as a wrapper around a given Class object, which in turn will be proxied across to the client process.
  */
 @interface ClassRepresentation : NSObject {
     Class _storedClass;
     const char *_className;
+    
+    NSMapTable *_signatures;        // SEL -> NSMethodSignature, for messages forwarded to the stored class
+    NSMapTable *_instanceMethods;   // SEL -> MethodProxy
+    NSMapTable *_classMethods;      // SEL -> MethodProxy
 }
 
 /** @name Lifecycle */
 
+/**
+ Gives the wrapper for the given class, creating it the first time. Always giving the same wrapper means the client
+ always gets the same proxy for a class, however often it looks it up.
+ @param classVar The class to proxy to
+ @return The wrapper for the class
+ */
++(ClassRepresentation*)representationForClass:(Class)classVar;
+
 /**
  Initialises this wrapper with the given class
  @param classVar The class to proxy to
@@ -42,4 +56,65 @@
  */
 -(const char*)storedClassName;
 
+/**
+ Gives the wrapper for a method of the wrapped class, creating it the first time.
+ @param selector The selector of the method to wrap
+ @param isInstance Whether this is an instance or class method
+ @return The wrapper around the method, or nil if the class has no such method
+ */
+-(MethodProxy*)methodProxyForSelector:(SEL)selector isInstanceMethod:(BOOL)isInstance;
+
+@end
+
+/**
+ A description of a class, sent by copy along with a proxy for its ClassRepresentation. Receiving one tells the
+ client up front the signature of each instance and class method the class defines or inherits, so that messaging
+ the class or its instances doesn't first need a round trip to ask the server for the signature of each selector.
+ 
+ Methods of the root class are left out, since every class has them; their signatures are asked for when first used.
+ */
+@interface ClassDescription : NSObject <NSCoding> {
+    ClassRepresentation *_representation;
+    NSString *_name;
+    NSArray *_superclassNames;
+    unsigned int _generation;
+}
+
+/** @name Lifecycle */
+
+/**
+ Initialises a description of the class wrapped by the given representation
+ @param representation The wrapper around the class to describe, or nil to say there is no such class
+ @param generation The server's class generation at the time of the lookup
+ @return An initialised description
+ */
+-(instancetype)initWithClassRepresentation:(ClassRepresentation*)representation generation:(unsigned int)generation;
+
+/** @name Datums */
+
+/**
+ Gives the wrapper around the described class; a proxy for it, once received by the client.
+ @return The wrapper around the described class, or nil if there is no such class.
+ */
+-(ClassRepresentation*)classRepresentation;
+
+/**
+ Gives the name of the described class.
+ @return The described class's name.
+ */
+-(NSString*)describedClassName;
+
+/**
+ Gives the names of the superclasses of the described class, nearest first.
+ @return The described class's superclass chain.
+ */
+-(NSArray*)superclassNames;
+
+/**
+ Gives the server's class generation when the class was looked up. This changes whenever the server may have gained
+ classes, so a client must forget any classes it was told don't exist.
+ @return The server's class generation.
+ */
+-(unsigned int)classGeneration;
+
 @end
@@ -10,16 +10,58 @@
 //
 
 #import "ClassRepresentation.h"
+#import "MethodProxy.h"
+#import "DCNSPortCoder.h"
+#import "DCNSPrivate.h"
+#import "DCNSConnection-NSPrivate.h"
 #import <objc/runtime.h>
 
+// Canonical wrappers by class. Classes are never unloaded, so neither are these.
+static NSMapTable *representations;
+static ClassRepresentation *nilRepresentation;
+
 @implementation ClassRepresentation
 
++(void)initialize {
+    if (self == [ClassRepresentation class]) {
+        representations = [NSMapTable mapTableWithKeyOptions:NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality
+                                                 valueOptions:NSPointerFunctionsStrongMemory];
+    }
+}
+
++(ClassRepresentation*)representationForClass:(Class)classVar {
+    ClassRepresentation *representation;
+    
+    @synchronized (representations) {
+        if (!classVar) {
+            if (!nilRepresentation)
+                nilRepresentation = [[ClassRepresentation alloc] initWithClass:Nil];
+            return nilRepresentation;
+        }
+        
+        representation = (__bridge ClassRepresentation*)NSMapGet(representations, (__bridge void*)classVar);
+        
+        if (!representation) {
+            representation = [[ClassRepresentation alloc] initWithClass:classVar];
+            NSMapInsert(representations, (__bridge void*)classVar, (__bridge void*)representation);
+        }
+    }
+    
+    return representation;
+}
+
 -(id)initWithClass:(Class)classVar {
     self = [super init];
     
     if (self) {
+        NSPointerFunctionsOptions selectors = NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality;
+        
         _storedClass = classVar;
         _className = object_getClassName(classVar);
+        
+        _signatures = [NSMapTable mapTableWithKeyOptions:selectors valueOptions:NSPointerFunctionsStrongMemory];
+        _instanceMethods = [NSMapTable mapTableWithKeyOptions:selectors valueOptions:NSPointerFunctionsStrongMemory];
+        _classMethods = [NSMapTable mapTableWithKeyOptions:selectors valueOptions:NSPointerFunctionsStrongMemory];
     }
     
     return self;
@@ -37,6 +79,25 @@
     return _className;
 }
 
+-(MethodProxy*)methodProxyForSelector:(SEL)selector isInstanceMethod:(BOOL)isInstance {
+    NSMapTable *methods = isInstance ? _instanceMethods : _classMethods;
+    MethodProxy *proxy;
+    
+    @synchronized (self) {
+        proxy = (__bridge MethodProxy*)NSMapGet(methods, selector);
+        
+        if (!proxy) {
+            proxy = [[MethodProxy alloc] initWithSelector:selector class:_storedClass isInstanceMethod:isInstance];
+            
+            // A method the class doesn't have is left for the client to remember.
+            if (proxy)
+                NSMapInsert(methods, selector, (__bridge void*)proxy);
+        }
+    }
+    
+    return proxy;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark Forward "class" methods through to the stored class
 
@@ -46,7 +107,17 @@
  */
 
 -(NSMethodSignature*)methodSignatureForSelector:(SEL)aSelector {
-    NSMethodSignature *sig = [super methodSignatureForSelector:aSelector];
+    NSMethodSignature *sig;
+    
+    // Every message from the client passes through here, so don't work it out again each time.
+    @synchronized (self) {
+        sig = (__bridge NSMethodSignature*)NSMapGet(_signatures, aSelector);
+    }
+    
+    if (sig)
+        return sig;
+    
+    sig = [super methodSignatureForSelector:aSelector];
     
     // If this class doesn't respond to the requested selector, the stored class might.
     
@@ -57,6 +128,12 @@
         sig = [NSMethodSignature signatureWithObjCTypes:typeEncoding];
     }
     
+    if (sig) {
+        @synchronized (self) {
+            NSMapInsert(_signatures, aSelector, (__bridge void*)sig);
+        }
+    }
+    
     return sig;
 }
 
@@ -76,4 +153,250 @@
     [anInvocation invokeWithTarget:_storedClass];
 }
 
+// We answer -methodDescriptionForSelector: as the stored class would, so proxies for us can share
+// the signatures the client learns with proxies for anything else that does.
+-(Class)_classForProxySignatures {
+    return object_getClass(_storedClass);
+}
+
+@end
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Class descriptions
+
+/*
+ * Sent as the class's name and superclass chain, then a table of the distinct type encodings of its methods, then
+ * its instance and class methods as a selector and an index into that table. Most methods share a handful of
+ * type encodings, so the table keeps this small. The proxy for the ClassRepresentation follows.
+ *
+ * The methods the class inherits are sent too, each in its nearest definition, but not those of the root class:
+ * every class has them, and they would only crowd out the rest. They are asked for like any other when first used.
+ *
+ * Method signatures are cached by the client against the identity of the class the server gives along with a
+ * proxy (see DCNSDistantObject), so the description carries those identities too. Either is 0 if the server
+ * wouldn't give one, in which case there's nothing to cache.
+ *
+ * A description with no class says that there is no such class. The client remembers that, until the server's
+ * class generation changes, which each description also carries.
+ */
+
+// Collects the methods defined directly by a class, except those a subclass has already overridden.
+static void _DCCollectMethods(Class c, NSMutableDictionary *methods, NSMutableArray *types, NSMutableDictionary *typeIndexes) {
+    unsigned int count, i;
+    Method *list = class_copyMethodList(c, &count);
+    
+    for (i = 0; i < count; i++) {
+        NSValue *selector = [NSValue valueWithPointer:method_getName(list[i])];
+        const char *type = method_getTypeEncoding(list[i]);
+        
+        if (!type || [methods objectForKey:selector])
+            continue;
+        
+        NSString *typeString = [NSString stringWithUTF8String:type];
+        NSNumber *index = [typeIndexes objectForKey:typeString];
+        
+        if (!index) {
+            index = [NSNumber numberWithUnsignedInteger:[types count]];
+            [types addObject:typeString];
+            [typeIndexes setObject:index forKey:typeString];
+        }
+        
+        [methods setObject:index forKey:selector];
+    }
+    
+    free(list);
+}
+
+static void _DCEncodeMethods(NSCoder *coder, NSDictionary *methods) {
+    unsigned int count = (unsigned int)[methods count];
+    
+    [coder encodeValueOfObjCType:@encode(unsigned int) at:&count];
+    
+    for (NSValue *selector in methods) {
+        SEL sel = [selector pointerValue];
+        unsigned int index = [[methods objectForKey:selector] unsignedIntValue];
+        
+        [coder encodeValueOfObjCType:@encode(SEL) at:&sel];
+        [coder encodeValueOfObjCType:@encode(unsigned int) at:&index];
+    }
+}
+
+static void _DCDecodeMethods(NSCoder *coder, NSArray *signatures, unsigned long long remoteClass, DCNSConnection *connection) {
+    unsigned int count, i;
+    
+    [coder decodeValueOfObjCType:@encode(unsigned int) at:&count];
+    
+    for (i = 0; i < count; i++) {
+        SEL sel;
+        unsigned int index;
+        
+        [coder decodeValueOfObjCType:@encode(SEL) at:&sel];
+        [coder decodeValueOfObjCType:@encode(unsigned int) at:&index];
+        
+        if (index >= [signatures count])
+            [NSException raise:NSInvalidArchiveOperationException format:@"ClassDescription: invalid type index %u", index];
+        
+        if (sel && remoteClass)
+            [DCNSDistantObject _setSignature:[signatures objectAtIndex:index] forSelector:sel remoteClass:remoteClass connection:connection];
+    }
+}
+
+static void _DCEncodeString(NSCoder *coder, const char *string) {
+    [coder encodeBytes:string length:strlen(string)+1];	// include final 0-byte
+}
+
+static const char *_DCDecodeString(NSCoder *coder) {
+    NSUInteger length;
+    const char *string = [coder decodeBytesWithReturnedLength:&length];
+    
+    if (length == 0 || string[length-1] != 0)
+        [NSException raise:NSInvalidArchiveOperationException format:@"ClassDescription: string is not terminated"];
+    
+    return string;
+}
+
+@implementation ClassDescription
+
+-(instancetype)initWithClassRepresentation:(ClassRepresentation*)representation generation:(unsigned int)generation {
+    self = [super init];
+    
+    if (self) {
+        _generation = generation;
+        
+        if (representation) {
+            Class superclass = class_getSuperclass([representation storedClass]);
+            NSMutableArray *superclassNames = [NSMutableArray array];
+            
+            for (; superclass; superclass = class_getSuperclass(superclass))
+                [superclassNames addObject:[NSString stringWithUTF8String:class_getName(superclass)]];
+            
+            _representation = representation;
+            _name = [NSString stringWithUTF8String:class_getName([representation storedClass])];
+            _superclassNames = superclassNames;
+        }
+    }
+    
+    return self;
+}
+
+-(ClassRepresentation*)classRepresentation {
+    return _representation;
+}
+
+-(NSString*)describedClassName {
+    return _name;
+}
+
+-(NSArray*)superclassNames {
+    return _superclassNames;
+}
+
+-(unsigned int)classGeneration {
+    return _generation;
+}
+
+-(NSString*)description {
+    return [NSString stringWithFormat:@"<ClassDescription> :: %@ : %@", _name, [_superclassNames componentsJoinedByString:@" : "]];
+}
+
+// Always sent by copy; it's the ClassRepresentation inside that goes by reference.
+-(id)replacementObjectForPortCoder:(DCNSPortCoder*)coder {
+    return self;
+}
+
+-(void)encodeWithCoder:(NSCoder *)coder {
+    Class storedClass = [_representation storedClass];
+    NSMutableDictionary *instanceMethods = [NSMutableDictionary dictionary];
+    NSMutableDictionary *classMethods = [NSMutableDictionary dictionary];
+    NSMutableArray *types = [NSMutableArray array];
+    NSMutableDictionary *typeIndexes = [NSMutableDictionary dictionary];
+    unsigned long long instanceClass = 0, metaClass = 0;
+    unsigned int count;
+    signed char flag = (_representation != nil);
+    Class c;
+    
+    [coder encodeValueOfObjCType:@encode(unsigned int) at:&_generation];
+    [coder encodeValueOfObjCType:@encode(signed char) at:&flag];
+    
+    if (!flag)
+        return;	// no such class
+    
+    // Classes are known to the client by a number of the connection's, not their address.
+    DCNSConnection *connection = [(DCNSPortCoder *)coder connection];
+    Class signatureClass = [storedClass _classForProxySignaturesOfInstances];
+    
+    if (signatureClass)
+        instanceClass = [connection _numberForProxyClass:signatureClass];
+    
+    signatureClass = [_representation _classForProxySignatures];
+    if (signatureClass)
+        metaClass = [connection _numberForProxyClass:signatureClass];
+    
+    // Nearest definition first, stopping short of the root class.
+    for (c = storedClass; c && class_getSuperclass(c); c = class_getSuperclass(c)) {
+        _DCCollectMethods(c, instanceMethods, types, typeIndexes);
+        _DCCollectMethods(object_getClass(c), classMethods, types, typeIndexes);
+    }
+    
+    _DCEncodeString(coder, [_name UTF8String]);
+    
+    count = (unsigned int)[_superclassNames count];
+    [coder encodeValueOfObjCType:@encode(unsigned int) at:&count];
+    for (NSString *superclassName in _superclassNames)
+        _DCEncodeString(coder, [superclassName UTF8String]);
+    
+    [coder encodeValueOfObjCType:@encode(unsigned long long) at:&instanceClass];
+    [coder encodeValueOfObjCType:@encode(unsigned long long) at:&metaClass];
+    
+    count = (unsigned int)[types count];
+    [coder encodeValueOfObjCType:@encode(unsigned int) at:&count];
+    for (NSString *type in types)
+        _DCEncodeString(coder, [type UTF8String]);
+    
+    _DCEncodeMethods(coder, instanceMethods);
+    _DCEncodeMethods(coder, classMethods);
+    
+    [coder encodeObject:_representation];
+}
+
+-(instancetype)initWithCoder:(NSCoder *)coder {
+    self = [super init];
+    
+    if (self) {
+        DCNSConnection *connection = [(DCNSPortCoder*)coder connection];
+        NSMutableArray *superclassNames = [NSMutableArray array];
+        NSMutableArray *signatures = [NSMutableArray array];
+        unsigned long long instanceClass, metaClass;
+        unsigned int count, i;
+        signed char flag;
+        
+        [coder decodeValueOfObjCType:@encode(unsigned int) at:&_generation];
+        [coder decodeValueOfObjCType:@encode(signed char) at:&flag];
+        
+        if (!flag)
+            return self;	// no such class
+        
+        _name = [NSString stringWithUTF8String:_DCDecodeString(coder)];
+        
+        [coder decodeValueOfObjCType:@encode(unsigned int) at:&count];
+        for (i = 0; i < count; i++)
+            [superclassNames addObject:[NSString stringWithUTF8String:_DCDecodeString(coder)]];
+        _superclassNames = superclassNames;
+        
+        [coder decodeValueOfObjCType:@encode(unsigned long long) at:&instanceClass];
+        [coder decodeValueOfObjCType:@encode(unsigned long long) at:&metaClass];
+        
+        [coder decodeValueOfObjCType:@encode(unsigned int) at:&count];
+        for (i = 0; i < count; i++)
+            [signatures addObject:[NSMethodSignature signatureWithObjCTypes:_DCDecodeString(coder)]];
+        
+        _DCDecodeMethods(coder, signatures, instanceClass, connection);
+        _DCDecodeMethods(coder, signatures, metaClass, connection);
+        
+        _representation = [coder decodeObject];
+    }
+    
+    return self;
+}
+
 @end
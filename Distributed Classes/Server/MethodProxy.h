@@ -14,10 +14,14 @@
 
 /**
  This class acts as a proxy for methods of the Class wrapped by ClassRepresentation.
+ 
+ It is an immutable snapshot of the method, and clients that understand this are sent it by copy. Their questions
+ about the method are then answered locally, rather than each needing a round trip to the server.
  */
-@interface MethodProxy : NSObject {
+@interface MethodProxy : NSObject <NSCoding> {
     SEL method_name;
-    Method _original;
+    char *_types;
+    unsigned int _numberOfArguments;
 }
 
 /** @name Lifecycle */
@@ -10,6 +10,8 @@
 //
 
 #import "MethodProxy.h"
+#import "DCNSPortCoder.h"
+#import "DCNSPrivate.h"
 
 @implementation MethodProxy
 
@@ -17,28 +19,36 @@
     self = [super init];
     
     if (self) {
-        method_name = selector;
+        Method original;
         
         if (isInstance) {
-            _original = class_getInstanceMethod(classVar, selector);
+            original = class_getInstanceMethod(classVar, selector);
         } else {
-            _original = class_getClassMethod(classVar, selector);
+            original = class_getClassMethod(classVar, selector);
         }
         
-        if (!_original) {
+        if (!original || !method_getTypeEncoding(original)) {
             return nil;
         }
+        
+        method_name = selector;
+        _types = strdup(method_getTypeEncoding(original));
+        _numberOfArguments = method_getNumberOfArguments(original);
     }
     
     return self;
 }
 
+-(void)dealloc {
+    free(_types);
+}
+
 -(const char*)typeEncoding {
-    return method_getTypeEncoding(_original);
+    return _types;
 }
 
 -(unsigned int)getNumberOfArguments {
-    return method_getNumberOfArguments(_original);
+    return _numberOfArguments;
 }
 
 -(SEL)getName {
@@ -46,19 +56,64 @@
 }
 
 -(char*)copyReturnType {
-    return method_copyReturnType(_original);
+    return strdup([[NSMethodSignature signatureWithObjCTypes:_types] methodReturnType]);
 }
 
 -(char*)copyArgumentType:(unsigned int)index {
-    return method_copyArgumentType(_original, index);
+    // NULL past the end, like method_copyArgumentType()
+    if (index >= _numberOfArguments)
+        return NULL;
+    
+    return strdup([[NSMethodSignature signatureWithObjCTypes:_types] getArgumentTypeAtIndex:index]);
 }
 
 -(char*)getArgumentType:(unsigned int)index {
-    return method_copyArgumentType(_original, index);
+    return [self copyArgumentType:index];
 }
 
 -(char*)getReturnType {
-    return method_copyReturnType(_original);
+    return [self copyReturnType];
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Sending by copy
+
+/*
+ * A client that can take a snapshot is sent the selector, type encoding and argument count, which is all there is
+ * to know about the method. Older clients expect a proxy, and ask it each question in turn.
+ */
+
+-(id)replacementObjectForPortCoder:(DCNSPortCoder*)coder {
+    if ([coder wireFeatures] & DCNS_WIRE_FEATURE_METHOD_SNAPSHOTS)
+        return self;
+    
+    return [super replacementObjectForPortCoder:coder];
+}
+
+-(void)encodeWithCoder:(NSCoder *)coder {
+    [coder encodeValueOfObjCType:@encode(SEL) at:&method_name];
+    [coder encodeBytes:_types length:strlen(_types)+1];	// include final 0-byte
+    [coder encodeValueOfObjCType:@encode(unsigned int) at:&_numberOfArguments];
+}
+
+-(instancetype)initWithCoder:(NSCoder *)coder {
+    self = [super init];
+    
+    if (self) {
+        NSUInteger length;
+        const char *types;
+        
+        [coder decodeValueOfObjCType:@encode(SEL) at:&method_name];
+        
+        types = [coder decodeBytesWithReturnedLength:&length];
+        if (length == 0 || types[length-1] != 0)
+            [NSException raise:NSInvalidArchiveOperationException format:@"MethodProxy: type encoding is not terminated"];
+        _types = strdup(types);
+        
+        [coder decodeValueOfObjCType:@encode(unsigned int) at:&_numberOfArguments];
+    }
+    
+    return self;
 }
 
 @end
@@ -25,6 +25,13 @@
  */
 -(ClassRepresentation*)objc_getClass:(const char*)name;
 
+/**
+ Retrieves a description of the given class name, including a wrapper around the class and the signatures of its methods.
+ @param name The name of the class to describe.
+ @return The description of the requested class, which describes no class if there is no such class.
+ */
+-(bycopy ClassDescription*)objc_getClassDescription:(const char*)name;
+
 /**
  Retrieves a wrapper around the class the given object is an instance of.
  @param object The object to find the class for.
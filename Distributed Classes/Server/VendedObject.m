@@ -14,20 +14,44 @@
 #import "MethodProxy.h"
 #import "DCNSDistantObject.h"
 #import <objc/runtime.h>
+#import <mach-o/dyld.h>
+
+// Bumped whenever an image is loaded, and with it perhaps new classes. See ClassDescription.
+static volatile int32_t classGeneration;
+
+static void imageAdded(const struct mach_header *header, intptr_t slide) {
+    __sync_fetch_and_add(&classGeneration, 1);
+}
 
 @implementation VendedObject
 
++(void)initialize {
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        // Also called straight away for every image already loaded.
+        _dyld_register_func_for_add_image(imageAdded);
+    });
+}
+
 -(ClassRepresentation*)objc_getClass:(const char*)name {
-    return [[ClassRepresentation alloc] initWithClass:objc_getClass(name)];
+    return [ClassRepresentation representationForClass:objc_getClass(name)];
+}
+
+-(ClassDescription*)objc_getClassDescription:(const char*)name {
+    // Read first, so that a class loaded in the meantime can't be missed with the new generation.
+    unsigned int generation = (unsigned int)classGeneration;
+    Class class = objc_getClass(name);
+    
+    return [[ClassDescription alloc] initWithClassRepresentation:(class ? [ClassRepresentation representationForClass:class] : nil)
+                                                      generation:generation];
 }
 
 -(ClassRepresentation*)object_getClass:(id)object {
-    return [[ClassRepresentation alloc] initWithClass:[object class]];
+    return [ClassRepresentation representationForClass:[object class]];
 }
 
 -(MethodProxy*)class_getInstanceMethod:(ClassRepresentation*)class andSelector:(SEL)selector {
-    MethodProxy *proxy = [[MethodProxy alloc] initWithSelector:selector class:[class storedClass] isInstanceMethod:YES];
-    return proxy;
+    return [class methodProxyForSelector:selector isInstanceMethod:YES];
 }
 
 -(MethodProxy*)class_getClassMethod:(ClassRepresentation*)class andSelector:(SEL)selector {
@@ -36,8 +60,7 @@
         return (MethodProxy*)class;
     }
     
-    MethodProxy *proxy = [[MethodProxy alloc] initWithSelector:selector class:[class storedClass] isInstanceMethod:NO];
-    return proxy;
+    return [class methodProxyForSelector:selector isInstanceMethod:NO];
 }
 
 @end
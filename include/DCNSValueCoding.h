@@ -0,0 +1,54 @@
+//
+//  DCNSValueCoding.h
+//  Distributed Classes
+//
+//  This file is part of the Distributed Classes Library and is provided
+//  under the terms of the GNU Lesser General Public License.
+//
+
+#ifndef _DO_H_DCNSValueCoding
+#define _DO_H_DCNSValueCoding
+
+#import <Foundation/NSObject.h>
+
+@class NSArray;
+@class NSString;
+
+/**
+ * Objects are normally passed to the remote as a proxy, so reading a small value object on the other side
+ * costs a round trip for every getter. Adopting this protocol makes instances of a class go by copy instead,
+ * as a flat copy of the instance variables that make up the value.
+ *
+ * The class says which instance variables those are by implementing one of the methods below. The layout
+ * is worked out once per class, after which instance variables are read and written directly on both sides;
+ * no accessors, <code>-init</code> or <code>-initWithCoder:</code> are called. Numbers, and structs or arrays of
+ * them, are copied in a single block. Objects, classes and selectors are encoded as they would be otherwise,
+ * and decoded objects are retained. Plain C pointers cannot be sent.
+ *
+ * Both sides must agree on the layout, so the class should be built from the same source for the same
+ * architecture at each end. A mismatch raises an exception when decoding.
+ */
+@protocol DCNSValueCoding <NSObject>
+
+@optional
+
+/**
+ The instance variables that make up the value, by name.
+ @discussion A property-style name also matches an instance variable named with a leading underscore, so
+ <code>@"origin"</code> finds <code>_origin</code>. Instance variables of superclasses may be named too.
+ @return The names of the instance variables to copy.
+ */
++(nonnull NSArray*)dc_valueCodingKeys;
+
+/**
+ The Objective-C type encoding of every instance variable declared by the class itself, in declaration order.
+ @discussion For example, <code>@"{CGPoint=dd}@q"</code>. This is checked against the runtime when the layout is
+ first worked out, and an exception raised if they differ. Used only if <code>+dc_valueCodingKeys</code> is not
+ implemented.
+ @return The type encoding of the class's instance variables.
+ */
++(nonnull NSString*)dc_valueCodingType;
+
+@end
+
+#endif
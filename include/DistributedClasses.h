@@ -47,6 +47,9 @@
 #import "DCNSBasicAuthentication.h"
 #import "DCNSConnection-Delegate.h"
 
+// Sending value objects by copy
+#import "DCNSValueCoding.h"
+
 // Server-side
 #import "DCNSServer.h"
 